@@ -0,0 +1,230 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FocusMap.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Focus surface fitted to reference points.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#include "FocusMap.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// heights per side of the sampled surface
+const int g_gridSize = 33;
+
+// Thin-plate spline kernel r^2 log r, from the squared distance
+double SplineKernel(double r2)
+{
+   return r2 > 0.0 ? 0.5 * r2 * log(r2) : 0.0;
+}
+
+// Solves a x = b in place (b becomes x) by Gaussian elimination with
+// partial pivoting.  False if a is singular.
+bool Solve(std::vector<double>& a, std::vector<double>& b, int n)
+{
+   double scale = 0.0;
+   for (size_t i = 0; i < a.size(); i++)
+      scale = std::max(scale, fabs(a[i]));
+   if (scale == 0.0)
+      return false;
+   for (int col = 0; col < n; col++)
+   {
+      int pivot = col;
+      for (int row = col + 1; row < n; row++)
+         if (fabs(a[row * n + col]) > fabs(a[pivot * n + col]))
+            pivot = row;
+      if (fabs(a[pivot * n + col]) < 1e-12 * scale)
+         return false;
+      if (pivot != col)
+      {
+         for (int k = 0; k < n; k++)
+            std::swap(a[pivot * n + k], a[col * n + k]);
+         std::swap(b[pivot], b[col]);
+      }
+      for (int row = col + 1; row < n; row++)
+      {
+         double f = a[row * n + col] / a[col * n + col];
+         if (f == 0.0)
+            continue;
+         for (int k = col; k < n; k++)
+            a[row * n + k] -= f * a[col * n + k];
+         b[row] -= f * b[col];
+      }
+   }
+   for (int row = n - 1; row >= 0; row--)
+   {
+      double sum = b[row];
+      for (int k = row + 1; k < n; k++)
+         sum -= a[row * n + k] * b[k];
+      b[row] = sum / a[row * n + row];
+   }
+   return true;
+}
+
+} // namespace
+
+FocusMap::FocusMap() :
+   mode_(FocusMapOff),
+   z0Um_(0.0),
+   dzdx_(0.0),
+   dzdy_(0.0),
+   gridX0Um_(0.0),
+   gridY0Um_(0.0),
+   gridDxUm_(1.0),
+   gridDyUm_(1.0),
+   gridSize_(0)
+{
+}
+
+bool FocusMap::Fit(FocusMapMode mode, const std::vector<FocusPoint>& points)
+{
+   Clear();
+   if (mode == FocusMapOff)
+      return true;
+   // the plane also tells whether the points span one
+   if (!FitPlane(points))
+      return false;
+   if (mode == FocusMapSurface && !FitSurface(points))
+      return false;
+   mode_ = mode;
+   return true;
+}
+
+void FocusMap::Clear()
+{
+   mode_ = FocusMapOff;
+   grid_.clear();
+   gridSize_ = 0;
+}
+
+double FocusMap::GetZUm(double xUm, double yUm) const
+{
+   if (mode_ == FocusMapPlane)
+      return z0Um_ + dzdx_ * xUm + dzdy_ * yUm;
+   if (mode_ != FocusMapSurface)
+      return 0.0;
+   double last = (double) (gridSize_ - 1);
+   double fx = std::min(std::max((xUm - gridX0Um_) / gridDxUm_, 0.0), last);
+   double fy = std::min(std::max((yUm - gridY0Um_) / gridDyUm_, 0.0), last);
+   int ix = std::min((int) fx, gridSize_ - 2);
+   int iy = std::min((int) fy, gridSize_ - 2);
+   double tx = fx - ix;
+   double ty = fy - iy;
+   const double* row0 = &grid_[iy * gridSize_ + ix];
+   const double* row1 = row0 + gridSize_;
+   return (1.0 - ty) * ((1.0 - tx) * row0[0] + tx * row0[1])
+         + ty * ((1.0 - tx) * row1[0] + tx * row1[1]);
+}
+
+// Least squares around the centroid, which keeps the sums well conditioned
+// for stage coordinates far from the origin
+bool FocusMap::FitPlane(const std::vector<FocusPoint>& points)
+{
+   size_t n = points.size();
+   if (n < 3)
+      return false;
+   double mx = 0.0, my = 0.0, mz = 0.0;
+   for (size_t i = 0; i < n; i++)
+   {
+      mx += points[i].xUm;
+      my += points[i].yUm;
+      mz += points[i].zUm;
+   }
+   mx /= n;
+   my /= n;
+   mz /= n;
+   double sxx = 0.0, sxy = 0.0, syy = 0.0, sxz = 0.0, syz = 0.0;
+   for (size_t i = 0; i < n; i++)
+   {
+      double dx = points[i].xUm - mx;
+      double dy = points[i].yUm - my;
+      double dz = points[i].zUm - mz;
+      sxx += dx * dx;
+      sxy += dx * dy;
+      syy += dy * dy;
+      sxz += dx * dz;
+      syz += dy * dz;
+   }
+   double det = sxx * syy - sxy * sxy;
+   // all on one line
+   if (det <= 1e-9 * sxx * syy || det <= 0.0)
+      return false;
+   dzdx_ = (sxz * syy - syz * sxy) / det;
+   dzdy_ = (syz * sxx - sxz * sxy) / det;
+   z0Um_ = mz - dzdx_ * mx - dzdy_ * my;
+   return true;
+}
+
+// Interpolating thin-plate spline, solved in coordinates scaled to the
+// points' bounding box, then sampled onto the grid
+bool FocusMap::FitSurface(const std::vector<FocusPoint>& points)
+{
+   int n = (int) points.size();
+   double xMin = points[0].xUm, xMax = xMin, yMin = points[0].yUm, yMax = yMin;
+   for (int i = 1; i < n; i++)
+   {
+      xMin = std::min(xMin, points[i].xUm);
+      xMax = std::max(xMax, points[i].xUm);
+      yMin = std::min(yMin, points[i].yUm);
+      yMax = std::max(yMax, points[i].yUm);
+   }
+   double cx = 0.5 * (xMin + xMax);
+   double cy = 0.5 * (yMin + yMax);
+   double scale = std::max(xMax - xMin, yMax - yMin);
+
+   // [K P; P' 0] [w; a] = [z; 0] with K the kernel between the points and
+   // P the rows (1, u, v)
+   int m = n + 3;
+   std::vector<double> a(m * m, 0.0);
+   std::vector<double> b(m, 0.0);
+   std::vector<double> u(n), v(n);
+   for (int i = 0; i < n; i++)
+   {
+      u[i] = (points[i].xUm - cx) / scale;
+      v[i] = (points[i].yUm - cy) / scale;
+   }
+   for (int i = 0; i < n; i++)
+   {
+      for (int j = 0; j < n; j++)
+      {
+         double du = u[i] - u[j];
+         double dv = v[i] - v[j];
+         a[i * m + j] = SplineKernel(du * du + dv * dv);
+      }
+      a[i * m + n] = a[n * m + i] = 1.0;
+      a[i * m + n + 1] = a[(n + 1) * m + i] = u[i];
+      a[i * m + n + 2] = a[(n + 2) * m + i] = v[i];
+      b[i] = points[i].zUm;
+   }
+   // repeated points make the system singular
+   if (!Solve(a, b, m))
+      return false;
+
+   gridSize_ = g_gridSize;
+   gridX0Um_ = xMin;
+   gridY0Um_ = yMin;
+   gridDxUm_ = (xMax - xMin) / (gridSize_ - 1);
+   gridDyUm_ = (yMax - yMin) / (gridSize_ - 1);
+   grid_.resize(gridSize_ * gridSize_);
+   for (int iy = 0; iy < gridSize_; iy++)
+   {
+      double gv = (gridY0Um_ + iy * gridDyUm_ - cy) / scale;
+      for (int ix = 0; ix < gridSize_; ix++)
+      {
+         double gu = (gridX0Um_ + ix * gridDxUm_ - cx) / scale;
+         double z = b[n] + b[n + 1] * gu + b[n + 2] * gv;
+         for (int i = 0; i < n; i++)
+         {
+            double du = gu - u[i];
+            double dv = gv - v[i];
+            z += b[i] * SplineKernel(du * du + dv * dv);
+         }
+         grid_[iy * gridSize_ + ix] = z;
+      }
+   }
+   return true;
+}
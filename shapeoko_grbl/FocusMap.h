@@ -0,0 +1,60 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FocusMap.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Focus surface fitted to (x, y, z) reference points, so that
+//                the hub can move Z along with every XY move.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifndef _FOCUS_MAP_H_
+#define _FOCUS_MAP_H_
+
+#include <vector>
+
+enum FocusMapMode
+{
+   FocusMapOff,
+   FocusMapPlane,        // least-squares plane
+   FocusMapSurface       // thin-plate spline through the points
+};
+
+struct FocusPoint
+{
+   double xUm, yUm, zUm;
+};
+
+// The spline is only solved when fitting; it is then sampled onto a grid
+// over the points' bounding box, so that a lookup is a bilinear
+// interpolation whatever the number of points.  Outside the box the
+// surface keeps the height of its edge rather than extrapolating.
+class FocusMap
+{
+public:
+   FocusMap();
+
+   // False, leaving the map off, for fewer than three points or points
+   // that do not span a plane (all on one line, or repeated for a surface)
+   bool Fit(FocusMapMode mode, const std::vector<FocusPoint>& points);
+   void Clear();
+   FocusMapMode GetMode() const { return mode_; }
+   bool IsEnabled() const { return mode_ != FocusMapOff; }
+
+   double GetZUm(double xUm, double yUm) const;
+
+private:
+   bool FitPlane(const std::vector<FocusPoint>& points);
+   bool FitSurface(const std::vector<FocusPoint>& points);
+
+   FocusMapMode mode_;
+   // plane: z = z0 + dzdx * x + dzdy * y
+   double z0Um_, dzdx_, dzdy_;
+   // surface: gridSize_ x gridSize_ heights, row by row in y
+   double gridX0Um_, gridY0Um_;
+   double gridDxUm_, gridDyUm_;
+   int gridSize_;
+   std::vector<double> grid_;
+};
+
+#endif // _FOCUS_MAP_H_
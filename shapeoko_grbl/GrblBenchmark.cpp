@@ -0,0 +1,407 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblBenchmark.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Measurements of the adapter's own overhead.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#include "GrblBenchmark.h"
+#include "GrblStatusReport.h"
+#include "ShapeokoGrbl.h"
+#include "XYStage.h"
+#include "ZStage.h"
+#include "DeviceUtils.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// The status parser the hub used before ParseGrblStatusReport; kept as the
+// reference point.  Only understands 0.9 reports.
+bool LegacyParseStatus(const std::string& returnString, std::string& state, double* MPos, double* WPos)
+{
+   std::vector<std::string> tokenInput;
+   CDeviceUtils::Tokenize(returnString, tokenInput, "<>,:\r\n");
+   if (tokenInput.size() != 9)
+      return false;
+   state.assign(tokenInput[0].c_str());
+   for (int i = 0; i < 3; i++)
+   {
+      std::istringstream m(tokenInput[2 + i]);
+      m >> MPos[i];
+      std::istringstream w(tokenInput[6 + i]);
+      w >> WPos[i];
+   }
+   return true;
+}
+
+double Seconds(std::chrono::steady_clock::time_point start)
+{
+   return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Collects per-call wall times and the CPU time of one benchmark phase
+class PhaseTimer
+{
+public:
+   PhaseTimer() : start_(std::chrono::steady_clock::now()), cpuStart_(std::clock()) {}
+
+   void BeginCall() { call_ = std::chrono::steady_clock::now(); }
+   void EndCall() { samplesMs_.push_back(Seconds(call_) * 1000.0); }
+   // takes over the calls timed by another thread
+   void Add(const PhaseTimer& other)
+   {
+      samplesMs_.insert(samplesMs_.end(), other.samplesMs_.begin(), other.samplesMs_.end());
+   }
+
+   void Finish(BenchmarkPhase& phase)
+   {
+      double seconds = Seconds(start_);
+      double cpuMs = 1000.0 * (std::clock() - cpuStart_) / CLOCKS_PER_SEC;
+      phase.calls = (long) samplesMs_.size();
+      phase.perSec = seconds > 0 ? samplesMs_.size() / seconds : 0.0;
+      phase.cpuMsPerCall = samplesMs_.empty() ? 0.0 : cpuMs / samplesMs_.size();
+      std::sort(samplesMs_.begin(), samplesMs_.end());
+      double sum = 0.0;
+      for (size_t i = 0; i < samplesMs_.size(); i++)
+         sum += samplesMs_[i];
+      phase.meanMs = samplesMs_.empty() ? 0.0 : sum / samplesMs_.size();
+      phase.p50Ms = Percentile(0.50);
+      phase.p90Ms = Percentile(0.90);
+      phase.p99Ms = Percentile(0.99);
+      phase.maxMs = samplesMs_.empty() ? 0.0 : samplesMs_.back();
+   }
+
+private:
+   double Percentile(double p) const
+   {
+      if (samplesMs_.empty())
+         return 0.0;
+      size_t i = (size_t) ceil(p * samplesMs_.size());
+      return samplesMs_[std::min(samplesMs_.size(), std::max((size_t) 1, i)) - 1];
+   }
+
+   std::chrono::steady_clock::time_point start_;
+   std::chrono::steady_clock::time_point call_;
+   std::clock_t cpuStart_;
+   std::vector<double> samplesMs_;
+};
+
+bool WaitForIdle(MM::Device& stage, double timeoutMs)
+{
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   while (stage.Busy())
+   {
+      if (Seconds(start) * 1000.0 > timeoutMs)
+         return false;
+      CDeviceUtils::SleepMs(1);
+   }
+   return true;
+}
+
+void ZeroPhase(BenchmarkPhase& phase)
+{
+   memset(&phase, 0, sizeof(phase));
+}
+
+void AppendPhaseJson(std::string& json, const char* name, const BenchmarkPhase& phase, bool last)
+{
+   char buf[400];
+   snprintf(buf, sizeof(buf),
+         "  \"%s\": {\"calls\": %ld, \"perSec\": %.3f, \"meanMs\": %.3f, \"p50Ms\": %.3f, "
+         "\"p90Ms\": %.3f, \"p99Ms\": %.3f, \"maxMs\": %.3f, \"cpuMsPerCall\": %.4f}%s\n",
+         name, phase.calls, phase.perSec, phase.meanMs, phase.p50Ms, phase.p90Ms, phase.p99Ms,
+         phase.maxMs, phase.cpuMsPerCall, last ? "" : ",");
+   json += buf;
+}
+
+const double g_benchmarkMoveTimeoutMs = 10000.0;
+
+// Commands of the stress benchmark and how their replies look
+struct StressCommand
+{
+   const char* line;
+   const char* expected;   // text in the reply, or 0 for a bare 'ok'
+   bool error;
+};
+
+const StressCommand g_stressCommands[] = {
+   {"G4 P0", 0, false},
+   {"$G", "G54", false},
+   {"$#", "G92:", false},
+   {"G999", 0, true}
+};
+
+bool IsExpectedReply(const StressCommand& command, const std::string& answer)
+{
+   if (command.error)
+      return ShapeokoGrblHub::IsErrorAnswer(answer);
+   if (ShapeokoGrblHub::IsErrorAnswer(answer))
+      return false;
+   if (command.expected == 0)
+      return answer == "ok";
+   return answer.find(command.expected) != std::string::npos;
+}
+
+struct StressThread
+{
+   StressThread() : mismatched(0), failed(0) {}
+   PhaseTimer timer;
+   long mismatched;
+   long failed;
+};
+
+void RunStressThread(ShapeokoGrblHub* hub, long index, long commands, StressThread* out)
+{
+   const long nCommands = (long) (sizeof(g_stressCommands) / sizeof(g_stressCommands[0]));
+   for (long n = 0; n < commands; n++)
+   {
+      if (index == 0 && n % 4 == 3)
+      {
+         if (hub->GetStatus() != DEVICE_OK)
+            out->failed++;
+         continue;
+      }
+      // threads walk through the commands out of step with each other
+      const StressCommand& command = g_stressCommands[(n * 3 + index) % nCommands];
+      std::string answer;
+      out->timer.BeginCall();
+      int ret = hub->ExecuteCommand(command.line, answer, 2000);
+      out->timer.EndCall();
+      if (ret != DEVICE_OK)
+         out->failed++;
+      else if (!IsExpectedReply(command, answer))
+         out->mismatched++;
+   }
+}
+
+} // namespace
+
+void RunParserBenchmark(long iterations, ParserBenchmarkResult& result)
+{
+   static const char* reports[] = {
+      "<Idle,MPos:0.000,0.000,0.000,WPos:0.000,0.000,0.000>",
+      "<Run,MPos:-123.456,78.900,-1.250,WPos:-23.456,8.900,-0.250>",
+      "<Idle|MPos:12.000,-4.500,0.000|Bf:15,128|FS:0,0|WCO:0.000,0.000,0.000>",
+      "<Run|MPos:-123.456,78.900,-1.250|Bf:11,87|FS:1500,0|Ov:100,100,100|A:F>"
+   };
+   const int nReports = sizeof(reports) / sizeof(reports[0]);
+   std::string legacyInput[nReports];
+   size_t lengths[nReports];
+   for (int i = 0; i < nReports; i++)
+   {
+      legacyInput[i] = reports[i];
+      lengths[i] = strlen(reports[i]);
+   }
+
+   result.iterations = iterations;
+   double sink = 0.0;
+
+   std::string state;
+   double MPos[3], WPos[3];
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   for (long n = 0; n < iterations; n++)
+   {
+      if (LegacyParseStatus(legacyInput[n % nReports], state, MPos, WPos))
+         sink += MPos[0];
+   }
+   double legacySeconds = Seconds(start);
+
+   GrblStatusReport report;
+   start = std::chrono::steady_clock::now();
+   for (long n = 0; n < iterations; n++)
+   {
+      int i = (int) (n % nReports);
+      if (ParseGrblStatusReport(reports[i], lengths[i], report))
+         sink += report.MPos[0] + report.WPos[0];
+   }
+   double seconds = Seconds(start);
+
+   // keep the loops from being optimized away
+   if (sink == 0.12345)
+      result.iterations++;
+
+   result.legacyReportsPerSec = legacySeconds > 0 ? iterations / legacySeconds : 0.0;
+   result.reportsPerSec = seconds > 0 ? iterations / seconds : 0.0;
+}
+
+std::string FormatParserBenchmark(const ParserBenchmarkResult& result)
+{
+   char buf[256];
+   snprintf(buf, sizeof(buf), "%ld reports: legacy %.0f/s, in-place %.0f/s (%.1fx)",
+         result.iterations, result.legacyReportsPerSec, result.reportsPerSec,
+         result.legacyReportsPerSec > 0 ? result.reportsPerSec / result.legacyReportsPerSec : 0.0);
+   return buf;
+}
+
+int RunAdapterBenchmark(ShapeokoGrblHub& hub, CShapeokoGrblXYStage& xyStage, ZStage& zStage,
+      long moves, AdapterBenchmarkResult& result)
+{
+   result.initializeMs = hub.GetInitializeMs();
+   result.detectDeviceMs = hub.GetDetectDeviceMs();
+   result.streamingMode = hub.IsCharacterCounting() ? "Character-counting" : "Lock-step";
+   ZeroPhase(result.status);
+   ZeroPhase(result.absoluteMoves);
+   ZeroPhase(result.relativeMoves);
+   ZeroPhase(result.zPlanes);
+   result.moveLines = result.moveBytes = result.legacyMoveBytes = 0;
+   if (!WaitForIdle(xyStage, g_benchmarkMoveTimeoutMs))
+      return ERR_COMMUNICATION;
+
+   PhaseTimer statusTimer;
+   for (long n = 0; n < 10 * moves; n++)
+   {
+      statusTimer.BeginCall();
+      int ret = hub.GetStatus();
+      statusTimer.EndCall();
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+   statusTimer.Finish(result.status);
+
+   double x0 = hub.GetCommandedPositionUm(0);
+   double y0 = hub.GetCommandedPositionUm(1);
+   double z0 = hub.GetCommandedPositionUm(2);
+   const double stepUm = 100.0;
+   const double zStepUm = 10.0;
+   long lines0, bytes0, legacyBytes0;
+   hub.GetMoveEncoderStats(lines0, bytes0, legacyBytes0);
+
+   // through the stage devices, as the core drives them
+   PhaseTimer absoluteTimer;
+   for (long n = 0; n < moves; n++)
+   {
+      double offset = (n % 2 == 0) ? stepUm : 0.0;
+      absoluteTimer.BeginCall();
+      int ret = xyStage.SetPositionUm(x0 + offset, y0 + offset);
+      if (ret != DEVICE_OK)
+         return ret;
+      if (!WaitForIdle(xyStage, g_benchmarkMoveTimeoutMs))
+         return ERR_COMMUNICATION;
+      absoluteTimer.EndCall();
+   }
+   absoluteTimer.Finish(result.absoluteMoves);
+
+   PhaseTimer relativeTimer;
+   for (long n = 0; n < moves; n++)
+   {
+      double step = (n % 2 == 0) ? stepUm : -stepUm;
+      relativeTimer.BeginCall();
+      int ret = xyStage.SetRelativePositionUm(step, 0);
+      if (ret != DEVICE_OK)
+         return ret;
+      if (!WaitForIdle(xyStage, g_benchmarkMoveTimeoutMs))
+         return ERR_COMMUNICATION;
+      relativeTimer.EndCall();
+   }
+   relativeTimer.Finish(result.relativeMoves);
+
+   PhaseTimer zTimer;
+   for (long n = 0; n < moves; n++)
+   {
+      zTimer.BeginCall();
+      int ret = zStage.SetPositionUm(z0 + (n + 1) * zStepUm);
+      if (ret != DEVICE_OK)
+         return ret;
+      if (!WaitForIdle(zStage, g_benchmarkMoveTimeoutMs))
+         return ERR_COMMUNICATION;
+      zTimer.EndCall();
+   }
+   zTimer.Finish(result.zPlanes);
+   hub.GetMoveEncoderStats(result.moveLines, result.moveBytes, result.legacyMoveBytes);
+   result.moveLines -= lines0;
+   result.moveBytes -= bytes0;
+   result.legacyMoveBytes -= legacyBytes0;
+
+   int ret = hub.MoveTo(true, x0, true, y0, true, z0);
+   if (ret != DEVICE_OK)
+      return ret;
+   return WaitForIdle(xyStage, g_benchmarkMoveTimeoutMs) ? DEVICE_OK : ERR_COMMUNICATION;
+}
+
+std::string FormatAdapterBenchmarkJson(const AdapterBenchmarkResult& result)
+{
+   char buf[300];
+   std::string json = "{\n";
+   snprintf(buf, sizeof(buf), "  \"firmware\": \"%s\",\n  \"streamingMode\": \"%s\",\n"
+         "  \"initializeMs\": %.3f,\n  \"detectDeviceMs\": %.3f,\n",
+         result.firmware.c_str(), result.streamingMode.c_str(), result.initializeMs, result.detectDeviceMs);
+   json += buf;
+   AppendPhaseJson(json, "status", result.status, false);
+   AppendPhaseJson(json, "absoluteMoves", result.absoluteMoves, false);
+   AppendPhaseJson(json, "relativeMoves", result.relativeMoves, false);
+   AppendPhaseJson(json, "zPlanes", result.zPlanes, false);
+   snprintf(buf, sizeof(buf), "  \"moveLines\": %ld,\n  \"moveBytes\": %ld,\n  \"legacyMoveBytes\": %ld\n",
+         result.moveLines, result.moveBytes, result.legacyMoveBytes);
+   json += buf;
+   json += "}\n";
+   return json;
+}
+
+std::string FormatAdapterBenchmark(const AdapterBenchmarkResult& result)
+{
+   char buf[256];
+   double saved = result.legacyMoveBytes > 0 ?
+         100.0 * (result.legacyMoveBytes - result.moveBytes) / result.legacyMoveBytes : 0.0;
+   snprintf(buf, sizeof(buf), "status p50 %.2f ms p99 %.2f ms, %.1f abs moves/s, %.1f rel moves/s, %.1f z planes/s, "
+         "%.1f bytes/move (%.0f%% less)",
+         result.status.p50Ms, result.status.p99Ms, result.absoluteMoves.perSec,
+         result.relativeMoves.perSec, result.zPlanes.perSec,
+         result.moveLines > 0 ? (double) result.moveBytes / result.moveLines : 0.0, saved);
+   return buf;
+}
+
+int RunStressBenchmark(ShapeokoGrblHub& hub, long threads, long commandsPerThread, StressBenchmarkResult& result)
+{
+   result.threads = threads;
+   result.mismatched = 0;
+   result.failed = 0;
+   ZeroPhase(result.commands);
+   if (!WaitForIdle(hub, g_benchmarkMoveTimeoutMs))
+      return ERR_COMMUNICATION;
+
+   PhaseTimer timer;
+   std::vector<StressThread> outputs(threads);
+   std::vector<std::thread> workers;
+   for (long i = 0; i < threads; i++)
+      workers.push_back(std::thread(RunStressThread, &hub, i, commandsPerThread, &outputs[i]));
+   for (long i = 0; i < threads; i++)
+   {
+      workers[i].join();
+      timer.Add(outputs[i].timer);
+      result.mismatched += outputs[i].mismatched;
+      result.failed += outputs[i].failed;
+   }
+   timer.Finish(result.commands);
+   return DEVICE_OK;
+}
+
+std::string FormatStressBenchmarkJson(const StressBenchmarkResult& result)
+{
+   char buf[200];
+   std::string json = "{\n";
+   snprintf(buf, sizeof(buf), "  \"threads\": %ld,\n  \"mismatched\": %ld,\n  \"failed\": %ld,\n",
+         result.threads, result.mismatched, result.failed);
+   json += buf;
+   AppendPhaseJson(json, "commands", result.commands, true);
+   json += "}\n";
+   return json;
+}
+
+std::string FormatStressBenchmark(const StressBenchmarkResult& result)
+{
+   char buf[256];
+   snprintf(buf, sizeof(buf), "%ld threads: %.0f commands/s, p50 %.2f ms p99 %.2f ms, %ld mismatched, %ld failed",
+         result.threads, result.commands.perSec, result.commands.p50Ms, result.commands.p99Ms,
+         result.mismatched, result.failed);
+   return buf;
+}
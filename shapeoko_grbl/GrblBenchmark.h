@@ -0,0 +1,86 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblBenchmark.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Measurements of the adapter's own overhead, run by the
+//                grbl_bench and grbl_stress_test targets against the
+//                simulated controller.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifndef _GRBL_BENCHMARK_H_
+#define _GRBL_BENCHMARK_H_
+
+#include <string>
+
+class ShapeokoGrblHub;
+class CShapeokoGrblXYStage;
+class ZStage;
+
+struct ParserBenchmarkResult
+{
+   long iterations;
+   double legacyReportsPerSec;   // Tokenize + istringstream, as before
+   double reportsPerSec;         // ParseGrblStatusReport
+};
+
+// Parses a fixed mix of 0.9 and 1.1 reports with both parsers.
+void RunParserBenchmark(long iterations, ParserBenchmarkResult& result);
+std::string FormatParserBenchmark(const ParserBenchmarkResult& result);
+
+// Per-phase timings of the adapter benchmark.  Times are wall clock, CPU
+// time is process time from std::clock().
+struct BenchmarkPhase
+{
+   long calls;
+   double perSec;
+   double meanMs;
+   double p50Ms;
+   double p90Ms;
+   double p99Ms;
+   double maxMs;
+   double cpuMsPerCall;
+};
+
+struct AdapterBenchmarkResult
+{
+   std::string firmware;
+   std::string streamingMode;
+   double initializeMs;
+   double detectDeviceMs;          // DetectDevice() against the port, before Initialize()
+   BenchmarkPhase status;          // '?' round trips
+   BenchmarkPhase absoluteMoves;   // XY moves to alternating targets, until idle
+   BenchmarkPhase relativeMoves;   // relative XY steps, until idle
+   BenchmarkPhase zPlanes;         // Z steps as in a z-stack, until idle
+   long moveLines;                 // move lines MoveTo() sent
+   long moveBytes;                 // their bytes on the wire
+   long legacyMoveBytes;           // the same moves as "G0 X%f Y%f"
+};
+
+// Status queries through the hub, then small XY and Z moves around the
+// current position through the stage devices, each waited for with the
+// stage's Busy(); the position is restored at the end.  Meant for the
+// simulated controller; on hardware the stage really moves.
+int RunAdapterBenchmark(ShapeokoGrblHub& hub, CShapeokoGrblXYStage& xyStage, ZStage& zStage,
+      long moves, AdapterBenchmarkResult& result);
+std::string FormatAdapterBenchmarkJson(const AdapterBenchmarkResult& result);
+std::string FormatAdapterBenchmark(const AdapterBenchmarkResult& result);
+
+struct StressBenchmarkResult
+{
+   long threads;
+   long mismatched;     // replies that do not belong to the command sent
+   long failed;         // calls that timed out or could not be sent
+   BenchmarkPhase commands;
+};
+
+// Several threads send commands through ExecuteCommand at once: lines
+// answered with 'ok', with a message and 'ok', and with 'error:', while
+// the first thread also queries the status.  Every reply is checked
+// against the command it was returned for.
+int RunStressBenchmark(ShapeokoGrblHub& hub, long threads, long commandsPerThread, StressBenchmarkResult& result);
+std::string FormatStressBenchmarkJson(const StressBenchmarkResult& result);
+std::string FormatStressBenchmark(const StressBenchmarkResult& result);
+
+#endif // _GRBL_BENCHMARK_H_
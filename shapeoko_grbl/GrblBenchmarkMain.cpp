@@ -0,0 +1,82 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblBenchmarkMain.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   grbl_bench: times the status parser, then runs the adapter
+//                benchmark on the hub and stages against the simulated
+//                controller and writes the result as JSON.
+//
+//                grbl_bench [-f 0.9j|1.1f] [-s Lock-step|Character-counting]
+//                           [-n moves] [-o file.json] [-v]
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#include "GrblBenchmark.h"
+#include "GrblTestCore.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+int main(int argc, char** argv)
+{
+   std::string firmware = "1.1f";
+   std::string streamingMode = "Character-counting";
+   long moves = 20;
+   std::string outputFile = "grbl_bench.json";
+   bool verbose = false;
+   for (int i = 1; i < argc; i++)
+   {
+      bool hasValue = i + 1 < argc;
+      if (strcmp(argv[i], "-f") == 0 && hasValue)
+         firmware = argv[++i];
+      else if (strcmp(argv[i], "-s") == 0 && hasValue)
+         streamingMode = argv[++i];
+      else if (strcmp(argv[i], "-n") == 0 && hasValue)
+         moves = atol(argv[++i]);
+      else if (strcmp(argv[i], "-o") == 0 && hasValue)
+         outputFile = argv[++i];
+      else if (strcmp(argv[i], "-v") == 0)
+         verbose = true;
+      else
+      {
+         fprintf(stderr, "usage: %s [-f 0.9j|1.1f] [-s Lock-step|Character-counting] [-n moves] [-o file.json] [-v]\n", argv[0]);
+         return 2;
+      }
+   }
+
+   ParserBenchmarkResult parser;
+   RunParserBenchmark(1000000, parser);
+   printf("parser: %s\n", FormatParserBenchmark(parser).c_str());
+
+   GrblTestCore core;
+   core.SetVerbose(verbose);
+   int ret = core.Open(firmware.c_str(), streamingMode.c_str());
+   if (ret != DEVICE_OK)
+   {
+      fprintf(stderr, "cannot open the simulated controller: error %d\n", ret);
+      return 1;
+   }
+   AdapterBenchmarkResult result;
+   result.firmware = firmware;
+   ret = RunAdapterBenchmark(*core.GetHub(), *core.GetXYStage(), *core.GetZStage(), moves, result);
+   core.Close();
+   if (ret != DEVICE_OK)
+   {
+      fprintf(stderr, "benchmark failed: error %d\n", ret);
+      return 1;
+   }
+   printf("adapter: %s\n", FormatAdapterBenchmark(result).c_str());
+
+   FILE* file = fopen(outputFile.c_str(), "w");
+   if (file == 0)
+   {
+      fprintf(stderr, "cannot write %s\n", outputFile.c_str());
+      return 1;
+   }
+   std::string json = FormatAdapterBenchmarkJson(result);
+   fwrite(json.data(), 1, json.size(), file);
+   fclose(file);
+   return 0;
+}
@@ -0,0 +1,75 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblCommandQueue.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Lock-free multi-producer, single-consumer queue through
+//                which callers hand lines to the hub's serial I/O thread.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifndef _GRBL_COMMAND_QUEUE_H_
+#define _GRBL_COMMAND_QUEUE_H_
+
+#include <atomic>
+
+// Linked list with a dummy node (after D. Vyukov's MPSC queue).  Push()
+// never blocks and may be called from any number of threads; items pushed
+// by one thread come out in the order they were pushed.  Pop() and
+// IsEmpty() must not be called by two threads at the same time.  A push
+// that is still in progress may not be visible to Pop() yet.
+template <class T>
+class MpscQueue
+{
+public:
+   MpscQueue() : head_(new Node()), tail_(head_.load()) {}
+
+   ~MpscQueue()
+   {
+      T item;
+      while (Pop(item))
+         ;
+      delete tail_;
+   }
+
+   void Push(const T& item)
+   {
+      Node* node = new Node(item);
+      Node* previous = head_.exchange(node, std::memory_order_acq_rel);
+      previous->next.store(node, std::memory_order_release);
+   }
+
+   bool Pop(T& item)
+   {
+      Node* next = tail_->next.load(std::memory_order_acquire);
+      if (next == 0)
+         return false;
+      item = next->item;
+      // the popped node becomes the new dummy
+      delete tail_;
+      tail_ = next;
+      return true;
+   }
+
+   bool IsEmpty() const
+   {
+      return tail_->next.load(std::memory_order_acquire) == 0;
+   }
+
+private:
+   struct Node
+   {
+      Node() : next(0) {}
+      explicit Node(const T& value) : item(value), next(0) {}
+      T item;
+      std::atomic<Node*> next;
+   };
+
+   MpscQueue(const MpscQueue&);
+   MpscQueue& operator=(const MpscQueue&);
+
+   std::atomic<Node*> head_;
+   Node* tail_;
+};
+
+#endif // _GRBL_COMMAND_QUEUE_H_
@@ -0,0 +1,166 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblJobFile.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Memory-mapped G-code program file.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifdef WIN32
+   #include <windows.h>
+#else
+   #include <fcntl.h>
+   #include <sys/mman.h>
+   #include <sys/stat.h>
+   #include <unistd.h>
+#endif
+#include "GrblJobFile.h"
+#include <cctype>
+#include <cstring>
+
+GrblJobFile::GrblJobFile() :
+   open_(false),
+   data_(0),
+   size_(0),
+   offset_(0),
+   lineNumber_(0),
+#ifdef WIN32
+   file_(INVALID_HANDLE_VALUE),
+   mapping_(0)
+#else
+   fd_(-1)
+#endif
+{
+}
+
+GrblJobFile::~GrblJobFile()
+{
+   Close();
+}
+
+bool GrblJobFile::Open(const std::string& path)
+{
+   Close();
+#ifdef WIN32
+   file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0,
+         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+   if (file_ == INVALID_HANDLE_VALUE)
+      return false;
+   LARGE_INTEGER size;
+   if (!GetFileSizeEx(file_, &size))
+   {
+      Close();
+      return false;
+   }
+   size_ = (uint64_t) size.QuadPart;
+   if (size_ > 0)
+   {
+      mapping_ = CreateFileMappingA(file_, 0, PAGE_READONLY, 0, 0, 0);
+      if (mapping_ != 0)
+         data_ = (const char*) MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+      if (data_ == 0)
+      {
+         Close();
+         return false;
+      }
+   }
+#else
+   fd_ = open(path.c_str(), O_RDONLY);
+   if (fd_ < 0)
+      return false;
+   struct stat info;
+   if (fstat(fd_, &info) != 0)
+   {
+      Close();
+      return false;
+   }
+   size_ = (uint64_t) info.st_size;
+   if (size_ > 0)
+   {
+      void* data = mmap(0, (size_t) size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+      if (data == MAP_FAILED)
+      {
+         Close();
+         return false;
+      }
+      // read once, front to back: let the kernel read ahead and drop
+      // pages behind the cursor
+      madvise(data, (size_t) size_, MADV_SEQUENTIAL);
+      data_ = (const char*) data;
+   }
+#endif
+   open_ = true;
+   path_ = path;
+   Rewind();
+   return true;
+}
+
+void GrblJobFile::Close()
+{
+#ifdef WIN32
+   if (data_ != 0)
+      UnmapViewOfFile(data_);
+   if (mapping_ != 0)
+      CloseHandle(mapping_);
+   if (file_ != INVALID_HANDLE_VALUE)
+      CloseHandle(file_);
+   mapping_ = 0;
+   file_ = INVALID_HANDLE_VALUE;
+#else
+   if (data_ != 0)
+      munmap((void*) data_, (size_t) size_);
+   if (fd_ >= 0)
+      close(fd_);
+   fd_ = -1;
+#endif
+   data_ = 0;
+   size_ = 0;
+   open_ = false;
+   path_.clear();
+   Rewind();
+}
+
+void GrblJobFile::Rewind()
+{
+   offset_ = 0;
+   lineNumber_ = 0;
+}
+
+bool GrblJobFile::NextLine(std::string& line, long& lineNumber, uint64_t& endOffset)
+{
+   line.clear();
+   while (offset_ < size_)
+   {
+      const char* start = data_ + offset_;
+      const char* end = (const char*) memchr(start, '\n', (size_t) (size_ - offset_));
+      size_t length = end != 0 ? (size_t) (end - start) : (size_t) (size_ - offset_);
+      offset_ += length + (end != 0 ? 1 : 0);
+      lineNumber_++;
+
+      // "(...)" comments end at the parenthesis, ';' comments at the end
+      // of the line
+      bool inComment = false;
+      for (size_t i = 0; i < length; i++)
+      {
+         char c = start[i];
+         if (inComment)
+            inComment = (c != ')');
+         else if (c == '(')
+            inComment = true;
+         else if (c == ';')
+            break;
+         else if (!isspace((unsigned char) c))
+            line += c;
+      }
+      if (line == "%")
+         line.clear();
+      if (!line.empty())
+      {
+         lineNumber = lineNumber_;
+         endOffset = offset_;
+         return true;
+      }
+   }
+   return false;
+}
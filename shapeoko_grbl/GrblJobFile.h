@@ -0,0 +1,63 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblJobFile.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   G-code program file for the hub's job runner.  The file is
+//                memory-mapped and read one line at a time, so a program of
+//                any size streams without being loaded as a whole.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifndef _GRBL_JOB_FILE_H_
+#define _GRBL_JOB_FILE_H_
+
+#include <string>
+#include <stdint.h>
+
+////////////////////////
+// GrblJobFile
+// Read-only mapping of a G-code file with a cursor.  NextLine() hands out
+// the lines as the controller should get them: comments, whitespace and
+// '%' program delimiters are removed and lines left empty are skipped.
+//////////////////////
+
+class GrblJobFile
+{
+public:
+   GrblJobFile();
+   ~GrblJobFile();
+
+   bool Open(const std::string& path);
+   void Close();
+   bool IsOpen() const { return open_; }
+   const std::string& GetPath() const { return path_; }
+   uint64_t GetSize() const { return size_; }
+
+   // Back to the first line
+   void Rewind();
+   // False at the end of the file.  lineNumber counts from 1 in the file as
+   // written; endOffset is the byte after the line, for progress.
+   bool NextLine(std::string& line, long& lineNumber, uint64_t& endOffset);
+   // Lines read so far, all of them once NextLine() returned false
+   long GetLineNumber() const { return lineNumber_; }
+
+private:
+   GrblJobFile(const GrblJobFile&);
+   GrblJobFile& operator=(const GrblJobFile&);
+
+   bool open_;
+   std::string path_;
+   const char* data_;    // 0 for an empty file
+   uint64_t size_;
+   uint64_t offset_;
+   long lineNumber_;
+#ifdef WIN32
+   void* file_;
+   void* mapping_;
+#else
+   int fd_;
+#endif
+};
+
+#endif // _GRBL_JOB_FILE_H_
@@ -0,0 +1,171 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblMoveEncoder.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Compact G0 move encoder.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#include "GrblMoveEncoder.h"
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+
+const char g_axisLetters[] = "XYZ";
+// without steps/mm, as many decimals as the adapter always sent
+const int g_defaultDecimals = 6;
+const int g_maxDecimals = 6;
+
+// "X-1.25" from -125 counts of 0.01 mm; trailing zeros and a bare
+// decimal point are left out
+void AppendAxis(std::string& line, int axis, long long counts, int decimals)
+{
+   char digits[32];
+   bool negative = counts < 0;
+   snprintf(digits, sizeof(digits), "%lld", negative ? -counts : counts);
+   std::string number(digits);
+   if (decimals > 0)
+   {
+      if ((int) number.size() <= decimals)
+         number.insert(0, decimals + 1 - number.size(), '0');
+      number.insert(number.size() - decimals, 1, '.');
+      size_t end = number.find_last_not_of('0');
+      if (number[end] == '.')
+         end--;
+      number.erase(end + 1);
+   }
+   line += g_axisLetters[axis];
+   if (negative)
+      line += '-';
+   line += number;
+}
+
+} // namespace
+
+GrblMoveEncoder::GrblMoveEncoder() :
+   moves_(0),
+   bytes_(0),
+   legacyBytes_(0)
+{
+   for (int i = 0; i < 3; i++)
+      decimals_[i] = g_defaultDecimals;
+   Reset();
+}
+
+// Grbl rounds the target to whole steps, so writing it with a rounding
+// error of at most a quarter step still lands on the same step.
+void GrblMoveEncoder::SetStepsPerMm(int axis, double stepsPerMm)
+{
+   int decimals = g_defaultDecimals;
+   if (stepsPerMm > 0.0)
+   {
+      decimals = 0;
+      while (decimals < g_maxDecimals && pow(10.0, -decimals) > 0.5 / stepsPerMm)
+         decimals++;
+   }
+   if (decimals != decimals_[axis])
+   {
+      decimals_[axis] = decimals;
+      positionKnown_[axis] = false;
+   }
+}
+
+void GrblMoveEncoder::Reset()
+{
+   modalKnown_ = false;
+   for (int i = 0; i < 3; i++)
+   {
+      positionKnown_[i] = false;
+      positionCounts_[i] = 0;
+   }
+}
+
+bool GrblMoveEncoder::Encode(bool moveX, double xUm, bool moveY, double yUm, bool moveZ, double zUm,
+      bool leaveOutUnchanged, std::string& line)
+{
+   bool move[3] = { moveX, moveY, moveZ };
+   double targetUm[3] = { xUm, yUm, zUm };
+   line.clear();
+   moves_++;
+   legacyBytes_ += (long) FormatLegacy(moveX, xUm, moveY, yUm, moveZ, zUm).size() + 1;
+   long long counts[3];
+   bool changed = false;
+   for (int i = 0; i < 3; i++)
+   {
+      if (!move[i])
+         continue;
+      counts[i] = llround(targetUm[i] / 1000.0 * pow(10.0, decimals_[i]));
+      if (!positionKnown_[i] || counts[i] != positionCounts_[i])
+         changed = true;
+   }
+   // a move to where the last line already goes
+   if (!changed)
+      return false;
+   for (int i = 0; i < 3; i++)
+   {
+      if (!move[i])
+         continue;
+      if (leaveOutUnchanged && positionKnown_[i] && counts[i] == positionCounts_[i])
+         continue;
+      AppendAxis(line, i, counts[i], decimals_[i]);
+      positionCounts_[i] = counts[i];
+      positionKnown_[i] = true;
+   }
+   if (!modalKnown_)
+   {
+      line.insert(0, "G0");
+      modalKnown_ = true;
+   }
+   bytes_ += (long) line.size() + 1;
+   return true;
+}
+
+std::string GrblMoveEncoder::FormatLegacy(bool moveX, double xUm, bool moveY, double yUm, bool moveZ, double zUm)
+{
+   std::string command = "G0";
+   char buff[32];
+   if (moveX)
+   {
+      sprintf(buff, " X%f", xUm/1000.);
+      command += buff;
+   }
+   if (moveY)
+   {
+      sprintf(buff, " Y%f", yUm/1000.);
+      command += buff;
+   }
+   if (moveZ)
+   {
+      sprintf(buff, " Z%f", zUm/1000.);
+      command += buff;
+   }
+   return command;
+}
+
+bool GrblMoveEncoder::ChangesMotionState(const std::string& line)
+{
+   if (line.empty())
+      return false;
+   if (line[0] == '$')
+      return line.compare(0, 3, "$J=") == 0 || line.compare(0, 2, "$H") == 0;
+   const char* text = line.c_str();
+   for (size_t i = 0; i < line.size(); i++)
+   {
+      char letter = (char) toupper((unsigned char) text[i]);
+      if (letter == 'X' || letter == 'Y' || letter == 'Z')
+         return true;
+      if (letter == 'G' && strtod(text + i + 1, 0) != 4.0)
+         return true;
+      if (letter == 'M')
+      {
+         double code = strtod(text + i + 1, 0);
+         if (code == 2.0 || code == 30.0)
+            return true;
+      }
+   }
+   return false;
+}
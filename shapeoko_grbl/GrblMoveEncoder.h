@@ -0,0 +1,63 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblMoveEncoder.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Writes G0 moves in as few bytes as Grbl needs to execute
+//                them exactly: no repeated modal G0, no unchanged axes, no
+//                spaces and no more decimals than the axis resolution.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifndef _GRBL_MOVE_ENCODER_H_
+#define _GRBL_MOVE_ENCODER_H_
+
+#include <string>
+
+// Remembers what the lines it wrote leave the controller in: G0 motion
+// mode and the target of each axis.  That only holds while nothing else
+// is sent in between that changes them; Reset() makes the next move
+// complete again.  It also only holds once every line before has been
+// acknowledged: a rejected line would leave the axes the next one omits
+// short of their target.  So the caller only asks for unchanged axes to be
+// left out when nothing is outstanding, and gets every requested axis
+// otherwise.
+class GrblMoveEncoder
+{
+public:
+   GrblMoveEncoder();
+
+   // Decimals are chosen so that rounding stays well inside half a step
+   void SetStepsPerMm(int axis, double stepsPerMm);
+   int GetDecimals(int axis) const { return decimals_[axis]; }
+   void Reset();
+
+   // Positions in um; axes whose flag is false are left out, and with
+   // leaveOutUnchanged also those already at their target.  Returns false,
+   // with an empty line, when no axis would move.
+   bool Encode(bool moveX, double xUm, bool moveY, double yUm, bool moveZ, double zUm,
+         bool leaveOutUnchanged, std::string& line);
+   // "G0 X1.000000 Y2.000000", as the adapter used to write every move
+   static std::string FormatLegacy(bool moveX, double xUm, bool moveY, double yUm, bool moveZ, double zUm);
+   // True for lines that may change the motion mode or an axis target
+   // behind the encoder's back: G words other than G4, axis words, program
+   // end, jogging and homing.  Queries and settings do not.
+   static bool ChangesMotionState(const std::string& line);
+
+   // Bytes on the wire, line ends included, of all moves encoded so far
+   // and of the same moves in the legacy format
+   long GetMoves() const { return moves_; }
+   long GetBytes() const { return bytes_; }
+   long GetLegacyBytes() const { return legacyBytes_; }
+
+private:
+   int decimals_[3];
+   bool modalKnown_;         // the last motion line was a G0
+   bool positionKnown_[3];
+   long long positionCounts_[3];  // target in units of the last decimal
+   long moves_;
+   long bytes_;
+   long legacyBytes_;
+};
+
+#endif // _GRBL_MOVE_ENCODER_H_
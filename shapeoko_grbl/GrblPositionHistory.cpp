@@ -0,0 +1,332 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblPositionHistory.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Position history ring buffer and memory-mapped log file.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifdef WIN32
+   #include <windows.h>
+#else
+   #include <fcntl.h>
+   #include <sys/mman.h>
+   #include <unistd.h>
+#endif
+#include "GrblPositionHistory.h"
+#include <cstring>
+
+namespace {
+
+struct PositionLogHeader
+{
+   char magic[8];
+   uint32_t headerSize;
+   uint32_t recordSize;
+   uint64_t count;
+   uint64_t reserved;
+};
+
+// the file grows by this many records (1.5 MB) at a time
+const uint64_t g_logChunkRecords = 65536;
+
+const char* g_stateNames[] = {
+   "Unknown", "Idle", "Run", "Hold", "Jog", "Alarm", "Door", "Check", "Home", "Sleep", "Queue"
+};
+
+uint64_t FileSize(uint64_t records)
+{
+   return sizeof(PositionLogHeader) + records * sizeof(PositionRecord);
+}
+
+} // namespace
+
+GrblStateCode GetGrblStateCode(const char* state)
+{
+   // 1.1 adds sub-states, as in "Hold:0"
+   size_t length = strcspn(state, ":");
+   for (int i = GrblStateIdle; i <= GrblStateQueue; i++)
+      if (strlen(g_stateNames[i]) == length && strncmp(state, g_stateNames[i], length) == 0)
+         return (GrblStateCode) i;
+   return GrblStateUnknown;
+}
+
+const char* GetGrblStateName(GrblStateCode code)
+{
+   if (code < GrblStateUnknown || code > GrblStateQueue)
+      return g_stateNames[GrblStateUnknown];
+   return g_stateNames[code];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PositionLog
+///////////////////////////////////////////////////////////////////////////////
+
+PositionLog::PositionLog() :
+   base_(0),
+   capacity_(0),
+#ifdef WIN32
+   file_(INVALID_HANDLE_VALUE),
+   mapping_(0)
+#else
+   fd_(-1)
+#endif
+{
+}
+
+PositionLog::~PositionLog()
+{
+   Close();
+}
+
+bool PositionLog::Open(const std::string& path)
+{
+   Close();
+#ifdef WIN32
+   file_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0,
+         CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+   if (file_ == INVALID_HANDLE_VALUE)
+      return false;
+#else
+   fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd_ < 0)
+      return false;
+#endif
+   if (!Map(g_logChunkRecords))
+   {
+      Close();
+      return false;
+   }
+   PositionLogHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, "GRBLPOS1", 8);
+   header.headerSize = sizeof(PositionLogHeader);
+   header.recordSize = sizeof(PositionRecord);
+   memcpy(base_, &header, sizeof(header));
+   return true;
+}
+
+void PositionLog::Close()
+{
+   uint64_t count = GetCount();
+   bool mapped = IsOpen();
+   Unmap();
+#ifdef WIN32
+   if (file_ != INVALID_HANDLE_VALUE)
+   {
+      if (mapped)
+      {
+         LARGE_INTEGER size;
+         size.QuadPart = (LONGLONG) FileSize(count);
+         SetFilePointerEx(file_, size, 0, FILE_BEGIN);
+         SetEndOfFile(file_);
+      }
+      CloseHandle(file_);
+      file_ = INVALID_HANDLE_VALUE;
+   }
+#else
+   if (fd_ >= 0)
+   {
+      if (mapped && ftruncate(fd_, (off_t) FileSize(count)) != 0)
+      {
+         // the unused tail stays in the file; readers go by the count
+      }
+      close(fd_);
+      fd_ = -1;
+   }
+#endif
+}
+
+bool PositionLog::Append(const PositionRecord& record)
+{
+   if (!IsOpen())
+      return false;
+   PositionLogHeader* header = (PositionLogHeader*) base_;
+   uint64_t count = header->count;
+   if (count >= capacity_ && !Map(capacity_ + g_logChunkRecords))
+      return false;
+   header = (PositionLogHeader*) base_;
+   memcpy(base_ + FileSize(count), &record, sizeof(record));
+   // the count goes last, so that a reader never sees a partial record
+   header->count = count + 1;
+   return true;
+}
+
+uint64_t PositionLog::GetCount() const
+{
+   if (!IsOpen())
+      return 0;
+   return ((const PositionLogHeader*) base_)->count;
+}
+
+// Sizes the file for capacity records and maps all of it.  An existing
+// mapping is replaced; what it holds is already in the file.
+bool PositionLog::Map(uint64_t capacity)
+{
+   Unmap();
+   uint64_t size = FileSize(capacity);
+#ifdef WIN32
+   mapping_ = CreateFileMappingA(file_, 0, PAGE_READWRITE, (DWORD) (size >> 32), (DWORD) size, 0);
+   if (mapping_ == 0)
+      return false;
+   base_ = (char*) MapViewOfFile(mapping_, FILE_MAP_WRITE, 0, 0, (SIZE_T) size);
+   if (base_ == 0)
+   {
+      CloseHandle(mapping_);
+      mapping_ = 0;
+      return false;
+   }
+#else
+   if (ftruncate(fd_, (off_t) size) != 0)
+      return false;
+   void* base = mmap(0, (size_t) size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+   if (base == MAP_FAILED)
+      return false;
+   base_ = (char*) base;
+#endif
+   capacity_ = capacity;
+   return true;
+}
+
+void PositionLog::Unmap()
+{
+   if (base_ == 0)
+      return;
+#ifdef WIN32
+   UnmapViewOfFile(base_);
+   CloseHandle(mapping_);
+   mapping_ = 0;
+#else
+   munmap(base_, (size_t) FileSize(capacity_));
+#endif
+   base_ = 0;
+   capacity_ = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PositionHistory
+///////////////////////////////////////////////////////////////////////////////
+
+PositionHistory::PositionHistory(size_t capacity) :
+   ring_(capacity),
+   next_(0),
+   count_(0)
+{
+}
+
+void PositionHistory::SetCapacity(size_t capacity)
+{
+   MMThreadGuard guard(lock_);
+   ring_.assign(capacity, PositionRecord());
+   next_ = 0;
+   count_ = 0;
+}
+
+size_t PositionHistory::GetCapacity()
+{
+   MMThreadGuard guard(lock_);
+   return ring_.size();
+}
+
+void PositionHistory::Clear()
+{
+   MMThreadGuard guard(lock_);
+   next_ = 0;
+   count_ = 0;
+}
+
+void PositionHistory::Add(double timeUs, const double mposMm[3], const char* state)
+{
+   MMThreadGuard guard(lock_);
+   if (ring_.empty())
+      return;
+   PositionRecord record;
+   record.timeUs = (int64_t) timeUs;
+   if (count_ > 0 && record.timeUs < At(count_ - 1).timeUs)
+      record.timeUs = At(count_ - 1).timeUs;
+   for (int i = 0; i < 3; i++)
+      record.mposMm[i] = (float) mposMm[i];
+   record.state = GetGrblStateCode(state);
+   ring_[next_] = record;
+   next_ = (next_ + 1) % ring_.size();
+   if (count_ < ring_.size())
+      count_++;
+   log_.Append(record);
+}
+
+size_t PositionHistory::GetCount()
+{
+   MMThreadGuard guard(lock_);
+   return count_;
+}
+
+bool PositionHistory::GetWindow(double& firstUs, double& lastUs)
+{
+   MMThreadGuard guard(lock_);
+   if (count_ == 0)
+      return false;
+   firstUs = (double) At(0).timeUs;
+   lastUs = (double) At(count_ - 1).timeUs;
+   return true;
+}
+
+bool PositionHistory::GetPositionAt(double timeUs, double mposMm[3], GrblStateCode& state, double& gapMs)
+{
+   MMThreadGuard guard(lock_);
+   if (count_ == 0 || timeUs < At(0).timeUs || timeUs > At(count_ - 1).timeUs)
+      return false;
+   // first sample later than timeUs; the window check leaves at least one
+   // sample at or before it
+   size_t low = 1, high = count_;
+   while (low < high)
+   {
+      size_t mid = (low + high) / 2;
+      if (At(mid).timeUs <= timeUs)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   const PositionRecord& before = At(low - 1);
+   if (low == count_)
+   {
+      for (int i = 0; i < 3; i++)
+         mposMm[i] = before.mposMm[i];
+      state = (GrblStateCode) before.state;
+      gapMs = 0.0;
+      return true;
+   }
+   const PositionRecord& after = At(low);
+   double span = (double) (after.timeUs - before.timeUs);
+   double f = (timeUs - before.timeUs) / span;
+   for (int i = 0; i < 3; i++)
+      mposMm[i] = before.mposMm[i] + f * (after.mposMm[i] - before.mposMm[i]);
+   state = (GrblStateCode) before.state;
+   gapMs = span / 1000.0;
+   return true;
+}
+
+bool PositionHistory::SetLogFile(const std::string& path)
+{
+   MMThreadGuard guard(lock_);
+   log_.Close();
+   logPath_.clear();
+   if (path.empty())
+      return true;
+   if (!log_.Open(path))
+      return false;
+   logPath_ = path;
+   return true;
+}
+
+std::string PositionHistory::GetLogFile()
+{
+   MMThreadGuard guard(lock_);
+   return logPath_;
+}
+
+// i-th sample, oldest first
+const PositionRecord& PositionHistory::At(size_t i) const
+{
+   return ring_[(next_ + ring_.size() - count_ + i) % ring_.size()];
+}
@@ -0,0 +1,132 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblPositionHistory.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Timestamped machine positions from the status reports, so
+//                that the position at the time of an exposure can be looked
+//                up afterwards.  Optionally streamed to a memory-mapped
+//                binary log file.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifndef _GRBL_POSITION_HISTORY_H_
+#define _GRBL_POSITION_HISTORY_H_
+
+#include "DeviceThreads.h"
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+enum GrblStateCode
+{
+   GrblStateUnknown,
+   GrblStateIdle,
+   GrblStateRun,
+   GrblStateHold,
+   GrblStateJog,
+   GrblStateAlarm,
+   GrblStateDoor,
+   GrblStateCheck,
+   GrblStateHome,
+   GrblStateSleep,
+   GrblStateQueue
+};
+
+GrblStateCode GetGrblStateCode(const char* state);
+const char* GetGrblStateName(GrblStateCode code);
+
+// One sample, 24 bytes, also the record format of the log file.  Times are
+// MM time (GetCurrentMMTime()) in us, the clock image metadata uses.
+struct PositionRecord
+{
+   int64_t timeUs;
+   float mposMm[3];
+   uint32_t state;       // GrblStateCode
+};
+
+////////////////////////
+// PositionLog
+// Append-only file of PositionRecords behind a 32 byte header:
+//    char     magic[8]      "GRBLPOS1"
+//    uint32_t headerSize    32
+//    uint32_t recordSize    24
+//    uint64_t count         records written so far
+//    uint64_t reserved
+// in native byte order.  The file is mapped into memory and grown in chunks,
+// so appending a record is a memory copy; it is cut to its length on Close().
+//////////////////////
+
+class PositionLog
+{
+public:
+   PositionLog();
+   ~PositionLog();
+
+   // Truncates an existing file
+   bool Open(const std::string& path);
+   void Close();
+   bool IsOpen() const { return base_ != 0; }
+   bool Append(const PositionRecord& record);
+   uint64_t GetCount() const;
+
+private:
+   PositionLog(const PositionLog&);
+   PositionLog& operator=(const PositionLog&);
+
+   bool Map(uint64_t capacity);
+   void Unmap();
+
+   char* base_;
+   uint64_t capacity_;   // records the current mapping has room for
+#ifdef WIN32
+   void* file_;
+   void* mapping_;
+#else
+   int fd_;
+#endif
+};
+
+////////////////////////
+// PositionHistory
+// Ring buffer of the most recent samples.  Positions in between are
+// interpolated linearly, so their accuracy depends on how often the status
+// is polled while the stage moves.
+//////////////////////
+
+class PositionHistory
+{
+public:
+   PositionHistory(size_t capacity = 4096);
+
+   // Changing the capacity drops the samples recorded so far
+   void SetCapacity(size_t capacity);
+   size_t GetCapacity();
+   void Clear();
+
+   // Samples must come in time order; an earlier one is moved up to the
+   // last sample's time.
+   void Add(double timeUs, const double mposMm[3], const char* state);
+   size_t GetCount();
+   bool GetWindow(double& firstUs, double& lastUs);
+
+   // Position at timeUs, false outside the window.  gapMs is the spacing
+   // of the two samples it was interpolated from.
+   bool GetPositionAt(double timeUs, double mposMm[3], GrblStateCode& state, double& gapMs);
+
+   // Empty path stops logging
+   bool SetLogFile(const std::string& path);
+   std::string GetLogFile();
+
+private:
+   const PositionRecord& At(size_t i) const;
+
+   MMThreadLock lock_;
+   std::vector<PositionRecord> ring_;
+   size_t next_;
+   size_t count_;
+   PositionLog log_;
+   std::string logPath_;
+};
+
+#endif // _GRBL_POSITION_HISTORY_H_
@@ -0,0 +1,92 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblSettings.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   The controller's $$ settings, read once at start-up.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#include "GrblSettings.h"
+#include <cstdio>
+#include <sstream>
+
+namespace {
+
+struct SettingName
+{
+   int number;
+   const char* name;
+};
+
+// Grbl 0.9/1.1 setting descriptions
+const SettingName g_settingNames[] = {
+   {0, "Step pulse (us)"},
+   {1, "Step idle delay (ms)"},
+   {2, "Step port invert mask"},
+   {3, "Direction port invert mask"},
+   {4, "Step enable invert"},
+   {5, "Limit pins invert"},
+   {6, "Probe pin invert"},
+   {10, "Status report mask"},
+   {11, "Junction deviation (mm)"},
+   {12, "Arc tolerance (mm)"},
+   {13, "Report inches"},
+   {20, "Soft limits"},
+   {21, "Hard limits"},
+   {22, "Homing cycle"},
+   {23, "Homing direction invert mask"},
+   {24, "Homing feed (mm/min)"},
+   {25, "Homing seek (mm/min)"},
+   {26, "Homing debounce (ms)"},
+   {27, "Homing pull-off (mm)"},
+   {30, "Max spindle speed (RPM)"},
+   {31, "Min spindle speed (RPM)"},
+   {32, "Laser mode"},
+   {100, "X steps/mm"},
+   {101, "Y steps/mm"},
+   {102, "Z steps/mm"},
+   {110, "X max rate (mm/min)"},
+   {111, "Y max rate (mm/min)"},
+   {112, "Z max rate (mm/min)"},
+   {120, "X acceleration (mm/s^2)"},
+   {121, "Y acceleration (mm/s^2)"},
+   {122, "Z acceleration (mm/s^2)"},
+   {130, "X max travel (mm)"},
+   {131, "Y max travel (mm)"},
+   {132, "Z max travel (mm)"}
+};
+
+} // namespace
+
+bool GrblSettings::Parse(const std::string& answer)
+{
+   values_.clear();
+   std::istringstream lines(answer);
+   std::string line;
+   while (std::getline(lines, line))
+   {
+      int number;
+      double value;
+      if (sscanf(line.c_str(), "$%d=%lf", &number, &value) == 2)
+         values_[number] = value;
+   }
+   return !values_.empty();
+}
+
+double GrblSettings::Get(int number, double fallback) const
+{
+   std::map<int, double>::const_iterator it = values_.find(number);
+   return it != values_.end() ? it->second : fallback;
+}
+
+std::string GrblSettings::PropertyName(int number)
+{
+   std::string name = "$" + std::to_string(number);
+   for (size_t i = 0; i < sizeof(g_settingNames) / sizeof(g_settingNames[0]); i++)
+   {
+      if (g_settingNames[i].number == number)
+         return name + " " + g_settingNames[i].name;
+   }
+   return name;
+}
@@ -0,0 +1,44 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblSettings.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   The controller's $$ settings, read once at start-up.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifndef _GRBL_SETTINGS_H_
+#define _GRBL_SETTINGS_H_
+
+#include <map>
+#include <string>
+
+// Setting numbers the adapter uses itself
+#define GRBL_SETTING_SOFT_LIMITS     20
+#define GRBL_SETTING_HOMING          22
+#define GRBL_SETTING_STEPS_PER_MM   100   // +axis
+#define GRBL_SETTING_MAX_RATE       110   // +axis, mm/min
+#define GRBL_SETTING_ACCELERATION   120   // +axis, mm/s^2
+#define GRBL_SETTING_MAX_TRAVEL     130   // +axis, mm
+
+class GrblSettings
+{
+public:
+   // Parses the reply to $$: "$N=value" lines, with or without 0.9's
+   // trailing "(description)".  Returns false if there were none.
+   bool Parse(const std::string& answer);
+
+   bool Has(int number) const { return values_.count(number) > 0; }
+   double Get(int number, double fallback = 0.0) const;
+   void Set(int number, double value) { values_[number] = value; }
+   const std::map<int, double>& GetAll() const { return values_; }
+   bool IsEmpty() const { return values_.empty(); }
+
+   // Property name for a setting, e.g. "$110 X max rate (mm/min)"
+   static std::string PropertyName(int number);
+
+private:
+   std::map<int, double> values_;
+};
+
+#endif // _GRBL_SETTINGS_H_
@@ -0,0 +1,1311 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblSimulator.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Simulated Grbl controller behind a Micro-Manager serial port.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#include "GrblSimulator.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+extern const char* g_GrblSimulatorDeviceName;
+
+namespace {
+
+struct SettingInfo
+{
+   int number;
+   double value;
+   bool integer;
+   const char* description;   // printed by 0.9 only
+};
+
+// Grbl 0.9 defaults for a ShapeOko 2, with homing enabled so that the
+// controller comes up locked like the original hardware does
+const SettingInfo g_defaultSettings[] = {
+   {0, 10, true, "step pulse, usec"},
+   {1, 25, true, "step idle delay, msec"},
+   {2, 0, true, "step port invert mask"},
+   {3, 0, true, "dir port invert mask"},
+   {4, 0, true, "step enable invert, bool"},
+   {5, 0, true, "limit pins invert, bool"},
+   {6, 0, true, "probe pin invert, bool"},
+   {10, 3, true, "status report mask"},
+   {11, 0.010, false, "junction deviation, mm"},
+   {12, 0.002, false, "arc tolerance, mm"},
+   {13, 0, true, "report inches, bool"},
+   {20, 0, true, "soft limits, bool"},
+   {21, 0, true, "hard limits, bool"},
+   {22, 1, true, "homing cycle, bool"},
+   {23, 0, true, "homing dir invert mask"},
+   {24, 25.0, false, "homing feed, mm/min"},
+   {25, 500.0, false, "homing seek, mm/min"},
+   {26, 250, true, "homing debounce, msec"},
+   {27, 1.000, false, "homing pull-off, mm"},
+   {100, 40.000, false, "x, step/mm"},
+   {101, 40.000, false, "y, step/mm"},
+   {102, 200.000, false, "z, step/mm"},
+   {110, 5000.000, false, "x max rate, mm/min"},
+   {111, 5000.000, false, "y max rate, mm/min"},
+   {112, 500.000, false, "z max rate, mm/min"},
+   {120, 250.000, false, "x accel, mm/sec^2"},
+   {121, 250.000, false, "y accel, mm/sec^2"},
+   {122, 50.000, false, "z accel, mm/sec^2"},
+   {130, 290.000, false, "x max travel, mm"},
+   {131, 290.000, false, "y max travel, mm"},
+   {132, 100.000, false, "z max travel, mm"}
+};
+const int g_settingCount = sizeof(g_defaultSettings) / sizeof(g_defaultSettings[0]);
+
+// Grbl 1.1 error codes; 0.9 prints the message instead
+enum {
+   ErrExpectedCommandLetter = 1,
+   ErrBadNumberFormat = 2,
+   ErrInvalidStatement = 3,
+   ErrSettingDisabled = 5,
+   ErrIdle = 8,
+   ErrAlarmLock = 9,
+   ErrOverflow = 11,
+   ErrInvalidJog = 16,
+   ErrUnsupportedCommand = 20,
+   ErrUndefinedFeedRate = 22,
+   ErrValueWordMissing = 28
+};
+
+const size_t g_lineBufferSize = 80;
+
+bool IsRealtime(unsigned char c)
+{
+   return c == '?' || c == '!' || c == '~' || c == 0x18 || c >= 0x80;
+}
+
+// Grbl's read_float(): optional sign, digits and one decimal point.  No
+// exponents, hex or inf/nan, which strtod() would accept.
+bool ReadNumber(const char* text, size_t& length, double& value)
+{
+   const char* p = text;
+   bool negative = false;
+   if (*p == '-' || *p == '+')
+      negative = *p++ == '-';
+   double result = 0.0, scale = 1.0;
+   bool digits = false, point = false;
+   for (;; p++)
+   {
+      if (*p >= '0' && *p <= '9')
+      {
+         digits = true;
+         if (point)
+            scale *= 0.1;
+         result = result * 10.0 + (*p - '0');
+      }
+      else if (*p == '.' && !point)
+         point = true;
+      else
+         break;
+   }
+   if (!digits)
+      return false;
+   value = (negative ? -result : result) * scale;
+   length = p - text;
+   return true;
+}
+
+} // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblSimulator
+///////////////////////////////////////////////////////////////////////////////
+
+GrblSimulator::GrblSimulator() :
+   version11_(false),
+   charTime_(0.0),
+   startupDelay_(0.0),
+   poweredUp_(false),
+   bannerAt_(0.0),
+   inputEnd_(0.0),
+   rxOverflows_(0),
+   outputEnd_(0.0),
+   state_(Idle),
+   holdComplete_(false),
+   holdStart_(0.0),
+   holdVelocity_(0.0),
+   holdAccel_(1.0),
+   jogCancel_(false),
+   wait_(WaitNone),
+   waitUntil_(0.0),
+   absolute_(true),
+   motionMode_(0),
+   feed_(0.0),
+   spindleOn_(false),
+   floodOn_(false),
+   mistOn_(false),
+   reportCount_(0)
+{
+   for (int i = 0; i < 3; i++)
+   {
+      position_[i] = plannedEnd_[i] = g92_[i] = 0.0;
+      holdPos_[i] = holdUnit_[i] = 0.0;
+   }
+   for (int i = 0; i < g_settingCount; i++)
+      settings_[g_defaultSettings[i].number] = g_defaultSettings[i].value;
+}
+
+// Equivalent of opening the port on an Arduino: the board resets, loses
+// its position and prints the banner once the bootloader has given up.
+// Settings survive, like they do in EEPROM.
+void GrblSimulator::PowerUp(double now)
+{
+   input_.clear();
+   output_.clear();
+   rxBuffer_.clear();
+   planner_.clear();
+   inputEnd_ = outputEnd_ = now;
+   for (int i = 0; i < 3; i++)
+      position_[i] = plannedEnd_[i] = g92_[i] = 0.0;
+   state_ = Setting(22) != 0.0 ? Alarm : Idle;
+   holdComplete_ = false;
+   jogCancel_ = false;
+   wait_ = WaitNone;
+   absolute_ = true;
+   motionMode_ = 0;
+   feed_ = 0.0;
+   spindleOn_ = floodOn_ = mistOn_ = false;
+   reportCount_ = 0;
+   poweredUp_ = false;
+   bannerAt_ = now + startupDelay_;
+}
+
+void GrblSimulator::Receive(const unsigned char* data, size_t length, double now)
+{
+   if (length == 0)
+      return;
+   Chunk chunk;
+   chunk.at = std::max(now, inputEnd_) + length * charTime_;
+   chunk.data.assign((const char*) data, length);
+   inputEnd_ = chunk.at;
+   input_.push_back(chunk);
+   Update(now);
+}
+
+void GrblSimulator::Update(double now)
+{
+   if (!poweredUp_)
+   {
+      if (now < bannerAt_)
+      {
+         // the bootloader swallows whatever arrives before the firmware runs
+         while (!input_.empty() && input_.front().at <= now)
+            input_.pop_front();
+         return;
+      }
+      poweredUp_ = true;
+      SendBanner(bannerAt_);
+      if (state_ == Alarm)
+         Send(version11_ ? "[MSG:'$H'|'$X' to unlock]\r\n" : "['$H'|'$X' to unlock]\r\n", bannerAt_);
+   }
+
+   // bytes in arrival order; real-time commands never reach the RX buffer
+   while (!input_.empty() && input_.front().at <= now)
+   {
+      Chunk chunk = input_.front();
+      input_.pop_front();
+      for (size_t i = 0; i < chunk.data.size(); i++)
+      {
+         unsigned char c = (unsigned char) chunk.data[i];
+         if (IsRealtime(c))
+            HandleRealtime(c, chunk.at);
+         else if (rxBuffer_.size() < (size_t) RxBufferSize)
+            rxBuffer_ += (char) c;
+         else
+            rxOverflows_++;
+      }
+   }
+
+   AdvanceMotion(now);
+
+   for (;;)
+   {
+      if (wait_ == WaitDwell)
+      {
+         if (now < waitUntil_)
+            break;
+         wait_ = WaitNone;
+         SendOk(waitUntil_);
+      }
+
+      size_t end = rxBuffer_.find_first_of("\r\n");
+      if (end == std::string::npos)
+         break;
+      std::string line = rxBuffer_.substr(0, end);
+      if (!ProcessLine(line, now))
+         break;   // waits for the planner; try again on the next update
+      rxBuffer_.erase(0, end + 1);
+   }
+}
+
+size_t GrblSimulator::Available(double now)
+{
+   Update(now);
+   size_t n = 0;
+   for (std::deque<Chunk>::const_iterator it = output_.begin(); it != output_.end() && it->at <= now; ++it)
+      n += it->data.size();
+   return n;
+}
+
+size_t GrblSimulator::Read(char* buffer, size_t maxLength, double now)
+{
+   Update(now);
+   size_t n = 0;
+   while (n < maxLength && !output_.empty() && output_.front().at <= now)
+   {
+      Chunk& chunk = output_.front();
+      size_t count = std::min(maxLength - n, chunk.data.size());
+      memcpy(buffer + n, chunk.data.data(), count);
+      n += count;
+      chunk.data.erase(0, count);
+      if (chunk.data.empty())
+         output_.pop_front();
+   }
+   return n;
+}
+
+void GrblSimulator::Purge(double now)
+{
+   Update(now);
+   while (!output_.empty() && output_.front().at <= now)
+      output_.pop_front();
+}
+
+// Real-time commands, executed the moment the byte comes in
+void GrblSimulator::HandleRealtime(unsigned char c, double now)
+{
+   if (!poweredUp_)
+      return;
+   AdvanceMotion(now);
+   switch (c)
+   {
+      case '?':
+         SendStatus(now);
+         break;
+      case '!':
+         if (state_ == Run || state_ == Jog)
+         {
+            // a hold during a jog ends it, like a jog cancel
+            jogCancel_ = state_ == Jog;
+            StartFeedHold(now);
+         }
+         break;
+      case '~':
+         if (state_ == Hold)
+            Resume(now);
+         break;
+      case 0x18:
+         SoftReset(now);
+         break;
+      case 0x85:
+         if (version11_ && state_ == Jog)
+         {
+            jogCancel_ = true;
+            StartFeedHold(now);
+         }
+         break;
+      default:
+         break;   // overrides and the like are not modelled
+   }
+}
+
+void GrblSimulator::SoftReset(double now)
+{
+   AdvanceMotion(now);
+   double pos[3];
+   CurrentPosition(now, pos);
+   // stopping the steppers mid-move loses steps, so Grbl no longer trusts
+   // its position
+   bool moving = state_ == Run || state_ == Jog || (state_ == Hold && !holdComplete_);
+   for (int i = 0; i < 3; i++)
+      position_[i] = plannedEnd_[i] = pos[i];
+   // gc_init() clears the parser state, the G92 offset with it
+   for (int i = 0; i < 3; i++)
+      g92_[i] = 0.0;
+   reportCount_ = 0;
+   planner_.clear();
+   rxBuffer_.clear();
+   wait_ = WaitNone;
+   jogCancel_ = false;
+   holdComplete_ = false;
+   absolute_ = true;
+   motionMode_ = 0;
+   spindleOn_ = floodOn_ = mistOn_ = false;
+   if (moving)
+   {
+      state_ = Alarm;
+      Send(version11_ ? "ALARM:3\r\n" : "ALARM: Abort during cycle\r\n", now);
+   }
+   else if (state_ != Alarm)
+      state_ = Idle;
+   SendBanner(now);
+   if (state_ == Alarm)
+      Send(version11_ ? "[MSG:'$H'|'$X' to unlock]\r\n" : "['$H'|'$X' to unlock]\r\n", now);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Motion
+//
+// Every block accelerates from and decelerates to a standstill, i.e. the
+// junction speed is always zero.  That is slower than Grbl's look-ahead
+// planner on long chains of short collinear segments but exact for the
+// point-to-point moves a microscope stage makes.
+///////////////////////////////////////////////////////////////////////////////
+
+void GrblSimulator::PlanBlock(const double target[3], double feedMmPerMin, bool rapid, bool jog)
+{
+   Block b;
+   double sum = 0.0;
+   for (int i = 0; i < 3; i++)
+   {
+      b.start[i] = plannedEnd_[i];
+      b.target[i] = target[i];
+      double d = target[i] - plannedEnd_[i];
+      sum += d * d;
+   }
+   b.length = sqrt(sum);
+   if (b.length < 1e-9)
+      return;   // Grbl drops zero length moves
+
+   b.vmax = rapid ? std::numeric_limits<double>::max() : feedMmPerMin / 60.0;
+   b.accel = std::numeric_limits<double>::max();
+   for (int i = 0; i < 3; i++)
+   {
+      b.unit[i] = (target[i] - plannedEnd_[i]) / b.length;
+      double u = fabs(b.unit[i]);
+      if (u < 1e-12)
+         continue;
+      b.vmax = std::min(b.vmax, Setting(110 + i) / 60.0 / u);
+      b.accel = std::min(b.accel, Setting(120 + i) / u);
+   }
+   if (b.length < b.vmax * b.vmax / b.accel)
+      b.duration = 2.0 * sqrt(b.length / b.accel);
+   else
+      b.duration = 2.0 * b.vmax / b.accel + (b.length - b.vmax * b.vmax / b.accel) / b.vmax;
+   b.jog = jog;
+   b.startTime = 0.0;
+
+   planner_.push_back(b);
+   for (int i = 0; i < 3; i++)
+      plannedEnd_[i] = target[i];
+}
+
+// Starts the head block if the machine is free to move
+void GrblSimulator::StartIfIdle(double now)
+{
+   if (state_ == Idle && !planner_.empty())
+   {
+      planner_.front().startTime = now;
+      state_ = planner_.front().jog ? Jog : Run;
+   }
+}
+
+void GrblSimulator::AdvanceMotion(double now)
+{
+   if (state_ == Hold)
+   {
+      if (holdComplete_ || now < holdStart_ + holdVelocity_ / holdAccel_)
+         return;
+      // deceleration finished: the rest of the block becomes a new block
+      // that starts from rest on cycle start
+      double stop = holdVelocity_ * holdVelocity_ / (2.0 * holdAccel_);
+      for (int i = 0; i < 3; i++)
+         position_[i] = holdPos_[i] + holdUnit_[i] * stop;
+      holdComplete_ = true;
+      if (!planner_.empty())
+      {
+         Block b = planner_.front();
+         planner_.pop_front();
+         double end[3];
+         for (int i = 0; i < 3; i++)
+         {
+            end[i] = plannedEnd_[i];
+            plannedEnd_[i] = position_[i];
+         }
+         std::deque<Block> rest;
+         rest.swap(planner_);
+         PlanBlock(b.target, b.vmax * 60.0, false, b.jog);
+         for (std::deque<Block>::iterator it = rest.begin(); it != rest.end(); ++it)
+            planner_.push_back(*it);
+         for (int i = 0; i < 3; i++)
+            plannedEnd_[i] = end[i];
+      }
+      if (jogCancel_)
+      {
+         planner_.clear();
+         for (int i = 0; i < 3; i++)
+            plannedEnd_[i] = position_[i];
+         jogCancel_ = false;
+         holdComplete_ = false;
+         state_ = Idle;
+      }
+      return;
+   }
+
+   while (!planner_.empty() && (state_ == Run || state_ == Jog))
+   {
+      Block& b = planner_.front();
+      double end = b.startTime + b.duration;
+      if (now < end)
+         break;
+      for (int i = 0; i < 3; i++)
+         position_[i] = b.target[i];
+      planner_.pop_front();
+      if (planner_.empty())
+         state_ = Idle;
+      else
+      {
+         planner_.front().startTime = end;
+         state_ = planner_.front().jog ? Jog : Run;
+      }
+   }
+}
+
+void GrblSimulator::BlockPosition(const Block& b, double t, double pos[3]) const
+{
+   t = std::max(0.0, std::min(t, b.duration));
+   double ta = std::min(b.vmax / b.accel, b.duration / 2.0);
+   double vpeak = b.accel * ta;
+   double s;
+   if (t < ta)
+      s = 0.5 * b.accel * t * t;
+   else if (t < b.duration - ta)
+      s = 0.5 * b.accel * ta * ta + vpeak * (t - ta);
+   else
+   {
+      double r = b.duration - t;
+      s = b.length - 0.5 * b.accel * r * r;
+   }
+   for (int i = 0; i < 3; i++)
+      pos[i] = b.start[i] + b.unit[i] * s;
+}
+
+double GrblSimulator::BlockVelocity(const Block& b, double t) const
+{
+   t = std::max(0.0, std::min(t, b.duration));
+   double ta = std::min(b.vmax / b.accel, b.duration / 2.0);
+   if (t < ta)
+      return b.accel * t;
+   if (t < b.duration - ta)
+      return b.accel * ta;
+   return b.accel * (b.duration - t);
+}
+
+void GrblSimulator::CurrentPosition(double now, double pos[3])
+{
+   if (state_ == Hold && !holdComplete_)
+   {
+      double dt = std::min(now - holdStart_, holdVelocity_ / holdAccel_);
+      double s = holdVelocity_ * dt - 0.5 * holdAccel_ * dt * dt;
+      for (int i = 0; i < 3; i++)
+         pos[i] = holdPos_[i] + holdUnit_[i] * s;
+      return;
+   }
+   if ((state_ == Run || state_ == Jog) && !planner_.empty())
+   {
+      const Block& b = planner_.front();
+      BlockPosition(b, now - b.startTime, pos);
+      return;
+   }
+   for (int i = 0; i < 3; i++)
+      pos[i] = position_[i];
+}
+
+double GrblSimulator::CurrentFeed(double now)
+{
+   if (state_ == Hold && !holdComplete_)
+      return std::max(0.0, holdVelocity_ - holdAccel_ * (now - holdStart_)) * 60.0;
+   if ((state_ == Run || state_ == Jog) && !planner_.empty())
+      return BlockVelocity(planner_.front(), now - planner_.front().startTime) * 60.0;
+   return 0.0;
+}
+
+void GrblSimulator::StartFeedHold(double now)
+{
+   if (planner_.empty())
+      return;
+   const Block& b = planner_.front();
+   double t = now - b.startTime;
+   BlockPosition(b, t, holdPos_);
+   holdVelocity_ = BlockVelocity(b, t);
+   holdAccel_ = b.accel;
+   for (int i = 0; i < 3; i++)
+      holdUnit_[i] = b.unit[i];
+   holdStart_ = now;
+   holdComplete_ = false;
+   state_ = Hold;
+   AdvanceMotion(now);
+}
+
+void GrblSimulator::Resume(double now)
+{
+   if (!holdComplete_)
+      return;   // still decelerating
+   holdComplete_ = false;
+   state_ = Idle;
+   StartIfIdle(now);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Line protocol
+///////////////////////////////////////////////////////////////////////////////
+
+// Executes one line from the RX buffer.  Returns false, without side
+// effects, if the line has to wait for the planner.
+bool GrblSimulator::ProcessLine(const std::string& raw, double now)
+{
+   if (raw.size() >= g_lineBufferSize)
+   {
+      SendError(ErrOverflow, "Line overflow", now);
+      return true;
+   }
+
+   // Grbl strips white space and comments and upper-cases the line
+   std::string line;
+   bool paren = false;
+   for (size_t i = 0; i < raw.size(); i++)
+   {
+      char c = raw[i];
+      if (paren)
+      {
+         if (c == ')')
+            paren = false;
+         continue;
+      }
+      if (c == '(')
+         paren = true;
+      else if (c == ';')
+         break;
+      else if (c > ' ')
+         line += (char) toupper((unsigned char) c);
+   }
+
+   if (line.empty())
+   {
+      SendOk(now);
+      return true;
+   }
+   if (line[0] == '$')
+      return ExecuteSystemCommand(line, now);
+   return ExecuteGcode(line, now);
+}
+
+bool GrblSimulator::ParseWords(const std::string& line, std::vector<std::pair<char, double> >& words, int& error)
+{
+   size_t i = 0;
+   while (i < line.size())
+   {
+      char letter = line[i++];
+      if (letter < 'A' || letter > 'Z')
+      {
+         error = ErrExpectedCommandLetter;
+         return false;
+      }
+      size_t length = 0;
+      double value = 0.0;
+      if (!ReadNumber(line.c_str() + i, length, value))
+      {
+         error = ErrBadNumberFormat;
+         return false;
+      }
+      i += length;
+      words.push_back(std::make_pair(letter, value));
+   }
+   return true;
+}
+
+bool GrblSimulator::ExecuteGcode(const std::string& line, double now)
+{
+   // 1.1 locks the parser during a jog the same way as in alarm
+   if (state_ == Alarm || state_ == Jog)
+   {
+      SendError(ErrAlarmLock, "Alarm lock", now);
+      return true;
+   }
+
+   std::vector<std::pair<char, double> > words;
+   int error = 0;
+   if (!ParseWords(line, words, error))
+   {
+      SendError(error, error == ErrBadNumberFormat ? "Bad number format" : "Expected command letter", now);
+      return true;
+   }
+
+   // collect the line into locals first; nothing changes until it is known
+   // that the line can run now
+   bool absolute = absolute_;
+   int motion = -1;
+   bool dwell = false, setOffset = false, clearOffset = false, machineCoords = false;
+   bool pause = false, programEnd = false;
+   int spindle = -1, flood = -1, mist = -1;
+   double feed = feed_;
+   bool hasAxis[3] = {false, false, false};
+   double axis[3] = {0.0, 0.0, 0.0};
+   bool hasP = false;
+   double p = 0.0;
+   for (size_t i = 0; i < words.size(); i++)
+   {
+      char letter = words[i].first;
+      double value = words[i].second;
+      int code = (int) floor(value * 10.0 + 0.5);   // G92.1 -> 921
+      switch (letter)
+      {
+         case 'G':
+            switch (code)
+            {
+               case 0: motion = 0; break;
+               case 10: motion = 1; break;
+               case 40: dwell = true; break;
+               case 900: absolute = true; break;
+               case 910: absolute = false; break;
+               case 920: setOffset = true; break;
+               case 921: clearOffset = true; break;
+               case 530: machineCoords = true; break;
+               case 170: case 210: case 540: case 940: case 400: case 490: case 800:
+                  break;
+               default:
+                  SendError(ErrUnsupportedCommand, "Unsupported command", now);
+                  return true;
+            }
+            break;
+         case 'M':
+            switch (code)
+            {
+               case 0: case 10: pause = true; break;
+               case 20: case 300: programEnd = true; break;
+               case 30: case 40: spindle = 1; break;
+               case 50: spindle = 0; break;
+               case 70: mist = 1; break;
+               case 80: flood = 1; break;
+               case 90: mist = 0; flood = 0; break;
+               default:
+                  SendError(ErrUnsupportedCommand, "Unsupported command", now);
+                  return true;
+            }
+            break;
+         case 'X': case 'Y': case 'Z':
+            hasAxis[letter - 'X'] = true;
+            axis[letter - 'X'] = value;
+            break;
+         case 'F':
+            feed = value;
+            break;
+         case 'P':
+            hasP = true;
+            p = value;
+            break;
+         case 'N': case 'S': case 'T':
+            break;
+         default:
+            SendError(ErrUnsupportedCommand, "Unsupported command", now);
+            return true;
+      }
+   }
+   bool anyAxis = hasAxis[0] || hasAxis[1] || hasAxis[2];
+   if (motion < 0 && anyAxis && !setOffset)
+      motion = motionMode_;
+   bool move = motion >= 0 && anyAxis && !setOffset;
+   if (move && motion == 1 && feed <= 0.0)
+   {
+      SendError(ErrUndefinedFeedRate, "Undefined feed rate", now);
+      return true;
+   }
+   if (dwell && !hasP)
+   {
+      SendError(ErrValueWordMissing, "Value word missing", now);
+      return true;
+   }
+
+   // dwell, program flow and spindle/coolant changes wait for the planner
+   // to run empty; moves wait for a free planner block
+   bool sync = dwell || pause || programEnd || spindle >= 0 || flood >= 0 || mist >= 0;
+   if (sync && !planner_.empty())
+      return false;
+   if (move && planner_.size() >= (size_t) PlannerSize)
+      return false;
+
+   absolute_ = absolute;
+   feed_ = feed;
+   if (motion >= 0)
+      motionMode_ = motion;
+   if (clearOffset)
+      g92_[0] = g92_[1] = g92_[2] = 0.0;
+   if (setOffset)
+   {
+      for (int i = 0; i < 3; i++)
+         if (hasAxis[i])
+            g92_[i] = plannedEnd_[i] - axis[i];
+   }
+   // 1.1 reports a changed offset in the next status report
+   if (clearOffset || setOffset)
+      reportCount_ = 0;
+   if (spindle >= 0)
+      spindleOn_ = spindle == 1;
+   if (flood >= 0)
+      floodOn_ = flood == 1;
+   if (mist >= 0)
+      mistOn_ = mist == 1;
+   if (move)
+   {
+      double target[3];
+      for (int i = 0; i < 3; i++)
+      {
+         target[i] = plannedEnd_[i];
+         if (!hasAxis[i])
+            continue;
+         if (machineCoords)
+            target[i] = axis[i];
+         else if (absolute_)
+            target[i] = axis[i] + g92_[i];
+         else
+            target[i] += axis[i];
+      }
+      PlanBlock(target, feed_, motion == 0, false);
+      StartIfIdle(now);
+   }
+   if (programEnd)
+   {
+      absolute_ = true;
+      motionMode_ = 1;
+      spindleOn_ = floodOn_ = mistOn_ = false;
+   }
+   if (pause)
+   {
+      state_ = Hold;
+      holdComplete_ = true;
+   }
+   if (dwell)
+   {
+      wait_ = WaitDwell;
+      waitUntil_ = now + p;
+      return true;   // ok when the dwell is over
+   }
+   SendOk(now);
+   return true;
+}
+
+bool GrblSimulator::ExecuteSystemCommand(const std::string& line, double now)
+{
+   bool idle = state_ == Idle || state_ == Alarm;
+   if (line == "$")
+   {
+      Send(version11_ ? "[HLP:$$ $# $G $I $N $x=val $Nx=line $J=line $SLP $C $X $H ~ ! ? ctrl-x]\r\n"
+                      : "$$ (view Grbl settings)\r\n$# (view # parameters)\r\n$G (view parser state)\r\n"
+                        "$I (view build info)\r\n$x=value (save Grbl setting)\r\n$X (kill alarm lock)\r\n"
+                        "$H (run homing cycle)\r\n~ (cycle start)\r\n! (feed hold)\r\n? (current status)\r\n"
+                        "ctrl-x (reset Grbl)\r\n", now);
+      SendOk(now);
+   }
+   else if (line == "$$")
+   {
+      if (!idle)
+         SendError(ErrIdle, "Busy or queued", now);
+      else
+      {
+         SendSettings(now);
+         SendOk(now);
+      }
+   }
+   else if (line == "$X")
+   {
+      if (state_ == Alarm)
+      {
+         state_ = Idle;
+         Send(version11_ ? "[MSG:Caution: Unlocked]\r\n" : "[Caution: Unlocked]\r\n", now);
+      }
+      SendOk(now);
+   }
+   else if (line == "$H")
+   {
+      if (Setting(22) == 0.0)
+         SendError(ErrSettingDisabled, "Setting disabled", now);
+      else if (!idle)
+         SendError(ErrIdle, "Busy or queued", now);
+      else
+      {
+         // homing is instantaneous here; machine zero is the home position
+         for (int i = 0; i < 3; i++)
+            position_[i] = plannedEnd_[i] = 0.0;
+         state_ = Idle;
+         SendOk(now);
+      }
+   }
+   else if (line == "$G")
+   {
+      char buff[120];
+      snprintf(buff, sizeof(buff), "[%sG%d G54 G17 G21 G%d G94 M0 M%d M%d T0 F%.1f S0.]\r\n",
+            version11_ ? "GC:" : "", motionMode_, absolute_ ? 90 : 91, spindleOn_ ? 3 : 5,
+            floodOn_ ? 8 : (mistOn_ ? 7 : 9), feed_);
+      Send(buff, now);
+      SendOk(now);
+   }
+   else if (line == "$#")
+   {
+      char buff[100];
+      snprintf(buff, sizeof(buff), "[G92:%.3f,%.3f,%.3f]\r\n", g92_[0], g92_[1], g92_[2]);
+      Send(buff, now);
+      SendOk(now);
+   }
+   else if (line == "$I")
+   {
+      Send(version11_ ? "[VER:1.1f.20170801:]\r\n[OPT:V,15,128]\r\n" : "[0.9j.20160726:]\r\n", now);
+      SendOk(now);
+   }
+   else if (line.compare(0, 3, "$J=") == 0)
+   {
+      if (!version11_)
+      {
+         SendError(ErrInvalidStatement, "Invalid statement", now);
+         return true;
+      }
+      if (state_ != Idle && state_ != Jog)
+      {
+         SendError(ErrIdle, "Busy or queued", now);
+         return true;
+      }
+      std::vector<std::pair<char, double> > words;
+      int error = 0;
+      if (!ParseWords(line.substr(3), words, error))
+      {
+         SendError(error, "", now);
+         return true;
+      }
+      bool absolute = absolute_, machineCoords = false;
+      bool hasAxis[3] = {false, false, false};
+      double axis[3] = {0.0, 0.0, 0.0};
+      double feed = -1.0;
+      for (size_t i = 0; i < words.size(); i++)
+      {
+         char letter = words[i].first;
+         double value = words[i].second;
+         if (letter == 'G' && value == 90.0)
+            absolute = true;
+         else if (letter == 'G' && value == 91.0)
+            absolute = false;
+         else if (letter == 'G' && value == 53.0)
+            machineCoords = true;
+         else if (letter == 'G' && value == 21.0)
+            ;
+         else if (letter >= 'X' && letter <= 'Z')
+         {
+            hasAxis[letter - 'X'] = true;
+            axis[letter - 'X'] = value;
+         }
+         else if (letter == 'F')
+            feed = value;
+         else
+         {
+            SendError(ErrInvalidJog, "", now);
+            return true;
+         }
+      }
+      if (feed <= 0.0 || !(hasAxis[0] || hasAxis[1] || hasAxis[2]))
+      {
+         SendError(ErrInvalidJog, "", now);
+         return true;
+      }
+      if (planner_.size() >= (size_t) PlannerSize)
+         return false;
+      // jog motion never changes the parser's modal state
+      double target[3];
+      for (int i = 0; i < 3; i++)
+      {
+         target[i] = plannedEnd_[i];
+         if (!hasAxis[i])
+            continue;
+         if (machineCoords)
+            target[i] = axis[i];
+         else if (absolute)
+            target[i] = axis[i] + g92_[i];
+         else
+            target[i] += axis[i];
+      }
+      PlanBlock(target, feed, false, true);
+      StartIfIdle(now);
+      SendOk(now);
+   }
+   else if (line.size() > 2 && isdigit((unsigned char) line[1]) && line.find('=') != std::string::npos)
+   {
+      int number = atoi(line.c_str() + 1);
+      const char* valueText = line.c_str() + line.find('=') + 1;
+      size_t length = 0;
+      double value = 0.0;
+      if (!ReadNumber(valueText, length, value) || valueText[length] != 0)
+         SendError(ErrBadNumberFormat, "Bad number format", now);
+      else if (settings_.find(number) == settings_.end())
+         SendError(ErrInvalidStatement, "Invalid statement", now);
+      else if (!idle)
+         SendError(ErrIdle, "Busy or queued", now);
+      else
+      {
+         settings_[number] = value;
+         SendOk(now);
+      }
+   }
+   else
+      SendError(ErrInvalidStatement, "Invalid statement", now);
+   return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Output
+///////////////////////////////////////////////////////////////////////////////
+
+void GrblSimulator::Send(const std::string& text, double now)
+{
+   Chunk chunk;
+   chunk.at = std::max(now, outputEnd_) + text.size() * charTime_;
+   chunk.data = text;
+   outputEnd_ = chunk.at;
+   output_.push_back(chunk);
+}
+
+void GrblSimulator::SendError(int code, const char* message, double now)
+{
+   char buff[80];
+   if (version11_)
+      snprintf(buff, sizeof(buff), "error:%d\r\n", code);
+   else
+      snprintf(buff, sizeof(buff), "error: %s\r\n", message);
+   Send(buff, now);
+}
+
+void GrblSimulator::SendBanner(double now)
+{
+   Send(version11_ ? "\r\nGrbl 1.1f ['$' for help]\r\n" : "\r\nGrbl 0.9j ['$' for help]\r\n", now);
+}
+
+void GrblSimulator::SendStatus(double now)
+{
+   double mpos[3];
+   CurrentPosition(now, mpos);
+   const char* state = "Idle";
+   switch (state_)
+   {
+      case Idle: state = "Idle"; break;
+      case Run: state = "Run"; break;
+      case Jog: state = "Jog"; break;
+      case Alarm: state = "Alarm"; break;
+      case Hold:
+         if (version11_)
+            state = holdComplete_ ? "Hold:0" : "Hold:1";
+         else
+            state = "Hold";
+         break;
+   }
+
+   char buff[200];
+   if (!version11_)
+   {
+      snprintf(buff, sizeof(buff), "<%s,MPos:%.3f,%.3f,%.3f,WPos:%.3f,%.3f,%.3f>\r\n", state,
+            mpos[0], mpos[1], mpos[2], mpos[0] - g92_[0], mpos[1] - g92_[1], mpos[2] - g92_[2]);
+      Send(buff, now);
+      return;
+   }
+
+   std::string report;
+   snprintf(buff, sizeof(buff), "<%s|MPos:%.3f,%.3f,%.3f|Bf:%d,%d|FS:%.0f,0", state,
+         mpos[0], mpos[1], mpos[2], PlannerSize - 1 - (int) planner_.size(),
+         RxBufferSize - (int) rxBuffer_.size(), CurrentFeed(now));
+   report = buff;
+   // like Grbl, only refresh the work coordinate offset every few reports,
+   // and right after it has changed
+   if (reportCount_++ % 10 == 0)
+   {
+      snprintf(buff, sizeof(buff), "|WCO:%.3f,%.3f,%.3f", g92_[0], g92_[1], g92_[2]);
+      report += buff;
+   }
+   if (spindleOn_ || floodOn_ || mistOn_)
+   {
+      report += "|A:";
+      if (spindleOn_)
+         report += "S";
+      if (floodOn_)
+         report += "F";
+      if (mistOn_)
+         report += "M";
+   }
+   report += ">\r\n";
+   Send(report, now);
+}
+
+void GrblSimulator::SendSettings(double now)
+{
+   std::string text;
+   for (int i = 0; i < g_settingCount; i++)
+   {
+      const SettingInfo& info = g_defaultSettings[i];
+      char buff[100];
+      double value = settings_[info.number];
+      if (info.integer)
+         snprintf(buff, sizeof(buff), "$%d=%d", info.number, (int) value);
+      else
+         snprintf(buff, sizeof(buff), "$%d=%.3f", info.number, value);
+      text += buff;
+      if (!version11_)
+      {
+         text += " (";
+         text += info.description;
+         text += ")";
+      }
+      text += "\r\n";
+   }
+   Send(text, now);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CGrblSimulatedPort
+///////////////////////////////////////////////////////////////////////////////
+
+CGrblSimulatedPort::CGrblSimulatedPort() :
+   initialized_(false),
+   version11_(false),
+   baudRate_(115200),
+   simulateWireTime_(true),
+   startupDelayMs_(0.0),
+   answerTimeoutMs_(500.0)
+{
+   CPropertyAction* pAct = new CPropertyAction(this, &CGrblSimulatedPort::OnVersion);
+   CreateProperty("GrblVersion", "0.9j", MM::String, false, pAct, true);
+   AddAllowedValue("GrblVersion", "0.9j");
+   AddAllowedValue("GrblVersion", "1.1f");
+
+   // the same properties as a real serial port, so that the hub can
+   // configure either, and like a real port they exist before it is
+   // opened: device detection sets them, then opens and closes the port
+   // once per baud rate
+   pAct = new CPropertyAction(this, &CGrblSimulatedPort::OnBaudRate);
+   CreateProperty(MM::g_Keyword_BaudRate, "115200", MM::String, false, pAct);
+   const char* rates[] = {"9600", "19200", "38400", "57600", "115200"};
+   for (unsigned i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+      AddAllowedValue(MM::g_Keyword_BaudRate, rates[i]);
+
+   pAct = new CPropertyAction(this, &CGrblSimulatedPort::OnAnswerTimeout);
+   CreateProperty(MM::g_Keyword_AnswerTimeout, "500.0", MM::Float, false, pAct);
+   CreateProperty(MM::g_Keyword_Handshaking, "Off", MM::String, false);
+   CreateProperty(MM::g_Keyword_StopBits, "1", MM::String, false);
+   CreateProperty("DelayBetweenCharsMs", "0", MM::Float, false);
+   CreateProperty("Verbose", "0", MM::Integer, false);
+
+   pAct = new CPropertyAction(this, &CGrblSimulatedPort::OnSimulateWireTime);
+   CreateProperty("SimulateWireTime", "Yes", MM::String, false, pAct);
+   AddAllowedValue("SimulateWireTime", "Yes");
+   AddAllowedValue("SimulateWireTime", "No");
+
+   pAct = new CPropertyAction(this, &CGrblSimulatedPort::OnStartupDelay);
+   CreateProperty("StartupDelayMs", "0", MM::Float, false, pAct);
+   SetPropertyLimits("StartupDelayMs", 0, 5000);
+
+   pAct = new CPropertyAction(this, &CGrblSimulatedPort::OnRxOverflows);
+   CreateProperty("RxOverflows", "0", MM::Integer, true, pAct);
+}
+
+CGrblSimulatedPort::~CGrblSimulatedPort()
+{
+   Shutdown();
+}
+
+void CGrblSimulatedPort::GetName(char* pszName) const
+{
+   CDeviceUtils::CopyLimitedString(pszName, g_GrblSimulatorDeviceName);
+}
+
+int CGrblSimulatedPort::Initialize()
+{
+   if (initialized_)
+      return DEVICE_OK;
+
+   MMThreadGuard guard(lock_);
+   sim_.SetVersion11(version11_);
+   UpdateCharTime();
+   sim_.PowerUp(Now());
+   received_.clear();
+   initialized_ = true;
+   return DEVICE_OK;
+}
+
+int CGrblSimulatedPort::Shutdown()
+{
+   initialized_ = false;
+   return DEVICE_OK;
+}
+
+double CGrblSimulatedPort::Now() const
+{
+   return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CGrblSimulatedPort::UpdateCharTime()
+{
+   // 8N1: ten bits on the wire per character
+   sim_.SetCharTime(simulateWireTime_ ? 10.0 / baudRate_ : 0.0);
+   sim_.SetStartupDelay(startupDelayMs_ / 1000.0);
+}
+
+int CGrblSimulatedPort::SetCommand(const char* command, const char* term)
+{
+   std::string text = std::string(command) + term;
+   return Write((const unsigned char*) text.c_str(), (unsigned long) text.size());
+}
+
+int CGrblSimulatedPort::GetAnswer(char* txt, unsigned maxChars, const char* term)
+{
+   if (!initialized_)
+      return DEVICE_NOT_CONNECTED;
+   double deadline = Now() + answerTimeoutMs_ / 1000.0;
+   for (;;)
+   {
+      {
+         MMThreadGuard guard(lock_);
+         double now = Now();
+         char buff[256];
+         size_t n;
+         while ((n = sim_.Read(buff, sizeof(buff), now)) > 0)
+            received_.append(buff, n);
+         size_t pos = received_.find(term);
+         if (pos != std::string::npos)
+         {
+            std::string answer = received_.substr(0, pos);
+            received_.erase(0, pos + strlen(term));
+            CDeviceUtils::CopyLimitedString(txt, answer.substr(0, maxChars > 0 ? maxChars - 1 : 0).c_str());
+            return DEVICE_OK;
+         }
+         if (now > deadline)
+            return DEVICE_SERIAL_TIMEOUT;
+      }
+      CDeviceUtils::SleepMs(1);
+   }
+}
+
+int CGrblSimulatedPort::Write(const unsigned char* buf, unsigned long bufLen)
+{
+   if (!initialized_)
+      return DEVICE_NOT_CONNECTED;
+   MMThreadGuard guard(lock_);
+   sim_.Receive(buf, bufLen, Now());
+   return DEVICE_OK;
+}
+
+int CGrblSimulatedPort::Read(unsigned char* buf, unsigned long bufLen, unsigned long& charsRead)
+{
+   if (!initialized_)
+      return DEVICE_NOT_CONNECTED;
+   MMThreadGuard guard(lock_);
+   charsRead = (unsigned long) std::min((size_t) bufLen, received_.size());
+   memcpy(buf, received_.data(), charsRead);
+   received_.erase(0, charsRead);
+   charsRead += (unsigned long) sim_.Read((char*) buf + charsRead, bufLen - charsRead, Now());
+   return DEVICE_OK;
+}
+
+int CGrblSimulatedPort::Purge()
+{
+   MMThreadGuard guard(lock_);
+   received_.clear();
+   sim_.Purge(Now());
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+///////////////////////////////////////////////////////////////////////////////
+
+int CGrblSimulatedPort::OnVersion(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(version11_ ? "1.1f" : "0.9j");
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string version;
+      pProp->Get(version);
+      version11_ = version == "1.1f";
+   }
+   return DEVICE_OK;
+}
+
+int CGrblSimulatedPort::OnBaudRate(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(baudRate_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string rate;
+      pProp->Get(rate);
+      baudRate_ = atol(rate.c_str());
+      MMThreadGuard guard(lock_);
+      UpdateCharTime();
+   }
+   return DEVICE_OK;
+}
+
+int CGrblSimulatedPort::OnSimulateWireTime(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(simulateWireTime_ ? "Yes" : "No");
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      simulateWireTime_ = value == "Yes";
+      MMThreadGuard guard(lock_);
+      UpdateCharTime();
+   }
+   return DEVICE_OK;
+}
+
+int CGrblSimulatedPort::OnStartupDelay(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(startupDelayMs_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(startupDelayMs_);
+      MMThreadGuard guard(lock_);
+      UpdateCharTime();
+   }
+   return DEVICE_OK;
+}
+
+int CGrblSimulatedPort::OnAnswerTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(answerTimeoutMs_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(answerTimeoutMs_);
+   }
+   return DEVICE_OK;
+}
+
+int CGrblSimulatedPort::OnRxOverflows(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(lock_);
+      pProp->Set(sim_.GetRxOverflows());
+   }
+   return DEVICE_OK;
+}
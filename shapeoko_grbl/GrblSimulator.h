@@ -0,0 +1,198 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblSimulator.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Simulated Grbl controller, exposed as a Micro-Manager serial
+//                port so that the hub and stages can run without hardware.
+//                Models the start-up banner, the 127 byte serial RX buffer,
+//                the planner queue, trapezoidal motion timing from the
+//                $110-$112 / $120-$122 settings, real-time commands and the
+//                0.9 and 1.1 status report formats.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifndef _GRBL_SIMULATOR_H_
+#define _GRBL_SIMULATOR_H_
+
+#include "DeviceBase.h"
+#include "DeviceThreads.h"
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////////////
+// GrblSimulator
+// The controller model.  Time is passed in explicitly, in seconds, so the
+// model itself never sleeps.
+//
+
+class GrblSimulator
+{
+public:
+   static const int RxBufferSize = 127;
+   static const int PlannerSize = 16;
+
+   GrblSimulator();
+
+   void SetVersion11(bool version11) { version11_ = version11; }
+   bool IsVersion11() const { return version11_; }
+   // serial transfer time per character (10 bits per character); 0 for none
+   void SetCharTime(double seconds) { charTime_ = seconds; }
+   // time from power-up (port open) to the banner, like an Arduino bootloader
+   void SetStartupDelay(double seconds) { startupDelay_ = seconds; }
+
+   void PowerUp(double now);
+   void Receive(const unsigned char* data, size_t length, double now);
+   void Update(double now);
+   // output that has made it across the wire by 'now'
+   size_t Available(double now);
+   size_t Read(char* buffer, size_t maxLength, double now);
+   void Purge(double now);
+
+   long GetRxOverflows() const { return rxOverflows_; }
+
+private:
+   enum State { Idle, Run, Hold, Jog, Alarm };
+   enum Wait { WaitNone, WaitDwell };
+
+   struct Block
+   {
+      double start[3];
+      double target[3];
+      double unit[3];
+      double length;
+      double vmax;
+      double accel;
+      double duration;
+      double startTime;
+      bool jog;
+   };
+
+   struct Chunk
+   {
+      double at;
+      std::string data;
+   };
+
+   // motion
+   void PlanBlock(const double target[3], double feedMmPerMin, bool rapid, bool jog);
+   void StartIfIdle(double now);
+   void AdvanceMotion(double now);
+   void BlockPosition(const Block& b, double t, double pos[3]) const;
+   double BlockVelocity(const Block& b, double t) const;
+   void CurrentPosition(double now, double pos[3]);
+   double CurrentFeed(double now);
+   void StartFeedHold(double now);
+   void Resume(double now);
+
+   // input
+   void HandleRealtime(unsigned char c, double now);
+   bool ProcessLine(const std::string& line, double now);
+   bool ExecuteSystemCommand(const std::string& line, double now);
+   bool ExecuteGcode(const std::string& line, double now);
+   bool ParseWords(const std::string& line, std::vector<std::pair<char, double> >& words, int& error);
+   void SoftReset(double now);
+
+   // output
+   void Send(const std::string& text, double now);
+   void SendOk(double now) { Send("ok\r\n", now); }
+   void SendError(int code, const char* message, double now);
+   void SendBanner(double now);
+   void SendStatus(double now);
+   void SendSettings(double now);
+
+   double Setting(int n) { return settings_[n]; }
+
+   bool version11_;
+   double charTime_;
+   double startupDelay_;
+   bool poweredUp_;
+   double bannerAt_;
+
+   std::deque<Chunk> input_;
+   double inputEnd_;
+   std::string rxBuffer_;
+   long rxOverflows_;
+   std::deque<Chunk> output_;
+   double outputEnd_;
+
+   State state_;
+   bool holdComplete_;
+   double holdStart_;
+   double holdPos_[3];
+   double holdVelocity_;
+   double holdAccel_;
+   double holdUnit_[3];
+   bool jogCancel_;
+
+   Wait wait_;
+   double waitUntil_;
+
+   std::deque<Block> planner_;
+   double position_[3];      // machine position at the end of the last finished block
+   double plannedEnd_[3];    // machine position at the end of the planner
+   double g92_[3];
+   bool absolute_;
+   int motionMode_;
+   double feed_;
+   bool spindleOn_;
+   bool floodOn_;
+   bool mistOn_;
+   long reportCount_;
+
+   std::map<int, double> settings_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// CGrblSimulatedPort
+// Serial port device backed by a GrblSimulator.  Set the hub's Port
+// property to this device's label to use it.
+//
+
+class CGrblSimulatedPort : public CSerialBase<CGrblSimulatedPort>
+{
+public:
+   CGrblSimulatedPort();
+   ~CGrblSimulatedPort();
+
+   // Device API
+   int Initialize();
+   int Shutdown();
+   void GetName(char* pszName) const;
+   bool Busy() { return false; }
+
+   // Serial API
+   MM::PortType GetPortType() const { return MM::SerialPort; }
+   int SetCommand(const char* command, const char* term);
+   int GetAnswer(char* txt, unsigned maxChars, const char* term);
+   int Write(const unsigned char* buf, unsigned long bufLen);
+   int Read(unsigned char* buf, unsigned long bufLen, unsigned long& charsRead);
+   int Purge();
+
+   // action interface
+   int OnVersion(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnBaudRate(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSimulateWireTime(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnStartupDelay(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAnswerTimeout(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRxOverflows(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+private:
+   double Now() const;
+   void UpdateCharTime();
+
+   GrblSimulator sim_;
+   MMThreadLock lock_;
+   bool initialized_;
+   bool version11_;
+   long baudRate_;
+   bool simulateWireTime_;
+   double startupDelayMs_;
+   double answerTimeoutMs_;
+   std::string received_;   // read from the simulator, not yet handed out
+};
+
+#endif // _GRBL_SIMULATOR_H_
@@ -0,0 +1,169 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblStats.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Command latency histograms and serial traffic counters.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#include "GrblStats.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+
+namespace {
+
+const double g_firstBucketMs = 0.01;
+const double g_bucketsPerOctave = 4.0;
+
+double BucketUpperMs(int bucket)
+{
+   return g_firstBucketMs * pow(2.0, (bucket + 1) / g_bucketsPerOctave);
+}
+
+} // namespace
+
+GrblCommandClass ClassifyGrblCommand(const std::string& line, bool isMotion)
+{
+   if (isMotion)
+      return GrblCommandMove;
+   if (line == "?")
+      return GrblCommandStatus;
+   if (line == "$X")
+      return GrblCommandUnlock;
+   if (line == "$$" || (line.size() > 1 && line[0] == '$' && isdigit((unsigned char) line[1])))
+      return GrblCommandSetting;
+   if (line.compare(0, 3, "$J=") == 0 || line.compare(0, 2, "G0") == 0 || line.compare(0, 2, "G1") == 0)
+      return GrblCommandMove;
+   return GrblCommandOther;
+}
+
+const char* GrblCommandClassName(GrblCommandClass commandClass)
+{
+   static const char* names[GrblCommandClassCount] = {
+      "Status", "Move", "Unlock", "Setting", "Realtime", "Other"
+   };
+   return names[commandClass];
+}
+
+void LatencyHistogram::Add(double ms)
+{
+   int bucket = 0;
+   if (ms > g_firstBucketMs)
+      bucket = (int) (g_bucketsPerOctave * log2(ms / g_firstBucketMs));
+   buckets_[std::min(std::max(bucket, 0), BucketCount - 1)]++;
+   count_++;
+   sumMs_ += ms;
+   maxMs_ = std::max(maxMs_, ms);
+}
+
+void LatencyHistogram::Clear()
+{
+   for (int i = 0; i < BucketCount; i++)
+      buckets_[i] = 0;
+   count_ = 0;
+   sumMs_ = 0.0;
+   maxMs_ = 0.0;
+}
+
+double LatencyHistogram::PercentileMs(double p) const
+{
+   if (count_ == 0)
+      return 0.0;
+   long rank = std::max(1L, (long) ceil(p * count_));
+   long seen = 0;
+   for (int i = 0; i < BucketCount; i++)
+   {
+      seen += buckets_[i];
+      if (seen >= rank)
+         return std::min(BucketUpperMs(i), maxMs_);
+   }
+   return maxMs_;
+}
+
+void GrblStats::RecordLatency(GrblCommandClass commandClass, double ms)
+{
+   MMThreadGuard guard(lock_);
+   latency_[commandClass].Add(ms);
+}
+
+void GrblStats::AddBytesSent(long bytes)
+{
+   MMThreadGuard guard(lock_);
+   bytesSent_ += bytes;
+}
+
+void GrblStats::AddBytesReceived(long bytes)
+{
+   MMThreadGuard guard(lock_);
+   bytesReceived_ += bytes;
+}
+
+void GrblStats::CountTimeout()
+{
+   MMThreadGuard guard(lock_);
+   timeouts_++;
+}
+
+void GrblStats::CountError()
+{
+   MMThreadGuard guard(lock_);
+   errors_++;
+}
+
+void GrblStats::CountAlarm()
+{
+   MMThreadGuard guard(lock_);
+   alarms_++;
+}
+
+void GrblStats::Reset()
+{
+   MMThreadGuard guard(lock_);
+   for (int i = 0; i < GrblCommandClassCount; i++)
+      latency_[i].Clear();
+   bytesSent_ = bytesReceived_ = 0;
+   timeouts_ = errors_ = alarms_ = 0;
+}
+
+std::string GrblStats::FormatLatency(GrblCommandClass commandClass)
+{
+   MMThreadGuard guard(lock_);
+   const LatencyHistogram& h = latency_[commandClass];
+   char buf[120];
+   snprintf(buf, sizeof(buf), "n=%ld p50=%.2f p99=%.2f max=%.2f ms", h.Count(),
+         h.PercentileMs(0.50), h.PercentileMs(0.99), h.MaxMs());
+   return buf;
+}
+
+long GrblStats::GetBytesSent()
+{
+   MMThreadGuard guard(lock_);
+   return bytesSent_;
+}
+
+long GrblStats::GetBytesReceived()
+{
+   MMThreadGuard guard(lock_);
+   return bytesReceived_;
+}
+
+long GrblStats::GetTimeouts()
+{
+   MMThreadGuard guard(lock_);
+   return timeouts_;
+}
+
+long GrblStats::GetErrors()
+{
+   MMThreadGuard guard(lock_);
+   return errors_;
+}
+
+long GrblStats::GetAlarms()
+{
+   MMThreadGuard guard(lock_);
+   return alarms_;
+}
@@ -0,0 +1,84 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblStats.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Command latency histograms and serial traffic counters,
+//                cheap enough to keep enabled all the time.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifndef _GRBL_STATS_H_
+#define _GRBL_STATS_H_
+
+#include "DeviceThreads.h"
+#include <string>
+
+enum GrblCommandClass
+{
+   GrblCommandStatus,     // '?' to status report
+   GrblCommandMove,       // motion line to 'ok'
+   GrblCommandUnlock,     // $X
+   GrblCommandSetting,    // $$, $N=value
+   GrblCommandRealtime,   // write of a real-time byte; there is no reply
+   GrblCommandOther,
+   GrblCommandClassCount
+};
+
+GrblCommandClass ClassifyGrblCommand(const std::string& line, bool isMotion);
+const char* GrblCommandClassName(GrblCommandClass commandClass);
+
+// Latencies in buckets of a quarter octave from 10 us up to about three
+// minutes.  Percentiles are the upper bucket edge, so at most 19% high.
+class LatencyHistogram
+{
+public:
+   static const int BucketCount = 96;
+
+   LatencyHistogram() { Clear(); }
+   void Add(double ms);
+   void Clear();
+   long Count() const { return count_; }
+   double MeanMs() const { return count_ > 0 ? sumMs_ / count_ : 0.0; }
+   double MaxMs() const { return maxMs_; }
+   double PercentileMs(double p) const;
+
+private:
+   long buckets_[BucketCount];
+   long count_;
+   double sumMs_;
+   double maxMs_;
+};
+
+class GrblStats
+{
+public:
+   GrblStats() { Reset(); }
+
+   void RecordLatency(GrblCommandClass commandClass, double ms);
+   void AddBytesSent(long bytes);
+   void AddBytesReceived(long bytes);
+   void CountTimeout();
+   void CountError();
+   void CountAlarm();
+   void Reset();
+
+   // "n=120 p50=2.4 p99=8.1 max=9.0 ms"
+   std::string FormatLatency(GrblCommandClass commandClass);
+   long GetBytesSent();
+   long GetBytesReceived();
+   long GetTimeouts();
+   long GetErrors();
+   long GetAlarms();
+
+private:
+   MMThreadLock lock_;
+   LatencyHistogram latency_[GrblCommandClassCount];
+   long bytesSent_;
+   long bytesReceived_;
+   long timeouts_;
+   long errors_;
+   long alarms_;
+};
+
+#endif // _GRBL_STATS_H_
@@ -0,0 +1,262 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblStatusReport.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   In-place parser for Grbl '?' status reports.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#include "GrblStatusReport.h"
+#include <cstring>
+
+namespace {
+
+const double g_pow10[] = {
+   1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+   1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+};
+
+bool IsNumberStart(char c)
+{
+   return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.';
+}
+
+// Grbl prints plain decimals ("-12.345"), so a digit loop is all we need.
+bool ParseNumber(const char*& p, const char* end, double& value)
+{
+   bool negative = false;
+   if (p < end && (*p == '-' || *p == '+'))
+   {
+      negative = (*p == '-');
+      ++p;
+   }
+   long long mantissa = 0;
+   int digits = 0;
+   int scale = 0;
+   bool fraction = false;
+   bool any = false;
+   while (p < end)
+   {
+      char c = *p;
+      if (c >= '0' && c <= '9')
+      {
+         any = true;
+         if (digits < 18)
+         {
+            mantissa = mantissa * 10 + (c - '0');
+            digits++;
+            if (fraction)
+               scale++;
+         }
+         else if (!fraction)
+            scale--; // integer digits beyond the mantissa's precision
+      }
+      else if (c == '.' && !fraction)
+         fraction = true;
+      else
+         break;
+      ++p;
+   }
+   if (!any)
+      return false;
+   double v = (double) mantissa;
+   if (scale > 0)
+      v /= g_pow10[scale];
+   else if (scale < 0)
+      v *= g_pow10[-scale];
+   value = negative ? -v : v;
+   return true;
+}
+
+// Parses a comma separated list of numbers.  In the 0.9 format the list
+// separator is also the field separator, so the list ends at the first
+// item that is not a number.  Values beyond maxValues are skipped.
+int ParseValues(const char*& p, const char* end, char separator, double* values, int maxValues)
+{
+   int count = 0;
+   for (;;)
+   {
+      double v;
+      if (!ParseNumber(p, end, v))
+         return -1;
+      if (count < maxValues)
+         values[count] = v;
+      count++;
+      if (p == end || *p != ',')
+         break;
+      if (separator == ',' && (p + 1 == end || !IsNumberStart(p[1])))
+         break;
+      ++p;
+   }
+   return count;
+}
+
+// Copies a text field (pin states, accessories) up to the next separator.
+void ParseText(const char*& p, const char* end, char separator, char* out, size_t outSize)
+{
+   size_t n = 0;
+   while (p < end && *p != separator && *p != '|')
+   {
+      if (n < outSize - 1)
+         out[n++] = *p;
+      ++p;
+   }
+   out[n] = 0;
+}
+
+bool KeyIs(const char* key, size_t length, const char* name)
+{
+   return strlen(name) == length && memcmp(key, name, length) == 0;
+}
+
+} // namespace
+
+void GrblStatusReport::Clear()
+{
+   state[0] = 0;
+   subState = -1;
+   hasMPos = hasWPos = hasWCO = false;
+   for (int i = 0; i < MaxAxes; i++)
+      MPos[i] = WPos[i] = WCO[i] = 0.0;
+   hasPlannerBlocks = hasRxBytes = false;
+   plannerBlocks = rxBytes = 0;
+   hasLineNumber = false;
+   lineNumber = 0;
+   hasFeed = hasSpindle = false;
+   feed = spindle = 0.0;
+   hasOverrides = false;
+   overrides[0] = overrides[1] = overrides[2] = 100;
+   pins[0] = 0;
+   accessories[0] = 0;
+}
+
+bool ParseGrblStatusReport(const char* text, size_t length, GrblStatusReport& r)
+{
+   r.Clear();
+   const char* p = text;
+   const char* end = text + length;
+   while (end > p && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' '))
+      --end;
+   if (end - p < 2 || *p != '<' || end[-1] != '>')
+      return false;
+   ++p;
+   --end;
+
+   // machine state, optionally with a 1.1 sub-state ("Hold:0")
+   size_t n = 0;
+   while (p < end && *p != ',' && *p != '|' && *p != ':')
+   {
+      if (n < sizeof(r.state) - 1)
+         r.state[n++] = *p;
+      ++p;
+   }
+   r.state[n] = 0;
+   if (n == 0)
+      return false;
+   if (p < end && *p == ':')
+   {
+      ++p;
+      double sub;
+      if (!ParseNumber(p, end, sub))
+         return false;
+      r.subState = (int) sub;
+   }
+
+   // 1.1 separates fields with '|', 0.9 with ','
+   char separator = (p < end) ? *p : '|';
+   double values[GrblStatusReport::MaxAxes];
+   while (p < end)
+   {
+      if (*p != separator)
+         return false;
+      ++p;
+      const char* key = p;
+      while (p < end && *p != ':' && *p != separator)
+         ++p;
+      size_t keyLength = p - key;
+      if (p == end || *p != ':')
+         return false;
+      ++p;
+
+      int count;
+      if (KeyIs(key, keyLength, "MPos"))
+      {
+         r.hasMPos = ParseValues(p, end, separator, r.MPos, GrblStatusReport::MaxAxes) >= GrblStatusReport::MaxAxes;
+         if (!r.hasMPos)
+            return false;
+      }
+      else if (KeyIs(key, keyLength, "WPos"))
+      {
+         r.hasWPos = ParseValues(p, end, separator, r.WPos, GrblStatusReport::MaxAxes) >= GrblStatusReport::MaxAxes;
+         if (!r.hasWPos)
+            return false;
+      }
+      else if (KeyIs(key, keyLength, "WCO"))
+      {
+         r.hasWCO = ParseValues(p, end, separator, r.WCO, GrblStatusReport::MaxAxes) >= GrblStatusReport::MaxAxes;
+         if (!r.hasWCO)
+            return false;
+      }
+      else if (KeyIs(key, keyLength, "Pn") || KeyIs(key, keyLength, "Lim"))
+         ParseText(p, end, separator, r.pins, sizeof(r.pins));
+      else if (KeyIs(key, keyLength, "A"))
+         ParseText(p, end, separator, r.accessories, sizeof(r.accessories));
+      else if (p < end && !IsNumberStart(*p))
+      {
+         // unknown text field (e.g. 0.9 "Ctl:")
+         char ignored[2];
+         ParseText(p, end, separator, ignored, sizeof(ignored));
+      }
+      else
+      {
+         count = ParseValues(p, end, separator, values, GrblStatusReport::MaxAxes);
+         if (count < 0)
+            return false;
+         if (KeyIs(key, keyLength, "Bf") && count >= 2)
+         {
+            r.hasPlannerBlocks = r.hasRxBytes = true;
+            r.plannerBlocks = (int) values[0];
+            r.rxBytes = (int) values[1];
+         }
+         else if (KeyIs(key, keyLength, "Buf"))
+         {
+            r.hasPlannerBlocks = true;
+            r.plannerBlocks = (int) values[0];
+         }
+         else if (KeyIs(key, keyLength, "RX"))
+         {
+            r.hasRxBytes = true;
+            r.rxBytes = (int) values[0];
+         }
+         else if (KeyIs(key, keyLength, "Ln"))
+         {
+            r.hasLineNumber = true;
+            r.lineNumber = (long) values[0];
+         }
+         else if (KeyIs(key, keyLength, "FS"))
+         {
+            r.hasFeed = true;
+            r.feed = values[0];
+            if (count >= 2)
+            {
+               r.hasSpindle = true;
+               r.spindle = values[1];
+            }
+         }
+         else if (KeyIs(key, keyLength, "F"))
+         {
+            r.hasFeed = true;
+            r.feed = values[0];
+         }
+         else if (KeyIs(key, keyLength, "Ov") && count >= 3)
+         {
+            r.hasOverrides = true;
+            r.overrides[0] = (int) values[0];
+            r.overrides[1] = (int) values[1];
+            r.overrides[2] = (int) values[2];
+         }
+      }
+   }
+   return true;
+}
@@ -0,0 +1,56 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblStatusReport.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   In-place parser for Grbl '?' status reports.  Understands
+//                the 0.9 format
+//                   <Idle,MPos:0.000,0.000,0.000,WPos:0.000,0.000,0.000,Buf:0,RX:0>
+//                and the 1.1 format
+//                   <Idle|MPos:0.000,0.000,0.000|Bf:15,128|FS:0,0|WCO:0.000,0.000,0.000>
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifndef _GRBL_STATUS_REPORT_H_
+#define _GRBL_STATUS_REPORT_H_
+
+#include <cstddef>
+
+struct GrblStatusReport
+{
+   static const int MaxAxes = 3;
+
+   char state[16];        // "Idle", "Run", "Hold", "Jog", "Alarm", ...
+   int subState;          // 1.1 "Hold:0" / "Door:1"; -1 when absent
+
+   bool hasMPos;
+   double MPos[MaxAxes];
+   bool hasWPos;
+   double WPos[MaxAxes];
+   bool hasWCO;
+   double WCO[MaxAxes];
+
+   bool hasPlannerBlocks; // Bf: (1.1) / Buf: (0.9)
+   int plannerBlocks;
+   bool hasRxBytes;       // Bf: (1.1) / RX: (0.9)
+   int rxBytes;
+   bool hasLineNumber;    // Ln:
+   long lineNumber;
+   bool hasFeed;          // FS: / F:
+   double feed;
+   bool hasSpindle;       // FS:
+   double spindle;
+   bool hasOverrides;     // Ov: feed, rapid, spindle in percent
+   int overrides[3];
+   char pins[16];         // Pn: (1.1) / Lim: (0.9), empty when absent
+   char accessories[8];   // A:, empty when absent
+
+   void Clear();
+};
+
+// Parses a single report (with or without the trailing line end) into
+// report.  Does not allocate.  Returns false if the text is not a status
+// report or a field is malformed.
+bool ParseGrblStatusReport(const char* text, size_t length, GrblStatusReport& report);
+
+#endif // _GRBL_STATUS_REPORT_H_
@@ -0,0 +1,69 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblStressTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   grbl_stress_test: sends commands to the hub from several
+//                threads at once, for both firmware versions and both
+//                streaming modes of the simulated controller, and exits
+//                non-zero if any reply was mismatched or any call failed.
+//
+//                grbl_stress_test [-t threads] [-n commands] [-v]
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#include "GrblBenchmark.h"
+#include "GrblTestCore.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+int main(int argc, char** argv)
+{
+   long threads = 4;
+   long commands = 250;
+   bool verbose = false;
+   for (int i = 1; i < argc; i++)
+   {
+      bool hasValue = i + 1 < argc;
+      if (strcmp(argv[i], "-t") == 0 && hasValue)
+         threads = atol(argv[++i]);
+      else if (strcmp(argv[i], "-n") == 0 && hasValue)
+         commands = atol(argv[++i]);
+      else if (strcmp(argv[i], "-v") == 0)
+         verbose = true;
+      else
+      {
+         fprintf(stderr, "usage: %s [-t threads] [-n commands] [-v]\n", argv[0]);
+         return 2;
+      }
+   }
+
+   const char* firmwares[] = {"0.9j", "1.1f"};
+   const char* streamingModes[] = {"Lock-step", "Character-counting"};
+   bool passed = true;
+   for (int f = 0; f < 2; f++)
+   {
+      for (int s = 0; s < 2; s++)
+      {
+         GrblTestCore core;
+         core.SetVerbose(verbose);
+         int ret = core.Open(firmwares[f], streamingModes[s]);
+         StressBenchmarkResult result;
+         if (ret == DEVICE_OK)
+            ret = RunStressBenchmark(*core.GetHub(), threads, commands, result);
+         core.Close();
+         if (ret != DEVICE_OK)
+         {
+            printf("FAIL %s %s: error %d\n", firmwares[f], streamingModes[s], ret);
+            passed = false;
+            continue;
+         }
+         bool ok = result.mismatched == 0 && result.failed == 0;
+         printf("%s %s %s: %s\n", ok ? "ok  " : "FAIL", firmwares[f], streamingModes[s],
+               FormatStressBenchmark(result).c_str());
+         passed = passed && ok;
+      }
+   }
+   return passed ? 0 : 1;
+}
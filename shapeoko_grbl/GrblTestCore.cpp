@@ -0,0 +1,239 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblTestCore.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Minimal stand-in for the Micro-Manager core.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#include "GrblTestCore.h"
+#include "ShapeokoGrbl.h"
+#include "XYStage.h"
+#include "ZStage.h"
+#include "GrblSimulator.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+extern const char* g_XYStageDeviceName;
+extern const char* g_ZStageDeviceName;
+extern const char* g_HubDeviceName;
+extern const char* g_GrblSimulatorDeviceName;
+
+GrblTestCore::GrblTestCore() :
+   port_(0),
+   hub_(0),
+   xyStage_(0),
+   zStage_(0),
+   verbose_(false)
+{
+}
+
+GrblTestCore::~GrblTestCore()
+{
+   Close();
+}
+
+void GrblTestCore::Add(MM::Device* device, const char* label)
+{
+   device->SetLabel(label);
+   device->SetCallback(this);
+   devices_[label] = device;
+}
+
+int GrblTestCore::Open(const char* firmware, const char* streamingMode)
+{
+   Close();
+   port_ = new CGrblSimulatedPort();
+   Add(port_, g_GrblSimulatorDeviceName);
+   int ret = port_->SetProperty("GrblVersion", firmware);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   hub_ = new ShapeokoGrblHub();
+   Add(hub_, g_HubDeviceName);
+   ret = hub_->SetProperty(MM::g_Keyword_Port, g_GrblSimulatorDeviceName);
+   if (ret != DEVICE_OK)
+      return ret;
+   // as the hardware configuration wizard does: detection opens and closes
+   // the port itself, and it is opened for good afterwards
+   if (hub_->DetectDevice() != MM::CanCommunicate)
+      return DEVICE_NOT_CONNECTED;
+   ret = port_->Initialize();
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = hub_->Initialize();
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = hub_->SetProperty("StreamingMode", streamingMode);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   xyStage_ = new CShapeokoGrblXYStage();
+   Add(xyStage_, g_XYStageDeviceName);
+   ret = xyStage_->Initialize();
+   if (ret != DEVICE_OK)
+      return ret;
+   zStage_ = new ZStage();
+   Add(zStage_, g_ZStageDeviceName);
+   return zStage_->Initialize();
+}
+
+// peripherals first, the port last, as the core unloads them
+void GrblTestCore::Close()
+{
+   MM::Device* devices[] = {zStage_, xyStage_, hub_, port_};
+   for (int i = 0; i < 4; i++)
+   {
+      if (devices[i] == 0)
+         continue;
+      devices[i]->Shutdown();
+      delete devices[i];
+   }
+   devices_.clear();
+   port_ = 0;
+   hub_ = 0;
+   xyStage_ = 0;
+   zStage_ = 0;
+}
+
+MM::Serial* GrblTestCore::GetPort(const char* label)
+{
+   return dynamic_cast<MM::Serial*>(GetDevice(0, label));
+}
+
+int GrblTestCore::LogMessage(const MM::Device* caller, const char* msg, bool /*debugOnly*/) const
+{
+   if (verbose_)
+   {
+      char label[MM::MaxStrLength] = "";
+      if (caller != 0)
+         caller->GetLabel(label);
+      fprintf(stderr, "[%s] %s\n", label, msg);
+   }
+   return DEVICE_OK;
+}
+
+MM::Device* GrblTestCore::GetDevice(const MM::Device* /*caller*/, const char* label)
+{
+   std::map<std::string, MM::Device*>::iterator it = devices_.find(label);
+   return it != devices_.end() ? it->second : 0;
+}
+
+int GrblTestCore::GetDeviceProperty(const char* deviceName, const char* propName, char* value)
+{
+   MM::Device* device = GetDevice(0, deviceName);
+   return device != 0 ? device->GetProperty(propName, value) : DEVICE_ERR;
+}
+
+int GrblTestCore::SetDeviceProperty(const char* deviceName, const char* propName, const char* value)
+{
+   MM::Device* device = GetDevice(0, deviceName);
+   return device != 0 ? device->SetProperty(propName, value) : DEVICE_ERR;
+}
+
+void GrblTestCore::GetLoadedDeviceOfType(const MM::Device* /*caller*/, MM::DeviceType /*devType*/, char* pDeviceName, const unsigned int /*deviceIterator*/)
+{
+   pDeviceName[0] = 0;
+}
+
+int GrblTestCore::SetSerialProperties(const char* portName, const char* answerTimeout, const char* baudRate, const char* delayBetweenCharsMs, const char* handshaking, const char* /*parity*/, const char* stopBits)
+{
+   SetDeviceProperty(portName, MM::g_Keyword_AnswerTimeout, answerTimeout);
+   SetDeviceProperty(portName, MM::g_Keyword_BaudRate, baudRate);
+   SetDeviceProperty(portName, "DelayBetweenCharsMs", delayBetweenCharsMs);
+   SetDeviceProperty(portName, MM::g_Keyword_Handshaking, handshaking);
+   SetDeviceProperty(portName, MM::g_Keyword_StopBits, stopBits);
+   return DEVICE_OK;
+}
+
+int GrblTestCore::SetSerialCommand(const MM::Device* /*caller*/, const char* portName, const char* command, const char* term)
+{
+   MM::Serial* port = GetPort(portName);
+   return port != 0 ? port->SetCommand(command, term) : DEVICE_NOT_CONNECTED;
+}
+
+int GrblTestCore::GetSerialAnswer(const MM::Device* /*caller*/, const char* portName, unsigned long ansLength, char* answer, const char* term)
+{
+   MM::Serial* port = GetPort(portName);
+   return port != 0 ? port->GetAnswer(answer, (unsigned) ansLength, term) : DEVICE_NOT_CONNECTED;
+}
+
+int GrblTestCore::WriteToSerial(const MM::Device* /*caller*/, const char* portName, const unsigned char* buf, unsigned long length)
+{
+   MM::Serial* port = GetPort(portName);
+   return port != 0 ? port->Write(buf, length) : DEVICE_NOT_CONNECTED;
+}
+
+int GrblTestCore::ReadFromSerial(const MM::Device* /*caller*/, const char* portName, unsigned char* buf, unsigned long length, unsigned long& read)
+{
+   MM::Serial* port = GetPort(portName);
+   return port != 0 ? port->Read(buf, length, read) : DEVICE_NOT_CONNECTED;
+}
+
+int GrblTestCore::PurgeSerial(const MM::Device* /*caller*/, const char* portName)
+{
+   MM::Serial* port = GetPort(portName);
+   return port != 0 ? port->Purge() : DEVICE_NOT_CONNECTED;
+}
+
+MM::PortType GrblTestCore::GetSerialPortType(const char* /*portName*/) const
+{
+   return MM::SerialPort;
+}
+
+unsigned long GrblTestCore::GetClockTicksUs(const MM::Device* /*caller*/)
+{
+   return (unsigned long) GetCurrentMMTime().getUsec();
+}
+
+MM::MMTime GrblTestCore::GetCurrentMMTime()
+{
+   double us = std::chrono::duration<double, std::micro>(
+         std::chrono::steady_clock::now().time_since_epoch()).count();
+   return MM::MMTime(us);
+}
+
+MM::Hub* GrblTestCore::GetParentHub(const MM::Device* /*caller*/) const
+{
+   return hub_;
+}
+
+// Nothing below is used by the hub or the stages
+
+int GrblTestCore::OnPropertiesChanged(const MM::Device*) { return DEVICE_OK; }
+int GrblTestCore::OnPropertyChanged(const MM::Device*, const char*, const char*) { return DEVICE_OK; }
+int GrblTestCore::OnStagePositionChanged(const MM::Device*, double) { return DEVICE_OK; }
+int GrblTestCore::OnXYStagePositionChanged(const MM::Device*, double, double) { return DEVICE_OK; }
+int GrblTestCore::OnExposureChanged(const MM::Device*, double) { return DEVICE_OK; }
+int GrblTestCore::OnSLMExposureChanged(const MM::Device*, double) { return DEVICE_OK; }
+int GrblTestCore::OnMagnifierChanged(const MM::Device*) { return DEVICE_OK; }
+int GrblTestCore::AcqFinished(const MM::Device*, int) { return DEVICE_OK; }
+int GrblTestCore::PrepareForAcq(const MM::Device*) { return DEVICE_OK; }
+int GrblTestCore::InsertImage(const MM::Device*, const unsigned char*, unsigned, unsigned, unsigned, const char*, const bool) { return DEVICE_UNSUPPORTED_COMMAND; }
+int GrblTestCore::InsertImage(const MM::Device*, const unsigned char*, unsigned, unsigned, unsigned, const Metadata*, const bool) { return DEVICE_UNSUPPORTED_COMMAND; }
+int GrblTestCore::InsertImage(const MM::Device*, const unsigned char*, unsigned, unsigned, unsigned, unsigned, const char*, const bool) { return DEVICE_UNSUPPORTED_COMMAND; }
+void GrblTestCore::ClearImageBuffer(const MM::Device*) {}
+bool GrblTestCore::InitializeImageBuffer(unsigned, unsigned, unsigned int, unsigned int, unsigned int) { return false; }
+int GrblTestCore::InsertMultiChannel(const MM::Device*, const unsigned char*, unsigned, unsigned, unsigned, unsigned, Metadata*) { return DEVICE_UNSUPPORTED_COMMAND; }
+const char* GrblTestCore::GetImage() { return 0; }
+int GrblTestCore::GetImageDimensions(int&, int&, int&) { return DEVICE_UNSUPPORTED_COMMAND; }
+int GrblTestCore::GetFocusPosition(double&) { return DEVICE_UNSUPPORTED_COMMAND; }
+int GrblTestCore::SetFocusPosition(double) { return DEVICE_UNSUPPORTED_COMMAND; }
+int GrblTestCore::MoveFocus(double) { return DEVICE_UNSUPPORTED_COMMAND; }
+int GrblTestCore::SetXYPosition(double, double) { return DEVICE_UNSUPPORTED_COMMAND; }
+int GrblTestCore::GetXYPosition(double&, double&) { return DEVICE_UNSUPPORTED_COMMAND; }
+int GrblTestCore::MoveXYStage(double, double) { return DEVICE_UNSUPPORTED_COMMAND; }
+int GrblTestCore::SetExposure(double) { return DEVICE_UNSUPPORTED_COMMAND; }
+int GrblTestCore::GetExposure(double&) { return DEVICE_UNSUPPORTED_COMMAND; }
+int GrblTestCore::SetConfig(const char*, const char*) { return DEVICE_UNSUPPORTED_COMMAND; }
+int GrblTestCore::GetCurrentConfig(const char*, int, char*) { return DEVICE_UNSUPPORTED_COMMAND; }
+int GrblTestCore::GetChannelConfig(char*, const unsigned int) { return DEVICE_UNSUPPORTED_COMMAND; }
+MM::ImageProcessor* GrblTestCore::GetImageProcessor(const MM::Device*) { return 0; }
+MM::AutoFocus* GrblTestCore::GetAutoFocus(const MM::Device*) { return 0; }
+MM::State* GrblTestCore::GetStateDevice(const MM::Device*, const char*) { return 0; }
+MM::SignalIO* GrblTestCore::GetSignalIODevice(const MM::Device*, const char*) { return 0; }
+void GrblTestCore::NextPostedError(int& errorCode, char*, int, int& messageLength) { errorCode = 0; messageLength = 0; }
+void GrblTestCore::PostError(const int, const char*) {}
+void GrblTestCore::ClearPostedErrors(void) {}
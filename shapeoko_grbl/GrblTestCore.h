@@ -0,0 +1,109 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblTestCore.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Minimal stand-in for the Micro-Manager core, so that the hub
+//                and stages can run in a plain executable against the
+//                simulated controller.  Used by the bench and stress test
+//                targets, never by the adapter itself.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifndef _GRBL_TEST_CORE_H_
+#define _GRBL_TEST_CORE_H_
+
+#include "MMDevice.h"
+#include <map>
+#include <string>
+
+class ShapeokoGrblHub;
+class CShapeokoGrblXYStage;
+class ZStage;
+class CGrblSimulatedPort;
+
+// Owns a GrblSimulator port, the hub and both stages, and answers the
+// callbacks they make: serial I/O goes to the port by label, properties
+// of other devices are looked up by label, everything else is a no-op.
+class GrblTestCore : public MM::Core
+{
+public:
+   GrblTestCore();
+   ~GrblTestCore();
+
+   // Loads the devices, runs the hub's device detection on the simulated
+   // port and initializes them.  firmware is the simulator's
+   // GrblVersion ("0.9j" or "1.1f"), streamingMode the hub's StreamingMode.
+   int Open(const char* firmware, const char* streamingMode);
+   void Close();
+
+   ShapeokoGrblHub* GetHub() { return hub_; }
+   CShapeokoGrblXYStage* GetXYStage() { return xyStage_; }
+   ZStage* GetZStage() { return zStage_; }
+   void SetVerbose(bool verbose) { verbose_ = verbose; }
+
+   // MM::Core
+   int LogMessage(const MM::Device* caller, const char* msg, bool debugOnly) const;
+   MM::Device* GetDevice(const MM::Device* caller, const char* label);
+   int GetDeviceProperty(const char* deviceName, const char* propName, char* value);
+   int SetDeviceProperty(const char* deviceName, const char* propName, const char* value);
+   void GetLoadedDeviceOfType(const MM::Device* caller, MM::DeviceType devType, char* pDeviceName, const unsigned int deviceIterator);
+   int SetSerialProperties(const char* portName, const char* answerTimeout, const char* baudRate, const char* delayBetweenCharsMs, const char* handshaking, const char* parity, const char* stopBits);
+   int SetSerialCommand(const MM::Device* caller, const char* portName, const char* command, const char* term);
+   int GetSerialAnswer(const MM::Device* caller, const char* portName, unsigned long ansLength, char* answer, const char* term);
+   int WriteToSerial(const MM::Device* caller, const char* port, const unsigned char* buf, unsigned long length);
+   int ReadFromSerial(const MM::Device* caller, const char* port, unsigned char* buf, unsigned long length, unsigned long& read);
+   int PurgeSerial(const MM::Device* caller, const char* portName);
+   MM::PortType GetSerialPortType(const char* portName) const;
+   int OnPropertiesChanged(const MM::Device* caller);
+   int OnPropertyChanged(const MM::Device* caller, const char* propName, const char* propValue);
+   int OnStagePositionChanged(const MM::Device* caller, double pos);
+   int OnXYStagePositionChanged(const MM::Device* caller, double xPos, double yPos);
+   int OnExposureChanged(const MM::Device* caller, double newExposure);
+   int OnSLMExposureChanged(const MM::Device* caller, double newExposure);
+   int OnMagnifierChanged(const MM::Device* caller);
+   unsigned long GetClockTicksUs(const MM::Device* caller);
+   MM::MMTime GetCurrentMMTime();
+   int AcqFinished(const MM::Device* caller, int statusCode);
+   int PrepareForAcq(const MM::Device* caller);
+   int InsertImage(const MM::Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const char* serializedMetadata, const bool doProcess = true);
+   int InsertImage(const MM::Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const Metadata* md = 0, const bool doProcess = true);
+   int InsertImage(const MM::Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, unsigned nComponents, const char* serializedMetadata, const bool doProcess = true);
+   void ClearImageBuffer(const MM::Device* caller);
+   bool InitializeImageBuffer(unsigned channels, unsigned slices, unsigned int w, unsigned int h, unsigned int pixDepth);
+   int InsertMultiChannel(const MM::Device* caller, const unsigned char* buf, unsigned numChannels, unsigned width, unsigned height, unsigned byteDepth, Metadata* md = 0);
+   const char* GetImage();
+   int GetImageDimensions(int& width, int& height, int& depth);
+   int GetFocusPosition(double& pos);
+   int SetFocusPosition(double pos);
+   int MoveFocus(double velocity);
+   int SetXYPosition(double x, double y);
+   int GetXYPosition(double& x, double& y);
+   int MoveXYStage(double vX, double vY);
+   int SetExposure(double expMs);
+   int GetExposure(double& expMs);
+   int SetConfig(const char* group, const char* name);
+   int GetCurrentConfig(const char* group, int bufLen, char* name);
+   int GetChannelConfig(char* channelConfigName, const unsigned int channelConfigIterator);
+   MM::ImageProcessor* GetImageProcessor(const MM::Device* caller);
+   MM::AutoFocus* GetAutoFocus(const MM::Device* caller);
+   MM::Hub* GetParentHub(const MM::Device* caller) const;
+   MM::State* GetStateDevice(const MM::Device* caller, const char* deviceName);
+   MM::SignalIO* GetSignalIODevice(const MM::Device* caller, const char* deviceName);
+   void NextPostedError(int& errorCode, char* pMessage, int maxlen, int& messageLength);
+   void PostError(const int errorCode, const char* pMessage);
+   void ClearPostedErrors(void);
+
+private:
+   void Add(MM::Device* device, const char* label);
+   MM::Serial* GetPort(const char* label);
+
+   std::map<std::string, MM::Device*> devices_;
+   CGrblSimulatedPort* port_;
+   ShapeokoGrblHub* hub_;
+   CShapeokoGrblXYStage* xyStage_;
+   ZStage* zStage_;
+   bool verbose_;
+};
+
+#endif // _GRBL_TEST_CORE_H_
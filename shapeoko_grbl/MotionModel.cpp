@@ -0,0 +1,65 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MotionModel.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Predicts how long Grbl takes for a move.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#include "MotionModel.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+MotionModel::MotionModel()
+{
+   for (int i = 0; i < 3; i++)
+      maxRate_[i] = accel_[i] = 0.0;
+}
+
+void MotionModel::SetAxis(int axis, double maxRateMmPerMin, double accelMmPerSec2)
+{
+   maxRate_[axis] = maxRateMmPerMin;
+   accel_[axis] = accelMmPerSec2;
+}
+
+bool MotionModel::IsValid() const
+{
+   for (int i = 0; i < 3; i++)
+      if (maxRate_[i] <= 0.0 || accel_[i] <= 0.0)
+         return false;
+   return true;
+}
+
+double MotionModel::MoveSeconds(const double fromMm[3], const double toMm[3], double feedMmPerMin) const
+{
+   double delta[3];
+   double sum = 0.0;
+   for (int i = 0; i < 3; i++)
+   {
+      delta[i] = toMm[i] - fromMm[i];
+      sum += delta[i] * delta[i];
+   }
+   double length = sqrt(sum);
+   if (length < 1e-9 || !IsValid())
+      return 0.0;
+
+   // like Grbl's planner: the path speed and acceleration are limited so
+   // that no axis exceeds its own limit
+   double vmax = feedMmPerMin > 0.0 ? feedMmPerMin / 60.0 : std::numeric_limits<double>::max();
+   double accel = std::numeric_limits<double>::max();
+   for (int i = 0; i < 3; i++)
+   {
+      double u = fabs(delta[i]) / length;
+      if (u < 1e-12)
+         continue;
+      vmax = std::min(vmax, maxRate_[i] / 60.0 / u);
+      accel = std::min(accel, accel_[i] / u);
+   }
+
+   // triangular profile if the move is too short to reach vmax
+   if (length < vmax * vmax / accel)
+      return 2.0 * sqrt(length / accel);
+   return 2.0 * vmax / accel + (length - vmax * vmax / accel) / vmax;
+}
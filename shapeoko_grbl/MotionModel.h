@@ -0,0 +1,37 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MotionModel.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Predicts how long Grbl takes for a move, from the per-axis
+//                max rate ($110-$112, mm/min) and acceleration ($120-$122,
+//                mm/s^2) settings.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifndef _MOTION_MODEL_H_
+#define _MOTION_MODEL_H_
+
+// Trapezoidal velocity profile of a single move that starts and ends at
+// rest, which is what Grbl does for a move issued while it is idle.  For
+// moves queued back to back Grbl carries speed across the junction, so
+// the sum of the predictions is an upper bound.
+class MotionModel
+{
+public:
+   MotionModel();
+
+   void SetAxis(int axis, double maxRateMmPerMin, double accelMmPerSec2);
+   bool IsValid() const;
+   double GetMaxRate(int axis) const { return maxRate_[axis]; }
+   double GetAccel(int axis) const { return accel_[axis]; }
+
+   // Duration in seconds; feedMmPerMin <= 0 means a G0 rapid move
+   double MoveSeconds(const double fromMm[3], const double toMm[3], double feedMmPerMin = 0.0) const;
+
+private:
+   double maxRate_[3];   // mm/min
+   double accel_[3];     // mm/s^2
+};
+
+#endif // _MOTION_MODEL_H_
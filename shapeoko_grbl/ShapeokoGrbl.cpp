@@ -25,7 +25,10 @@
 #include "ShapeokoGrbl.h"
 #include "XYStage.h"
 #include "ZStage.h"
+#include "GrblSimulator.h"
 #include <cstdio>
+#include <cstdlib>
+#include <cctype>
 #include <string>
 #include <math.h>
 #include "ModuleInterface.h"
@@ -41,7 +44,107 @@ using namespace std;
 const char* g_XYStageDeviceName = "DXYStage";
 const char* g_ZStageDeviceName = "DZStage";
 const char* g_HubDeviceName = "DHub";
+const char* g_GrblSimulatorDeviceName = "GrblSimulator";
 const char* g_versionProp = "Version";
+const char* g_statusPollIntervalProp = "StatusPollIntervalMs";
+const char* g_streamingModeProp = "StreamingMode";
+const char* g_streamingLockStep = "Lock-step";
+const char* g_streamingCharacterCounting = "Character-counting";
+const char* g_rxBufferSizeProp = "RxBufferSize";
+const char* g_moveErrorProp = "MoveError";
+const char* g_sequenceAdvanceProp = "SequenceAdvance";
+const char* g_sequenceAdvanceDwell = "Dwell";
+const char* g_sequenceAdvanceCycleStart = "Cycle start input";
+const char* g_sequenceDwellProp = "SequenceDwellMs";
+const char* g_triggerOutputProp = "TriggerOutput";
+const char* g_triggerNone = "None";
+const char* g_triggerCoolant = "Coolant (M8/M9)";
+const char* g_triggerSpindle = "Spindle (M3/M5)";
+const char* g_triggerPulseProp = "TriggerPulseMs";
+const char* g_triggerSpindleSpeedProp = "TriggerSpindleSpeed";
+const char* g_statsResetProp = "Stats-Reset";
+const char* g_completionGuardProp = "CompletionGuardMs";
+const char* g_completionModeProp = "CompletionMode";
+const char* g_completionPolling = "Status polling";
+const char* g_completionDwell = "Dwell (G4 P0)";
+const char* g_startupBannerTimeoutProp = "StartupBannerTimeoutMs";
+const char* g_startupResetTimeoutProp = "StartupResetTimeoutMs";
+const char* g_startupTimeProp = "StartupTimeMs";
+const char* g_baudRatesProp = "DetectBaudRates";
+const char* g_baudRateProp = "BaudRate";
+
+// read-only counters, in the order of OnStatsCounter's index
+const char* g_statsCounterProps[] = {
+   "Stats-BytesSent", "Stats-BytesReceived", "Stats-Timeouts", "Stats-Errors", "Stats-Alarms"
+};
+const char* g_moveXYZProp = "MoveXYZ";
+const char* g_realtimeProp = "RealtimeCommand";
+const char* g_realtimeNone = "None";
+const char* g_realtimeFeedHold = "Feed hold";
+const char* g_realtimeCycleStart = "Cycle start";
+const char* g_realtimeJogCancel = "Jog cancel";
+const char* g_realtimeSoftReset = "Soft reset";
+const char* g_realtimeStop = "Stop";
+const char* g_jogIntervalProp = "JogIntervalMs";
+const char* g_tileScanFocusPlaneProp = "TileScan-FocusPlane";
+const char* g_tileScanControlProp = "TileScan-Control";
+const char* g_tileScanProgressProp = "TileScan-Progress";
+const char* g_tileScanIdle = "Idle";
+const char* g_tileScanStart = "Start";
+const char* g_tileScanStop = "Stop";
+const char* g_positionHistorySizeProp = "PositionHistorySize";
+const char* g_positionAtProp = "PositionAt";
+const char* g_positionLogFileProp = "PositionLogFile";
+const char* g_focusMapModeProp = "FocusMap-Mode";
+const char* g_focusMapPointsProp = "FocusMap-Points";
+const char* g_focusMapOff = "Off";
+const char* g_focusMapPlane = "Plane";
+const char* g_focusMapSurface = "Surface";
+const char* g_visitOrderStartProp = "VisitOrder-Start";
+const char* g_visitOrderFromCurrent = "Current position";
+const char* g_visitOrderFromFirst = "First position";
+const char* g_visitOrderControlProp = "VisitOrder-Control";
+const char* g_visitOrderIdle = "Idle";
+const char* g_visitOrderOptimize = "Optimize";
+const char* g_jobFileProp = "Job-File";
+const char* g_jobControlProp = "Job-Control";
+const char* g_jobStateProp = "Job-State";
+const char* g_jobProgressProp = "Job-Progress";
+const char* g_jobLineProp = "Job-Line";
+const char* g_jobErrorProp = "Job-Error";
+const char* g_jobIdle = "Idle";
+const char* g_jobStart = "Start";
+const char* g_jobPause = "Pause";
+const char* g_jobResume = "Resume";
+const char* g_jobAbort = "Abort";
+
+// in the order of OnVisitOrderFile's index
+const char* g_visitOrderFileProps[] = {
+   "VisitOrder-InputFile", "VisitOrder-OutputFile"
+};
+// read-only, in the order of OnVisitOrderResult's index
+const char* g_visitOrderResultProps[] = {
+   "VisitOrder-SecondsBefore", "VisitOrder-SecondsAfter", "VisitOrder-OptimizeMs"
+};
+
+// in the order of JobState
+const char* g_jobStateNames[] = {
+   "Idle", "Running", "Paused", "Done", "Failed", "Aborted"
+};
+
+// numeric tile scan settings, in the order of OnTileScanSetting's index
+const char* g_tileScanSettingProps[] = {
+   "TileScan-XMinUm", "TileScan-XMaxUm", "TileScan-YMinUm", "TileScan-YMaxUm",
+   "TileScan-TileWidthUm", "TileScan-TileHeightUm", "TileScan-OverlapPercent",
+   "TileScan-DwellMs"
+};
+
+// number of jog intervals kept queued ahead of the machine
+const double g_jogLookahead = 3.0;
+
+// job lines queued ahead of the controller's answers; enough to keep its
+// RX buffer full, few enough that the queue stays small
+const size_t g_jobLookahead = 32;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Exported MMDevice API
@@ -52,6 +155,7 @@ MODULE_API void InitializeModuleData()
    RegisterDevice(g_XYStageDeviceName, MM::XYStageDevice, "ShapeokoGrbl XY stage");
      RegisterDevice(g_ZStageDeviceName, MM::StageDevice, "ShapeokoTinyG Z stage");
    RegisterDevice(g_HubDeviceName, MM::HubDevice, "DHub");
+   RegisterDevice(g_GrblSimulatorDeviceName, MM::SerialDevice, "Simulated Grbl controller");
 }
 
 MODULE_API MM::Device* CreateDevice(const char* deviceName)
@@ -73,6 +177,10 @@ MODULE_API MM::Device* CreateDevice(const char* deviceName)
    {
 	  return new ShapeokoGrblHub();
    }
+   else if (strcmp(deviceName, g_GrblSimulatorDeviceName) == 0)
+   {
+      return new CGrblSimulatedPort();
+   }
 
    // ...supplied name not recognized
    return 0;
@@ -87,23 +195,84 @@ MODULE_API void DeleteDevice(MM::Device* pDevice)
 
 ShapeokoGrblHub::ShapeokoGrblHub():
       initialized_(false),
-      busy_(false)
+      busy_(false),
+      versionMajor_(0),
+      versionMinor_(0),
+      bannerCount_(0),
+      unlockRequested_(false),
+      startupBannerTimeoutMs_(2500.0),
+      startupResetTimeoutMs_(1000.0),
+      baudRates_("115200,9600,57600,38400,19200"),
+      portAvailable_(false),
+      moveEncoderStale_(false),
+      positionReportPending_(false),
+      moveResyncPending_(false),
+      xyStage_(0),
+      zStage_(0),
+      poller_(0),
+      ioThread_(0),
+      ioWakeRequested_(false),
+      ioEvents_(0),
+      inFlightBytes_(0),
+      nextTicket_(1),
+      characterCounting_(false),
+      rxBufferSize_(127),
+      moveErrorPending_(false),
+      answerTimeoutMs_(-1.0),
+      completionGuardMs_(20.0),
+      completionByDwell_(false),
+      syncTicket_(0),
+      syncState_(SyncNone),
+      initializeMs_(0.0),
+      detectDeviceMs_(0.0),
+      jogging_(false),
+      jogResyncPending_(false),
+      jogFirstTicket_(0),
+      jogIntervalMs_(50.0),
+      sequenceWaitForCycleStart_(false),
+      sequenceDwellMs_(100.0),
+      visitOrderKeepFirst_(false),
+      jobState_(JobIdle),
+      jobEndQueued_(false),
+      jobLineNumber_(0),
+      jobDoneBytes_(0),
+      jobResyncPending_(false),
+      triggerOutput_(TriggerNone),
+      triggerPulseMs_(50.0),
+      triggerSpindleSpeed_(1000.0)
 {
   LogMessage("Constructor");
-  WPos[0] = 0.0;
-  WPos[1] = 0.0;
-  WPos[2] = 0.0;
-  MPos[0] = 0.0;
-  MPos[1] = 0.0;
-  MPos[2] = 0.0;
+  SetErrorText(ERR_COMMAND_REJECTED, "The controller rejected the command");
+  SetErrorText(ERR_NOT_SUPPORTED_BY_FIRMWARE, "Not supported by this Grbl version");
+  SetErrorText(ERR_MOVE_OUT_OF_RANGE, "Target position is outside the axis travel ($130-$132)");
+  SetErrorText(ERR_JOB_FILE, "Could not open the G-code file");
+  SetErrorText(ERR_JOB_ACTIVE, "A G-code job is running");
+  SetErrorText(ERR_NO_MOTION_MODEL, "Max rates and accelerations ($110-$122) are not known");
+  SetErrorText(ERR_POSITION_FILE, "Could not read or write the position file");
+  SetErrorText(ERR_TILE_SCAN_ACTIVE, "A tile scan is running; stop it first");
+  commandedUm_[0] = commandedUm_[1] = commandedUm_[2] = 0.0;
+  jogVelocity_[0] = jogVelocity_[1] = 0.0;
+  visitOrderResult_[0] = visitOrderResult_[1] = visitOrderResult_[2] = 0.0;
 
   CPropertyAction* pAct  = new CPropertyAction(this, &ShapeokoGrblHub::OnPort);
   CreateProperty(MM::g_Keyword_Port, "Undefined", MM::String, false, pAct, true);
+
+  // How long to wait for the banner after the port opens, and for the one
+  // printed after a soft reset when the first never shows up
+  pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnStartupBannerTimeout);
+  CreateProperty(g_startupBannerTimeoutProp, CDeviceUtils::ConvertToString(startupBannerTimeoutMs_), MM::Float, false, pAct, true);
+  pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnStartupResetTimeout);
+  CreateProperty(g_startupResetTimeoutProp, CDeviceUtils::ConvertToString(startupResetTimeoutMs_), MM::Float, false, pAct, true);
+
+  // Rates DetectDevice() tries, in this order, until one gets an answer
+  pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnBaudRates);
+  CreateProperty(g_baudRatesProp, baudRates_.c_str(), MM::String, false, pAct, true);
 }
 
 int ShapeokoGrblHub::Initialize()
 {
   LogMessage("Initialize");
+   MM::MMTime initializeStart = GetCurrentMMTime();
    /* From EVA's XYStage */
    int ret = DEVICE_ERR;
 
@@ -164,96 +333,337 @@ int ShapeokoGrblHub::Initialize()
    sversion << version_;
    CreateProperty(g_versionProp, sversion.str().c_str(), MM::String, true, pAct);
 
-   CDeviceUtils::SleepMs(1000);
-   // At port opening, the arduino will sleep for 1-2 seconds then output a version string.
+   // From here on only the I/O thread reads from the port
+   if (ioThread_ == 0)
+      ioThread_ = new SerialIoThread(this);
+   ioThread_->Start();
+
+   // At port opening, the arduino resets and prints its banner once the
+   // bootloader gives up waiting for new firmware
    ret = GetControllerVersion(version_);
    if( DEVICE_OK != ret)
       return ret;
-   PurgeComPortH();
-
-   
-   LogMessage("Unlock device.");
-   ret = SendCommand("$X");
-   if(DEVICE_OK != ret){
-     return DEVICE_ERR;
-   }
-   std::string returnString;
-   ret = ReceiveResponse(returnString, 1000);
-   if(DEVICE_OK != ret){
-     return DEVICE_ERR;
-   }
-   LogMessage("Unlocked device.");
-   PurgeComPortH();
-   
-   LogMessage("resetting device origin.");
-   ret = SendCommand("G92 X0 Y0 Z0");
-   if(DEVICE_OK != ret){
-     return DEVICE_ERR;
+
+   ret = GetStatus();
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // Only a controller that came up in alarm (homing enabled, or reset
+   // during a move) asks to be unlocked
+   bool unlock;
+   {
+      MMThreadGuard guard(streamLock_);
+      unlock = unlockRequested_;
+      unlockRequested_ = false;
    }
-   ret = ReceiveResponse(returnString);
-   if(DEVICE_OK != ret){
-     return DEVICE_ERR;
+   std::string answer;
+   if (unlock || GetState() == "Alarm")
+   {
+      LogMessage("Unlock device.");
+      ret = ExecuteCommand("$X", answer, 1000);
+      if (ret != DEVICE_OK)
+         return ret;
+      if (IsErrorAnswer(answer))
+      {
+         LogMessage("Unlock rejected: " + answer);
+         return ERR_COMMAND_REJECTED;
+      }
    }
 
-   LogMessage("reset device origin.");
-   CDeviceUtils::SleepMs(500);
-   PurgeComPortH();
+   LogMessage("resetting device origin.");
+   ret = ExecuteCommand("G92 X0 Y0 Z0", answer);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (IsErrorAnswer(answer))
+   {
+      LogMessage("G92 rejected: " + answer);
+      return ERR_COMMAND_REJECTED;
+   }
 
    ret = GetStatus();
    if (ret != DEVICE_OK)
       return ret;
-   PurgeComPortH();
+
+   // Without the settings the built-in step sizes apply, moves are not
+   // range-checked and completion is detected by polling alone
+   if (ReadSettings() != DEVICE_OK)
+      LogMessage("No $$ settings from the controller");
+
+   // From here on the stages read position and state from the cached status
+   poller_ = new StatusPoller(this);
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnStatusPollInterval);
+   CreateProperty(g_statusPollIntervalProp, CDeviceUtils::ConvertToString(poller_->GetIntervalMs()), MM::Integer, false, pAct);
+   SetPropertyLimits(g_statusPollIntervalProp, 10, 2000);
+
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnStreamingMode);
+   CreateProperty(g_streamingModeProp, g_streamingLockStep, MM::String, false, pAct);
+   AddAllowedValue(g_streamingModeProp, g_streamingLockStep);
+   AddAllowedValue(g_streamingModeProp, g_streamingCharacterCounting);
+
+   // Grbl's serial RX buffer is 128 bytes, one of which is always kept free
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnRxBufferSize);
+   CreateProperty(g_rxBufferSizeProp, CDeviceUtils::ConvertToString(rxBufferSize_), MM::Integer, false, pAct);
+   SetPropertyLimits(g_rxBufferSizeProp, 16, 1024);
+
+   // In character-counting mode MoveTo() returns before the controller has
+   // answered; a move it rejects is shown here, and the next MoveTo()
+   // returns the error instead of moving.
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnMoveError);
+   CreateProperty(g_moveErrorProp, "", MM::String, true, pAct);
+
+   // How stage sequences move on to the next point: after a fixed dwell, or
+   // when the controller's cycle start input is triggered (M0 pause).
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnSequenceAdvance);
+   CreateProperty(g_sequenceAdvanceProp, g_sequenceAdvanceDwell, MM::String, false, pAct);
+   AddAllowedValue(g_sequenceAdvanceProp, g_sequenceAdvanceDwell);
+   AddAllowedValue(g_sequenceAdvanceProp, g_sequenceAdvanceCycleStart);
+
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnSequenceDwell);
+   CreateProperty(g_sequenceDwellProp, CDeviceUtils::ConvertToString(sequenceDwellMs_), MM::Float, false, pAct);
+   SetPropertyLimits(g_sequenceDwellProp, 0, 60000);
+
+   // Output pulsed at each point of a stage sequence or tile scan, e.g.
+   // to trigger a camera.  Grbl switches coolant and spindle only once
+   // all moves before have finished, so the pulse starts when the stage
+   // arrives.  Grbl dwells in 50 ms steps, which rounds the pulse up.  The
+   // spindle output needs laser mode ($32) off, or it stays low at rest.
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnTriggerOutput);
+   CreateProperty(g_triggerOutputProp, g_triggerNone, MM::String, false, pAct);
+   AddAllowedValue(g_triggerOutputProp, g_triggerNone);
+   AddAllowedValue(g_triggerOutputProp, g_triggerCoolant);
+   AddAllowedValue(g_triggerOutputProp, g_triggerSpindle);
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnTriggerPulse);
+   CreateProperty(g_triggerPulseProp, CDeviceUtils::ConvertToString(triggerPulseMs_), MM::Float, false, pAct);
+   SetPropertyLimits(g_triggerPulseProp, 0, 10000);
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnTriggerSpindleSpeed);
+   CreateProperty(g_triggerSpindleSpeedProp, CDeviceUtils::ConvertToString(triggerSpindleSpeed_), MM::Float, false, pAct);
+   SetPropertyLimits(g_triggerSpindleSpeedProp, 0, 100000);
+
+   // Round-trip latency per command class and traffic counters, e.g.
+   // Stats-MoveLatency.  Setting Stats-Reset to "Reset" clears them.
+   for (long i = 0; i < GrblCommandClassCount; i++)
+   {
+      std::string name = std::string("Stats-") + GrblCommandClassName((GrblCommandClass) i) + "Latency";
+      CPropertyActionEx* pActEx = new CPropertyActionEx(this, &ShapeokoGrblHub::OnStatsLatency, i);
+      CreateProperty(name.c_str(), "", MM::String, true, pActEx);
+   }
+   for (long i = 0; i < (long) (sizeof(g_statsCounterProps) / sizeof(g_statsCounterProps[0])); i++)
+   {
+      CPropertyActionEx* pActEx = new CPropertyActionEx(this, &ShapeokoGrblHub::OnStatsCounter, i);
+      CreateProperty(g_statsCounterProps[i], "0", MM::Integer, true, pActEx);
+   }
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnStatsReset);
+   CreateProperty(g_statsResetProp, "", MM::String, false, pAct);
+   AddAllowedValue(g_statsResetProp, "");
+   AddAllowedValue(g_statsResetProp, "Reset");
+
+   // status polling resumes this long before a move's predicted end
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnCompletionGuard);
+   CreateProperty(g_completionGuardProp, CDeviceUtils::ConvertToString(completionGuardMs_), MM::Float, false, pAct);
+   SetPropertyLimits(g_completionGuardProp, 0, 1000);
+
+   // How the end of a move is detected.  With "Dwell (G4 P0)" a G4 P0
+   // follows every move and every streamed batch; Grbl answers it only
+   // once all motion before it has finished, so its 'ok' replaces the
+   // status queries.  Lines sent behind it wait for the move, and
+   // single moves no longer blend into each other.  Falls back to
+   // polling for a move whose dwell fails.
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnCompletionMode);
+   CreateProperty(g_completionModeProp, g_completionPolling, MM::String, false, pAct);
+   AddAllowedValue(g_completionModeProp, g_completionPolling);
+   AddAllowedValue(g_completionModeProp, g_completionDwell);
+
+   // One property per $$ setting; edits are written to the controller
+   std::map<int, double> settings = settings_.GetAll();
+   for (std::map<int, double>::const_iterator it = settings.begin(); it != settings.end(); ++it)
+   {
+      CPropertyActionEx* pActEx = new CPropertyActionEx(this, &ShapeokoGrblHub::OnSetting, it->first);
+      CreateProperty(GrblSettings::PropertyName(it->first).c_str(),
+            CDeviceUtils::ConvertToString(it->second), MM::Float, false, pActEx);
+   }
+
+   // "x,y,z" in um: one coordinated move of all three axes
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnMoveXYZ);
+   CreateProperty(g_moveXYZProp, "0,0,0", MM::String, false, pAct);
+
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnRealtimeCommand);
+   CreateProperty(g_realtimeProp, g_realtimeNone, MM::String, false, pAct);
+   AddAllowedValue(g_realtimeProp, g_realtimeNone);
+   AddAllowedValue(g_realtimeProp, g_realtimeFeedHold);
+   AddAllowedValue(g_realtimeProp, g_realtimeCycleStart);
+   AddAllowedValue(g_realtimeProp, g_realtimeJogCancel);
+   AddAllowedValue(g_realtimeProp, g_realtimeSoftReset);
+   AddAllowedValue(g_realtimeProp, g_realtimeStop);
+
+   // duration of one jog segment; shorter is more responsive, longer
+   // needs less serial traffic
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnJogInterval);
+   CreateProperty(g_jogIntervalProp, CDeviceUtils::ConvertToString(jogIntervalMs_), MM::Float, false, pAct);
+   SetPropertyLimits(g_jogIntervalProp, 10, 500);
+
+   // Tile scan
+   for (long i = 0; i < (long) (sizeof(g_tileScanSettingProps) / sizeof(g_tileScanSettingProps[0])); i++)
+   {
+      CPropertyActionEx* pActEx = new CPropertyActionEx(this, &ShapeokoGrblHub::OnTileScanSetting, i);
+      CreateProperty(g_tileScanSettingProps[i], "0", MM::Float, false, pActEx);
+   }
+   SetPropertyLimits("TileScan-OverlapPercent", 0, 90);
+   // "z0,dz/dx,dz/dy" with z0 in um, empty for no focus plane
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnTileScanFocusPlane);
+   CreateProperty(g_tileScanFocusPlaneProp, "", MM::String, false, pAct);
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnTileScanControl);
+   CreateProperty(g_tileScanControlProp, g_tileScanIdle, MM::String, false, pAct);
+   AddAllowedValue(g_tileScanControlProp, g_tileScanIdle);
+   AddAllowedValue(g_tileScanControlProp, g_tileScanStart);
+   AddAllowedValue(g_tileScanControlProp, g_tileScanStop);
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnTileScanProgress);
+   CreateProperty(g_tileScanProgressProp, "0/0", MM::String, true, pAct);
+
+   // Position history.  Setting PositionAt to an MM time in ms (as in the
+   // image metadata) makes it read back the position then, "x,y,z" in um,
+   // or nothing when the time is outside the history.  PositionLogFile
+   // streams every sample to a binary file; empty stops logging.
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnPositionHistorySize);
+   CreateProperty(g_positionHistorySizeProp, CDeviceUtils::ConvertToString((long) history_.GetCapacity()), MM::Integer, false, pAct);
+   SetPropertyLimits(g_positionHistorySizeProp, 16, 1000000);
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnPositionAt);
+   CreateProperty(g_positionAtProp, "", MM::String, false, pAct);
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnPositionLogFile);
+   CreateProperty(g_positionLogFileProp, "", MM::String, false, pAct);
+
+   // Focus map, fitted to "x,y,z;x,y,z;..." reference points in um.  A
+   // plane needs three points off a line, the surface (thin-plate spline)
+   // as many as it should pass through.
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnFocusMapPoints);
+   CreateProperty(g_focusMapPointsProp, "", MM::String, false, pAct);
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnFocusMapMode);
+   CreateProperty(g_focusMapModeProp, g_focusMapOff, MM::String, false, pAct);
+   AddAllowedValue(g_focusMapModeProp, g_focusMapOff);
+   AddAllowedValue(g_focusMapModeProp, g_focusMapPlane);
+   AddAllowedValue(g_focusMapModeProp, g_focusMapSurface);
+
+   // Visit order.  The input file has one position per line, "x,y" or
+   // "x,y,z" in um; Optimize writes them to the output file in the order
+   // that takes least travel time, as "index,x,y[,z]" with the index of
+   // the input line, and reports the estimated times for both orders.
+   for (long i = 0; i < 2; i++)
+   {
+      CPropertyActionEx* pActEx = new CPropertyActionEx(this, &ShapeokoGrblHub::OnVisitOrderFile, i);
+      CreateProperty(g_visitOrderFileProps[i], "", MM::String, false, pActEx);
+   }
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnVisitOrderStart);
+   CreateProperty(g_visitOrderStartProp, g_visitOrderFromCurrent, MM::String, false, pAct);
+   AddAllowedValue(g_visitOrderStartProp, g_visitOrderFromCurrent);
+   AddAllowedValue(g_visitOrderStartProp, g_visitOrderFromFirst);
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnVisitOrderControl);
+   CreateProperty(g_visitOrderControlProp, g_visitOrderIdle, MM::String, false, pAct);
+   AddAllowedValue(g_visitOrderControlProp, g_visitOrderIdle);
+   AddAllowedValue(g_visitOrderControlProp, g_visitOrderOptimize);
+   for (long i = 0; i < 3; i++)
+   {
+      CPropertyActionEx* pActEx = new CPropertyActionEx(this, &ShapeokoGrblHub::OnVisitOrderResult, i);
+      CreateProperty(g_visitOrderResultProps[i], "0", MM::Float, true, pActEx);
+   }
+
+   // G-code job.  Job-File maps the program, Job-Control runs it; progress
+   // is in percent of the file, Job-Line is the last line the controller
+   // accepted and Job-Error the line it rejected, which ends the job.
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnJobFile);
+   CreateProperty(g_jobFileProp, "", MM::String, false, pAct);
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnJobControl);
+   CreateProperty(g_jobControlProp, g_jobIdle, MM::String, false, pAct);
+   AddAllowedValue(g_jobControlProp, g_jobIdle);
+   AddAllowedValue(g_jobControlProp, g_jobStart);
+   AddAllowedValue(g_jobControlProp, g_jobPause);
+   AddAllowedValue(g_jobControlProp, g_jobResume);
+   AddAllowedValue(g_jobControlProp, g_jobAbort);
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnJobState);
+   CreateProperty(g_jobStateProp, g_jobStateNames[JobIdle], MM::String, true, pAct);
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnJobProgress);
+   CreateProperty(g_jobProgressProp, "0", MM::Float, true, pAct);
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnJobLine);
+   CreateProperty(g_jobLineProp, "0", MM::Integer, true, pAct);
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnJobError);
+   CreateProperty(g_jobErrorProp, "", MM::String, true, pAct);
+
+   // the rate the port was configured with, by DetectDevice() or by hand
+   char baudRate[MM::MaxStrLength];
+   if (GetCoreCallback()->GetDeviceProperty(port_.c_str(), MM::g_Keyword_BaudRate, baudRate) == DEVICE_OK)
+      baudRate_ = baudRate;
+   CreateProperty(g_baudRateProp, baudRate_.c_str(), MM::String, true);
+
+   // wall time of Initialize(), filled in once it returns
+   pAct = new CPropertyAction(this, &ShapeokoGrblHub::OnStartupTime);
+   CreateProperty(g_startupTimeProp, "0", MM::Float, true, pAct);
+
+   poller_->Start();
 
    ret = UpdateStatus();
    if (ret != DEVICE_OK)
       return ret;
 
+   initializeMs_ = (GetCurrentMMTime() - initializeStart).getMsec();
+   LogMessage("Start-up took " + std::to_string((long) initializeMs_) + " ms");
    initialized_ = true;
    return DEVICE_OK;
 }
 
-// private and expects caller to:
-// 1. guard the port
-// 2. purge the port
+int ShapeokoGrblHub::Shutdown()
+{
+   if (poller_ != 0)
+   {
+      poller_->Stop();
+      delete poller_;
+      poller_ = 0;
+   }
+   if (ioThread_ != 0)
+   {
+      ioThread_->Stop();
+      delete ioThread_;
+      ioThread_ = 0;
+   }
+   {
+      // nothing feeds the job any more
+      MMThreadGuard guard(jobLock_);
+      jobLines_.clear();
+      jobFile_.Close();
+      jobState_ = JobIdle;
+   }
+   initialized_ = false;
+   return DEVICE_OK;
+}
+
+// Waits for the start-up banner, which the controller prints when opening
+// the port resets it.  Boards that do not reset on open, or whose banner
+// was missed, are probed with a soft reset.  DispatchLine takes the
+// version and the unlock request from the lines that come in.
 int ShapeokoGrblHub::GetControllerVersion(string& version)
 {
   LogMessage("GetControllerVersion");
-   int ret = DEVICE_OK;
-   MMThreadGuard(this->executeLock_);
-   // Ignore initial empty string
-   std::string returnString;
-   ret = ReceiveResponse(returnString, 1000);
-   if(DEVICE_OK != ret){
-     return DEVICE_ERR;
-   }
-   if (returnString != "") {
-     LogMessage("Expected empty string, got ");
-     LogMessage(returnString);
-     return DEVICE_ERR;
-   }
-   ret = ReceiveResponse(returnString, 1000);
-   if(DEVICE_OK != ret){
-     return DEVICE_ERR;
-   }
-     LogMessage("got: ");
-     LogMessage(returnString);
-
-   std::vector<std::string> tokenInput;
-   char* pEnd;
-   CDeviceUtils::Tokenize(returnString, tokenInput, "[");
-   
-   if(tokenInput.size() != 2) {
-     LogMessage("tokensize:");
-     LogMessage(std::to_string(tokenInput.size()).c_str());
-     return DEVICE_ERR;
-   }
-
-   // Depending on lock state, an optional message will be output on how to unlock.
-   CDeviceUtils::SleepMs(1000);
-   PurgeComPortH();
-
-   version_ = tokenInput[0];
-   return ret;
+   long banners;
+   {
+      MMThreadGuard guard(streamLock_);
+      banners = bannerCount_;
+   }
+   MM::MMTime start = GetCurrentMMTime();
+   int ret = WaitForBanner(banners, (float) startupBannerTimeoutMs_);
+   if (ret != DEVICE_OK)
+   {
+      LogMessage("Probing the controller with a soft reset");
+      ret = SendRealtime(GRBL_RT_SOFT_RESET);
+      if (ret != DEVICE_OK)
+         return ret;
+      ret = WaitForBanner(banners, (float) startupResetTimeoutMs_);
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+   LogMessage("Banner after " + std::to_string((long) (GetCurrentMMTime() - start).getMsec()) + " ms");
+
+   MMThreadGuard guard(streamLock_);
+   version = version_;
+   if (versionMajor_ == 0 && versionMinor_ == 0)
+      LogMessage("Could not parse version " + version_);
+   return DEVICE_OK;
 }
 
 int ShapeokoGrblHub::DetectInstalledDevices()
@@ -264,14 +674,14 @@ int ShapeokoGrblHub::DetectInstalledDevices()
    // make sure this method is called before we look for available devices
    InitializeModuleData();
 
-   char hubName[MM::MaxStrLength];
-   GetName(hubName); // this device name
+   // only the stages are peripherals of the hub; the simulator is a port
+   // that the hub itself may be connected to
    for (unsigned i=0; i<GetNumberOfDevices(); i++)
    {
       char deviceName[MM::MaxStrLength];
       LogMessage("Get device");
       bool success = GetDeviceName(i, deviceName, MM::MaxStrLength);
-      if (success && (strcmp(hubName, deviceName) != 0))
+      if (success && (strcmp(g_XYStageDeviceName, deviceName) == 0 || strcmp(g_ZStageDeviceName, deviceName) == 0))
       {
         LogMessage("Got device", deviceName);
          MM::Device* pDev = CreateDevice(deviceName);
@@ -311,7 +721,6 @@ int ShapeokoGrblHub::OnPort(MM::PropertyBase* pProp, MM::ActionType pAct)
 
 int ShapeokoGrblHub::OnCommand(MM::PropertyBase* pProp, MM::ActionType pAct)
 {
-   PurgeComPortH();
   LogMessage("OnCommand");
    if (pAct == MM::BeforeGet)
    {
@@ -323,11 +732,12 @@ int ShapeokoGrblHub::OnCommand(MM::PropertyBase* pProp, MM::ActionType pAct)
       pProp->Get(cmd);
 	  if(cmd.compare(commandResult_) ==0)  // command result still there
 		  return DEVICE_OK;
-	  int ret = SendCommand(cmd);
-	  if(DEVICE_OK != ret){
-		  return DEVICE_ERR;
+	  if (!IsIoThreadRunning() && IsStreamIdle())
+	  {
+		  MMThreadGuard guard(executeLock_);
+		  PurgeComPortH();
 	  }
-	  ret = ReceiveResponse(commandResult_);
+	  int ret = ExecuteCommand(cmd, commandResult_);
 	  if(DEVICE_OK != ret){
 		  return DEVICE_ERR;
 	  }
@@ -335,192 +745,2812 @@ int ShapeokoGrblHub::OnCommand(MM::PropertyBase* pProp, MM::ActionType pAct)
    return DEVICE_OK;
 }
 
-int ShapeokoGrblHub::SendCommand(std::string command, std::string terminator)
+int ShapeokoGrblHub::OnStatusPollInterval(MM::PropertyBase* pProp, MM::ActionType pAct)
 {
-  LogMessage("SendCommand");
-  LogMessage("command=" + command);
-   if(!portAvailable_)
-	   return ERR_NO_PORT_SET;
-   // needs a lock because the other Thread will also use this function
-   MMThreadGuard(this->executeLock_);
-   int ret = DEVICE_OK;
-
-   LogMessage("Write command.");
-   ret = SetCommandComPortH(command.c_str(), terminator.c_str());
-   LogMessage("set command, ret=" + ret);
-   if (ret != DEVICE_OK)
+   if (pAct == MM::BeforeGet)
    {
-	    LogMessage("command write fail");
-	   return ret;
+      pProp->Set(poller_->GetIntervalMs());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      long interval;
+      pProp->Get(interval);
+      poller_->SetIntervalMs(interval);
    }
+   return DEVICE_OK;
 }
-int ShapeokoGrblHub::ReceiveResponse(std::string &returnString, float timeout)
-{
-  MMThreadGuard(this->executeLock_);
-  SetAnswerTimeoutMs(timeout);
-
-  std::string an;
-  try
-    {
-
-      int ret = GetSerialAnswerComPortH(an,"\r\n");
-      if (ret != DEVICE_OK)
-	{
-	  LogMessage(std::string("answer get error!_"));
-	  return ret;
-	}
-      LogMessage("answer:");
-      LogMessage(std::string(an));
-      returnString.assign(an);
-      return DEVICE_OK;
-    }
-  catch(...)
-    {
-      LogMessage("Exception in send command!");
-      return DEVICE_ERR;
-    }
 
+int ShapeokoGrblHub::OnStreamingMode(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(characterCounting_ ? g_streamingCharacterCounting : g_streamingLockStep);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      MMThreadGuard guard(streamLock_);
+      characterCounting_ = (mode == g_streamingCharacterCounting);
+   }
+   return DEVICE_OK;
 }
 
-MM::DeviceDetectionStatus ShapeokoGrblHub::DetectDevice(void)
+int ShapeokoGrblHub::OnRxBufferSize(MM::PropertyBase* pProp, MM::ActionType pAct)
 {
-  LogMessage("DetectDevice");
-  if (initialized_)
-      return MM::CanCommunicate;
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(rxBufferSize_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      long size;
+      pProp->Get(size);
+      MMThreadGuard guard(streamLock_);
+      rxBufferSize_ = size;
+   }
+   return DEVICE_OK;
+}
 
-   // all conditions must be satisfied...
-   MM::DeviceDetectionStatus result = MM::Misconfigured;
-   char answerTO[MM::MaxStrLength];
+int ShapeokoGrblHub::OnMoveError(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(streamLock_);
+      pProp->Set(moveError_.c_str());
+   }
+   return DEVICE_OK;
+}
 
-   try
+int ShapeokoGrblHub::OnSequenceAdvance(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
    {
-      std::string portLowerCase = port_;
-      for( std::string::iterator its = portLowerCase.begin(); its != portLowerCase.end(); ++its)
-      {
-         *its = (char)tolower(*its);
-      }
-      if( 0< portLowerCase.length() &&  0 != portLowerCase.compare("undefined")  && 0 != portLowerCase.compare("unknown") )
-      {
-         result = MM::CanNotCommunicate;
-         // record the default answer time out
-         GetCoreCallback()->GetDeviceProperty(port_.c_str(), "AnswerTimeout", answerTO);
+      pProp->Set(sequenceWaitForCycleStart_ ? g_sequenceAdvanceCycleStart : g_sequenceAdvanceDwell);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      sequenceWaitForCycleStart_ = (mode == g_sequenceAdvanceCycleStart);
+   }
+   return DEVICE_OK;
+}
 
-         // device specific default communication parameters
-         // for Arduino Duemilanova
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_Handshaking, "Off");
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_BaudRate, "9600");
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_StopBits, "1");
-         // Arduino timed out in GetControllerVersion even if AnswerTimeout  = 300 ms
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), "AnswerTimeout", "500.0");
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), "DelayBetweenCharsMs", "0");
-         MM::Device* pS = GetCoreCallback()->GetDevice(this, port_.c_str());
-         pS->Initialize();
-         // The first second or so after opening the serial port, the Arduino is waiting for firmwareupgrades.  Simply sleep 1 second.
-         CDeviceUtils::SleepMs(2000);
-         MMThreadGuard myLock(executeLock_);
-         PurgeComPort(port_.c_str());
-         int ret = GetStatus();
-         // later, Initialize will explicitly check the version #
-         if( DEVICE_OK != ret )
-         {
-           LogMessage("Got:");
-            LogMessageCode(ret,true);
-         }
-         else
-         {
-            // to succeed must reach here....
-            result = MM::CanCommunicate;
-         }
-         pS->Shutdown();
-         // always restore the AnswerTimeout to the default
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), "AnswerTimeout", answerTO);
+int ShapeokoGrblHub::OnSequenceDwell(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(sequenceDwellMs_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(sequenceDwellMs_);
+   }
+   return DEVICE_OK;
+}
 
-      }
+int ShapeokoGrblHub::OnTriggerOutput(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      if (triggerOutput_ == TriggerCoolant)
+         pProp->Set(g_triggerCoolant);
+      else if (triggerOutput_ == TriggerSpindle)
+         pProp->Set(g_triggerSpindle);
+      else
+         pProp->Set(g_triggerNone);
    }
-   catch(...)
+   else if (pAct == MM::AfterSet)
    {
-      LogMessage("Exception in DetectDevice!",false);
+      std::string output;
+      pProp->Get(output);
+      if (output == g_triggerCoolant)
+         triggerOutput_ = TriggerCoolant;
+      else if (output == g_triggerSpindle)
+         triggerOutput_ = TriggerSpindle;
+      else
+         triggerOutput_ = TriggerNone;
    }
+   return DEVICE_OK;
+}
 
-   return result;
+int ShapeokoGrblHub::OnTriggerPulse(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(triggerPulseMs_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(triggerPulseMs_);
+   }
+   return DEVICE_OK;
 }
 
-int ShapeokoGrblHub::SetAnswerTimeoutMs(double timeout)
+int ShapeokoGrblHub::OnTriggerSpindleSpeed(MM::PropertyBase* pProp, MM::ActionType pAct)
 {
-      if(!portAvailable_)
-	   return ERR_NO_PORT_SET;
-     GetCoreCallback()->SetDeviceProperty(port_.c_str(), "AnswerTimeout",  CDeviceUtils::ConvertToString(timeout));
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(triggerSpindleSpeed_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(triggerSpindleSpeed_);
+   }
    return DEVICE_OK;
 }
 
-std::vector<std::string> &split(const std::string &s, char delim, std::vector<std::string> &elems) {
-    std::stringstream ss(s);
-    std::string item;
-    while (std::getline(ss, item, delim)) {
-        elems.push_back(item);
-    }
-    return elems;
+int ShapeokoGrblHub::OnStatsLatency(MM::PropertyBase* pProp, MM::ActionType pAct, long commandClass)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(stats_.FormatLatency((GrblCommandClass) commandClass).c_str());
+   }
+   return DEVICE_OK;
 }
 
+int ShapeokoGrblHub::OnStatsCounter(MM::PropertyBase* pProp, MM::ActionType pAct, long counter)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      long value = 0;
+      switch (counter)
+      {
+         case 0: value = stats_.GetBytesSent(); break;
+         case 1: value = stats_.GetBytesReceived(); break;
+         case 2: value = stats_.GetTimeouts(); break;
+         case 3: value = stats_.GetErrors(); break;
+         case 4: value = stats_.GetAlarms(); break;
+      }
+      pProp->Set(value);
+   }
+   return DEVICE_OK;
+}
 
-std::vector<std::string> split(const std::string &s, char delim) {
-    std::vector<std::string> elems;
-    split(s, delim, elems);
-    return elems;
+int ShapeokoGrblHub::OnStatsReset(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set("");
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      if (value == "Reset")
+         stats_.Reset();
+      pProp->Set("");
+   }
+   return DEVICE_OK;
 }
 
-template <class Type>
-Type stringToNum(const std::string& str)
+int ShapeokoGrblHub::OnCompletionGuard(MM::PropertyBase* pProp, MM::ActionType pAct)
 {
-	std::istringstream iss(str);
-	Type num;
-	iss >> num;
-	return num;
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(completionGuardMs_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(completionGuardMs_);
+   }
+   return DEVICE_OK;
 }
 
-std::string ShapeokoGrblHub::GetState() {
-  return state_;
+int ShapeokoGrblHub::OnCompletionMode(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(completionByDwell_ ? g_completionDwell : g_completionPolling);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      MMThreadGuard guard(streamLock_);
+      completionByDwell_ = (mode == g_completionDwell);
+      syncState_ = SyncNone;
+   }
+   return DEVICE_OK;
 }
 
-void ShapeokoGrblHub::GetPos(float &x, float &y) {
-  x = MPos[0];
-  y = MPos[1];
+int ShapeokoGrblHub::OnStartupBannerTimeout(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(startupBannerTimeoutMs_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(startupBannerTimeoutMs_);
+   }
+   return DEVICE_OK;
 }
 
-// private and expects caller to:
-// 1. guard the port
-// 2. purge the port
-int ShapeokoGrblHub::GetStatus()
+int ShapeokoGrblHub::OnStartupResetTimeout(MM::PropertyBase* pProp, MM::ActionType pAct)
 {
-  LogMessage("GetStatus");
-  int ret = SendCommand("?", "");
-  if(DEVICE_OK != ret){
-    return DEVICE_ERR;
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(startupResetTimeoutMs_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(startupResetTimeoutMs_);
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnBaudRates(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(baudRates_.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(baudRates_);
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnStartupTime(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(initializeMs_);
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnSetting(MM::PropertyBase* pProp, MM::ActionType pAct, long number)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(settingsLock_);
+      pProp->Set(settings_.Get(number));
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      double value;
+      pProp->Get(value);
+      // at the precision Grbl reports settings with; %g would cut to six
+      // digits and use exponents, which Grbl rejects
+      char text[32];
+      snprintf(text, sizeof(text), "%.3f", value);
+      value = atof(text);
+      {
+         MMThreadGuard guard(settingsLock_);
+         if (value == settings_.Get(number))
+         {
+            pProp->Set(value);
+            return DEVICE_OK;
+         }
+      }
+      char command[64];
+      snprintf(command, sizeof(command), "$%ld=%s", number, text);
+      std::string answer;
+      int ret = ExecuteCommand(command, answer, 1000);
+      if (ret == DEVICE_OK && IsErrorAnswer(answer))
+      {
+         // Grbl only takes settings while idle
+         LogMessage(std::string(command) + " rejected: " + answer);
+         ret = ERR_COMMAND_REJECTED;
+      }
+      MMThreadGuard guard(settingsLock_);
+      if (ret != DEVICE_OK)
+      {
+         pProp->Set(settings_.Get(number));
+         return ret;
+      }
+      settings_.Set(number, value);
+      pProp->Set(value);
+      ApplySettings();
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnMoveXYZ(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      char buf[100];
+      snprintf(buf, sizeof(buf), "%g,%g,%g", GetCommandedPositionUm(0),
+            GetCommandedPositionUm(1), GetCommandedPositionUm(2));
+      pProp->Set(buf);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      double x, y, z;
+      if (sscanf(value.c_str(), "%lf,%lf,%lf", &x, &y, &z) != 3)
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      return MoveXYZ(x, y, z);
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnRealtimeCommand(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(g_realtimeNone);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string command;
+      pProp->Get(command);
+      pProp->Set(g_realtimeNone);
+      if (command == g_realtimeFeedHold)
+         return FeedHold();
+      if (command == g_realtimeCycleStart)
+         return CycleStart();
+      if (command == g_realtimeJogCancel)
+         return JogCancel();
+      if (command == g_realtimeSoftReset)
+         return SoftReset();
+      if (command == g_realtimeStop)
+         return StopMotion();
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnJogInterval(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(jogIntervalMs_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      MMThreadGuard guard(jogLock_);
+      pProp->Get(jogIntervalMs_);
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnTileScanSetting(MM::PropertyBase* pProp, MM::ActionType pAct, long index)
+{
+   double* settings[] = {
+      &tileScan_.xMinUm, &tileScan_.xMaxUm, &tileScan_.yMinUm, &tileScan_.yMaxUm,
+      &tileScan_.tileWidthUm, &tileScan_.tileHeightUm, &tileScan_.overlapPercent,
+      &tileScan_.dwellMs
+   };
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(*settings[index]);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(*settings[index]);
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnTileScanFocusPlane(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      char buf[100] = "";
+      if (tileScan_.useFocusPlane)
+         snprintf(buf, sizeof(buf), "%g,%g,%g", tileScan_.z0Um, tileScan_.dzdx, tileScan_.dzdy);
+      pProp->Set(buf);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      if (value.empty())
+      {
+         tileScan_.useFocusPlane = false;
+         return DEVICE_OK;
+      }
+      if (sscanf(value.c_str(), "%lf,%lf,%lf", &tileScan_.z0Um, &tileScan_.dzdx, &tileScan_.dzdy) != 3)
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      tileScan_.useFocusPlane = true;
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnTileScanControl(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      long done, total;
+      GetTileScanProgress(done, total);
+      pProp->Set(done < total ? g_tileScanStart : g_tileScanIdle);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      if (value == g_tileScanStart)
+         return StartTileScan();
+      if (value == g_tileScanStop)
+         return StopTileScan();
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnTileScanProgress(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      long done, total;
+      GetTileScanProgress(done, total);
+      pProp->Set((std::to_string(done) + "/" + std::to_string(total)).c_str());
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnPositionHistorySize(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set((long) history_.GetCapacity());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      long size;
+      pProp->Get(size);
+      if ((size_t) size != history_.GetCapacity())
+         history_.SetCapacity(size);
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnPositionAt(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(positionAt_.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      if (value == positionAt_)  // result still there
+         return DEVICE_OK;
+      double ms;
+      if (sscanf(value.c_str(), "%lf", &ms) != 1)
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      positionAt_.clear();
+      double um[3];
+      if (GetPositionAt(MM::MMTime(ms * 1000.0), um))
+      {
+         char buf[100];
+         snprintf(buf, sizeof(buf), "%g,%g,%g", um[0], um[1], um[2]);
+         positionAt_ = buf;
+      }
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnPositionLogFile(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(history_.GetLogFile().c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string path;
+      pProp->Get(path);
+      if (path == history_.GetLogFile())
+         return DEVICE_OK;
+      if (!history_.SetLogFile(path))
+      {
+         LogMessage("Cannot open position log " + path);
+         return DEVICE_CAN_NOT_SET_PROPERTY;
+      }
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnFocusMapMode(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(statusLock_);
+      FocusMapMode mode = focusMap_.GetMode();
+      pProp->Set(mode == FocusMapPlane ? g_focusMapPlane : mode == FocusMapSurface ? g_focusMapSurface : g_focusMapOff);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      FocusMapMode mode = FocusMapOff;
+      if (value == g_focusMapPlane)
+         mode = FocusMapPlane;
+      else if (value == g_focusMapSurface)
+         mode = FocusMapSurface;
+      MMThreadGuard guard(statusLock_);
+      if (!focusMap_.Fit(mode, focusPoints_))
+      {
+         LogMessage("Focus map: " + std::to_string(focusPoints_.size()) + " points do not determine a " + value);
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      }
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnFocusMapPoints(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(statusLock_);
+      std::string value;
+      char buf[100];
+      for (size_t i = 0; i < focusPoints_.size(); i++)
+      {
+         snprintf(buf, sizeof(buf), "%s%g,%g,%g", i > 0 ? ";" : "",
+               focusPoints_[i].xUm, focusPoints_[i].yUm, focusPoints_[i].zUm);
+         value += buf;
+      }
+      pProp->Set(value.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      std::vector<FocusPoint> points;
+      size_t start = 0;
+      while (start < value.size())
+      {
+         size_t end = value.find(';', start);
+         if (end == std::string::npos)
+            end = value.size();
+         FocusPoint point;
+         if (sscanf(value.substr(start, end - start).c_str(), "%lf,%lf,%lf", &point.xUm, &point.yUm, &point.zUm) != 3)
+            return DEVICE_INVALID_PROPERTY_VALUE;
+         points.push_back(point);
+         start = end + 1;
+      }
+      // refit in the current mode; points that do not fit it are refused
+      MMThreadGuard guard(statusLock_);
+      FocusMap map;
+      if (!map.Fit(focusMap_.GetMode(), points))
+      {
+         LogMessage("Focus map: " + std::to_string(points.size()) + " points do not determine the map");
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      }
+      focusMap_ = map;
+      focusPoints_ = points;
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnVisitOrderFile(MM::PropertyBase* pProp, MM::ActionType pAct, long output)
+{
+   std::string& path = output ? visitOrderOutput_ : visitOrderInput_;
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(path.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(path);
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnVisitOrderStart(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(visitOrderKeepFirst_ ? g_visitOrderFromFirst : g_visitOrderFromCurrent);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      visitOrderKeepFirst_ = (value == g_visitOrderFromFirst);
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnVisitOrderControl(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(g_visitOrderIdle);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      if (value == g_visitOrderOptimize)
+      {
+         int ret = OptimizeVisitOrderFile();
+         pProp->Set(g_visitOrderIdle);
+         return ret;
+      }
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnVisitOrderResult(MM::PropertyBase* pProp, MM::ActionType pAct, long index)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(visitOrderResult_[index]);
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnJobFile(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(jobLock_);
+      pProp->Set(jobFile_.GetPath().c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string path;
+      pProp->Get(path);
+      return OpenJob(path);
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnJobControl(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      JobState state = GetJobState();
+      pProp->Set(state == JobRunning ? g_jobStart : state == JobPaused ? g_jobPause : g_jobIdle);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      if (value == g_jobStart)
+         return StartJob();
+      if (value == g_jobPause)
+         return PauseJob();
+      if (value == g_jobResume)
+         return ResumeJob();
+      if (value == g_jobAbort)
+         return AbortJob();
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnJobState(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(g_jobStateNames[GetJobState()]);
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnJobProgress(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      double percent;
+      long lineNumber;
+      std::string error;
+      GetJobProgress(percent, lineNumber, error);
+      pProp->Set(percent);
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnJobLine(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      double percent;
+      long lineNumber;
+      std::string error;
+      GetJobProgress(percent, lineNumber, error);
+      pProp->Set(lineNumber);
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OnJobError(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      double percent;
+      long lineNumber;
+      std::string error;
+      GetJobProgress(percent, lineNumber, error);
+      pProp->Set(error.c_str());
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::SendCommand(std::string command, std::string terminator)
+{
+  LogMessage("SendCommand", true);
+  LogMessage("command=" + command, true);
+   if(!portAvailable_)
+	   return ERR_NO_PORT_SET;
+   // needs a lock because the other Thread will also use this function
+   MMThreadGuard portGuard(executeLock_);
+   int ret = DEVICE_OK;
+
+   ret = SetCommandComPortH(command.c_str(), terminator.c_str());
+   if (ret != DEVICE_OK)
+   {
+	    LogMessage("command write fail");
+	   return ret;
+   }
+   stats_.AddBytesSent((long) (command.size() + terminator.size()));
+   return DEVICE_OK;
+}
+int ShapeokoGrblHub::ReceiveResponse(std::string &returnString, float timeout)
+{
+  MMThreadGuard portGuard(executeLock_);
+  SetAnswerTimeoutMs(timeout);
+
+  std::string an;
+  try
+    {
+
+      int ret = GetSerialAnswerComPortH(an,"\r\n");
+      if (ret != DEVICE_OK)
+	{
+	  LogMessage(std::string("answer get error!_"), true);
+	  return ret;
+	}
+      LogMessage("answer: " + an, true);
+      stats_.AddBytesReceived((long) an.size() + 2);
+      returnString.assign(an);
+      return DEVICE_OK;
+    }
+  catch(...)
+    {
+      LogMessage("Exception in send command!");
+      return DEVICE_ERR;
+    }
+
+}
+
+// Sends a command through the stream and waits for its answer.  The
+// answer holds any informational lines followed by the 'ok'/'error:' line.
+int ShapeokoGrblHub::ExecuteCommand(const std::string& command, std::string& answer, float timeout)
+{
+   long ticket = QueueCommand(command, false, true);
+   return WaitForReply(ticket, answer, timeout);
+}
+
+// Finishes a queued motion command.  The stages are busy until a status
+// report received after the controller accepted the move says it is idle
+// again.  In character-counting mode the move is only queued, so that
+// consecutive moves keep the planner filled; in lock-step mode its reply
+// was kept and is waited for.
+int ShapeokoGrblHub::CompleteMoveCommand(long ticket, bool lockStep)
+{
+   if (!lockStep)
+   {
+      QueueSyncDwell();
+      PumpStream(0);
+      return DEVICE_OK;
+   }
+   std::string answer;
+   int ret = WaitForReply(ticket, answer);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (IsErrorAnswer(answer))
+   {
+      LogMessage("Move rejected: " + answer);
+      return ERR_COMMAND_REJECTED;
+   }
+   QueueSyncDwell();
+   return DEVICE_OK;
+}
+
+// A move queued without waiting for its reply was rejected since the last
+// call: reported once, by the next MoveTo().
+int ShapeokoGrblHub::TakeMoveError()
+{
+   MMThreadGuard guard(streamLock_);
+   if (!moveErrorPending_)
+      return DEVICE_OK;
+   moveErrorPending_ = false;
+   LogMessage("Earlier move rejected: " + moveError_);
+   return ERR_COMMAND_REJECTED;
+}
+
+// Holds the stream lock so that the reply cannot be dispatched before the
+// ticket is recorded.
+void ShapeokoGrblHub::QueueSyncDwell()
+{
+   MMThreadGuard guard(streamLock_);
+   if (!completionByDwell_)
+      return;
+   syncTicket_ = QueueCommand("G4 P0", true, false);
+   syncState_ = SyncPending;
+}
+
+bool ShapeokoGrblHub::IsSyncDwellPending()
+{
+   MMThreadGuard guard(streamLock_);
+   return syncState_ == SyncPending && !IsTicketComplete(syncTicket_);
+}
+
+bool ShapeokoGrblHub::IsSyncDwellDone()
+{
+   MMThreadGuard guard(streamLock_);
+   // dropped by a cancel or a reset without an answer
+   if (syncState_ == SyncPending && IsTicketComplete(syncTicket_))
+   {
+      LogMessage("Sync dwell lost, polling for completion");
+      syncState_ = SyncNone;
+   }
+   return syncState_ == SyncDone;
+}
+
+std::string ShapeokoGrblHub::FormatMove(bool moveX, double xUm, bool moveY, double yUm, bool moveZ, double zUm)
+{
+   GrblMoveEncoder encoder = NewMoveEncoder();
+   std::string line;
+   encoder.Encode(moveX, xUm, moveY, yUm, moveZ, zUm, false, line);
+   return line;
+}
+
+// With the resolution from the $$ table and nothing known about the
+// controller's state
+GrblMoveEncoder ShapeokoGrblHub::NewMoveEncoder()
+{
+   GrblMoveEncoder encoder;
+   MMThreadGuard guard(settingsLock_);
+   for (int i = 0; i < 3; i++)
+      encoder.SetStepsPerMm(i, settings_.Get(GRBL_SETTING_STEPS_PER_MM + i));
+   return encoder;
+}
+
+// Totals of the moves MoveTo() wrote, compared with the format used before
+void ShapeokoGrblHub::GetMoveEncoderStats(long& moves, long& bytes, long& legacyBytes)
+{
+   MMThreadGuard guard(statusLock_);
+   moves = moveEncoder_.GetMoves();
+   bytes = moveEncoder_.GetBytes();
+   legacyBytes = moveEncoder_.GetLegacyBytes();
+}
+
+int ShapeokoGrblHub::MoveTo(bool moveX, double xUm, bool moveY, double yUm, bool moveZ, double zUm)
+{
+   int ret = TakeMoveError();
+   if (ret != DEVICE_OK)
+      return ret;
+   {
+      MMThreadGuard guard(statusLock_);
+      FollowFocusMap(commandedUm_, moveX, xUm, moveY, yUm, moveZ, zUm);
+   }
+   ret = CheckTargetUm(moveX, xUm, moveY, yUm, moveZ, zUm);
+   if (ret != DEVICE_OK)
+      return ret;
+   bool lockStep = !characterCounting_;
+   long ticket;
+   {
+      MMThreadGuard moveGuard(moveLock_);
+      // unchanged axes may only be left out once the lines that set them
+      // have been acknowledged
+      bool leaveOutUnchanged = IsStreamIdle();
+      std::string line;
+      {
+         MMThreadGuard guard(statusLock_);
+         if (moveEncoderStale_.exchange(false))
+            moveEncoder_.Reset();
+         // already there
+         if (!moveEncoder_.Encode(moveX, xUm, moveY, yUm, moveZ, zUm, leaveOutUnchanged, line))
+            return DEVICE_OK;
+      }
+      ticket = PushLine(line, true, lockStep);
+   }
+   ret = CompleteMoveCommand(ticket, lockStep);
+   if (ret != DEVICE_OK)
+   {
+      moveEncoderStale_ = true;
+      return ret;
+   }
+   PredictMove(moveX, xUm, moveY, yUm, moveZ, zUm);
+   MMThreadGuard guard(statusLock_);
+   if (moveX)
+      commandedUm_[0] = xUm;
+   if (moveY)
+      commandedUm_[1] = yUm;
+   if (moveZ)
+      commandedUm_[2] = zUm;
+   return DEVICE_OK;
+}
+
+// Extends the predicted completion time by the duration of a move from the
+// commanded position.  Moves queue behind each other in the planner, so
+// the durations add up.
+void ShapeokoGrblHub::PredictMove(bool moveX, double xUm, bool moveY, double yUm, bool moveZ, double zUm)
+{
+   MMThreadGuard guard(statusLock_);
+   double from[3], to[3];
+   for (int i = 0; i < 3; i++)
+      from[i] = to[i] = commandedUm_[i] / 1000.0;
+   if (moveX)
+      to[0] = xUm / 1000.0;
+   if (moveY)
+      to[1] = yUm / 1000.0;
+   if (moveZ)
+      to[2] = zUm / 1000.0;
+   double seconds = motionModel_.MoveSeconds(from, to);
+   if (seconds <= 0.0)
+      return;
+   MM::MMTime now = GetCurrentMMTime();
+   if (predictedIdle_ < now)
+      predictedIdle_ = now;
+   predictedIdle_ = predictedIdle_ + MM::MMTime(seconds * 1e6);
+}
+
+MM::MMTime ShapeokoGrblHub::GetPredictedCompletion()
+{
+   MMThreadGuard guard(statusLock_);
+   if (predictedIdle_ == MM::MMTime(0.0))
+      return predictedIdle_;
+   return predictedIdle_ - MM::MMTime(completionGuardMs_ * 1000.0);
+}
+
+// Reads the $$ table once; everything that depends on the machine's
+// configuration is derived from this copy.
+int ShapeokoGrblHub::ReadSettings()
+{
+   std::string answer;
+   int ret = ExecuteCommand("$$", answer, 2000);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (IsErrorAnswer(answer))
+      return ERR_COMMAND_REJECTED;
+   MMThreadGuard guard(settingsLock_);
+   if (!settings_.Parse(answer))
+      return ERR_COMMUNICATION;
+   ApplySettings();
+   return DEVICE_OK;
+}
+
+// Expects the caller to hold settingsLock_
+void ShapeokoGrblHub::ApplySettings()
+{
+   for (int i = 0; i < 3; i++)
+      motionModel_.SetAxis(i, settings_.Get(GRBL_SETTING_MAX_RATE + i),
+            settings_.Get(GRBL_SETTING_ACCELERATION + i));
+   MMThreadGuard guard(statusLock_);
+   for (int i = 0; i < 3; i++)
+      moveEncoder_.SetStepsPerMm(i, settings_.Get(GRBL_SETTING_STEPS_PER_MM + i));
+}
+
+double ShapeokoGrblHub::GetStepSizeUm(int axis)
+{
+   MMThreadGuard guard(settingsLock_);
+   double stepsPerMm = settings_.Get(GRBL_SETTING_STEPS_PER_MM + axis);
+   if (stepsPerMm > 0.0)
+      return 1000.0 / stepsPerMm;
+   // what the adapter assumed before it read the settings
+   return axis == 2 ? 5.0 : 0.025;
+}
+
+// XY start at the origin corner, so they travel in the positive
+// direction only; Z starts at an unknown height and may go either way.
+void ShapeokoGrblHub::GetTravelLimitsUm(int axis, double& lowerUm, double& upperUm)
+{
+   MMThreadGuard guard(settingsLock_);
+   // without settings: the limits the stages used to have
+   upperUm = settings_.Get(GRBL_SETTING_MAX_TRAVEL + axis, axis == 2 ? 100.0 : 20.0) * 1000.0;
+   lowerUm = axis == 2 ? -upperUm : 0.0;
+}
+
+int ShapeokoGrblHub::CheckTargetUm(bool moveX, double xUm, bool moveY, double yUm, bool moveZ, double zUm)
+{
+   bool move[3] = {moveX, moveY, moveZ};
+   double target[3] = {xUm, yUm, zUm};
+   for (int i = 0; i < 3; i++)
+   {
+      {
+         MMThreadGuard guard(settingsLock_);
+         if (!move[i] || !settings_.Has(GRBL_SETTING_MAX_TRAVEL + i))
+            continue;
+      }
+      double lower, upper;
+      GetTravelLimitsUm(i, lower, upper);
+      if (target[i] < lower || target[i] > upper)
+      {
+         LogMessage("Target " + std::to_string(target[i]) + " um is outside the travel of axis " + std::to_string(i));
+         return ERR_MOVE_OUT_OF_RANGE;
+      }
+   }
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::MoveXYZ(double xUm, double yUm, double zUm)
+{
+   return MoveTo(true, xUm, true, yUm, true, zUm);
+}
+
+double ShapeokoGrblHub::GetCommandedPositionUm(int axis)
+{
+   MMThreadGuard guard(statusLock_);
+   return commandedUm_[axis];
+}
+
+// Two lookups in the fitted map, so cheap enough for every move
+bool ShapeokoGrblHub::FollowFocusMap(const double fromUm[3], bool moveX, double xUm, bool moveY, double yUm,
+      bool& moveZ, double& zUm)
+{
+   if (moveZ || !(moveX || moveY))
+      return false;
+   MMThreadGuard guard(statusLock_);
+   if (!focusMap_.IsEnabled())
+      return false;
+   double toX = moveX ? xUm : fromUm[0];
+   double toY = moveY ? yUm : fromUm[1];
+   zUm = fromUm[2] + focusMap_.GetZUm(toX, toY) - focusMap_.GetZUm(fromUm[0], fromUm[1]);
+   moveZ = true;
+   return true;
+}
+
+void ShapeokoGrblHub::SetCommandedPositionUm(int axis, double positionUm)
+{
+   MMThreadGuard guard(statusLock_);
+   commandedUm_[axis] = positionUm;
+}
+
+long ShapeokoGrblHub::QueueCommand(const std::string& command, bool isMotion, bool keepReply)
+{
+   if (!GrblMoveEncoder::ChangesMotionState(command))
+      return PushLine(command, isMotion, keepReply);
+   // not between MoveTo() encoding a move and queueing it
+   MMThreadGuard guard(moveLock_);
+   moveEncoderStale_ = true;
+   return PushLine(command, isMotion, keepReply);
+}
+
+long ShapeokoGrblHub::PushLine(const std::string& command, bool isMotion, bool keepReply)
+{
+   // not streamLock_: callers never wait for the I/O thread here
+   StreamedLine entry;
+   entry.line = command;
+   entry.isMotion = isMotion;
+   entry.keepReply = keepReply;
+   {
+      std::lock_guard<std::mutex> guard(submitLock_);
+      entry.ticket = nextTicket_++;
+      outstandingTickets_.insert(entry.ticket);
+      submissions_.Push(entry);
+   }
+   WakeIoThread();
+   return entry.ticket;
+}
+
+// Cuts the I/O thread's idle wait short; it never sleeps for more than
+// 1 ms anyway, so a wake-up that comes too early is harmless.
+void ShapeokoGrblHub::WakeIoThread()
+{
+   ioWakeRequested_ = true;
+   ioWake_.notify_one();
+}
+
+// Waits until the reply for the given ticket has arrived, reading from the
+// port in the meantime unless the I/O thread does.
+int ShapeokoGrblHub::WaitForReply(long ticket, std::string& answer, float timeout)
+{
+   MM::MMTime deadline = GetCurrentMMTime() + MM::MMTime(timeout * 1000.0);
+   for (;;)
+   {
+      unsigned long seen = GetIoEventCount();
+      {
+         MMThreadGuard guard(streamLock_);
+         std::map<long, std::string>::iterator it = replies_.find(ticket);
+         if (it != replies_.end())
+         {
+            answer = it->second;
+            replies_.erase(it);
+            return DEVICE_OK;
+         }
+         if (IsTicketComplete(ticket))
+         {
+            answer = "ok";
+            return DEVICE_OK;
+         }
+      }
+      MM::MMTime now = GetCurrentMMTime();
+      if (now > deadline)
+      {
+         LogMessage("Timeout waiting for reply to command " + std::to_string(ticket));
+         stats_.CountTimeout();
+         return ERR_COMMUNICATION;
+      }
+      double remaining = std::min(50.0, (deadline - now).getMsec());
+      if (IsIoThreadRunning())
+         WaitForIoEvent(seen, remaining);
+      else
+         PumpStream((float) remaining);
+   }
+}
+
+// Waits until every queued line has been acknowledged.
+int ShapeokoGrblHub::WaitForStream(float timeout)
+{
+   MM::MMTime deadline = GetCurrentMMTime() + MM::MMTime(timeout * 1000.0);
+   for (;;)
+   {
+      MM::MMTime now = GetCurrentMMTime();
+      if (now > deadline)
+         return ERR_COMMUNICATION;
+      if (!PumpStream((float) std::min(50.0, (deadline - now).getMsec())))
+         return DEVICE_OK;
+   }
+}
+
+// Drops lines from fromTicket on that have not been sent yet.  Lines
+// already in the controller's buffer still execute.
+void ShapeokoGrblHub::CancelQueuedCommands(long fromTicket)
+{
+   // a dropped move may have been one the encoder counts on
+   moveEncoderStale_ = true;
+   MMThreadGuard guard(streamLock_);
+   DrainSubmissions();
+   std::deque<StreamedLine>::iterator it = pendingLines_.begin();
+   while (it != pendingLines_.end())
+   {
+      if (it->ticket >= fromTicket)
+      {
+         if (it->keepReply)
+            replies_[it->ticket] = "error: cancelled";
+         MarkTicketDone(it->ticket);
+         it = pendingLines_.erase(it);
+      }
+      else
+         ++it;
+   }
+}
+
+// Queues a block of lines without waiting for replies and returns the
+// ticket of the first one.  Optionally returns the tickets of all lines.
+long ShapeokoGrblHub::StreamLines(const std::vector<std::string>& lines, bool isMotion, std::vector<long>* tickets)
+{
+   long first = 0;
+   for (size_t i = 0; i < lines.size(); i++)
+   {
+      long ticket = QueueCommand(lines[i], isMotion, false);
+      if (i == 0)
+         first = ticket;
+      if (tickets != 0)
+         tickets->push_back(ticket);
+   }
+   if (isMotion)
+      QueueSyncDwell();
+   PumpStream(0);
+   return first;
+}
+
+// A ticket is complete once its line has been answered, cancelled or
+// dropped.  Recorded explicitly: a line another producer has not finished
+// pushing yet can hide lines behind it from the queue's consumer.
+bool ShapeokoGrblHub::IsTicketComplete(long ticket)
+{
+   std::lock_guard<std::mutex> guard(submitLock_);
+   return outstandingTickets_.count(ticket) == 0;
+}
+
+void ShapeokoGrblHub::MarkTicketDone(long ticket)
+{
+   std::lock_guard<std::mutex> guard(submitLock_);
+   outstandingTickets_.erase(ticket);
+}
+
+int ShapeokoGrblHub::StartTileScan()
+{
+   // its tickets are all that Stop and the progress know of a scan
+   long done, total;
+   GetTileScanProgress(done, total);
+   if (done < total)
+      return ERR_TILE_SCAN_ACTIVE;
+
+   std::vector<TilePosition> tiles;
+   if (!PlanTileScan(tileScan_, tiles))
+      return DEVICE_INVALID_PROPERTY_VALUE;
+
+   // a move, the trigger pulse and a dwell per tile; the dwell is answered
+   // only once all of it has happened, so it marks the tile done
+   std::vector<std::string> lines;
+   std::vector<size_t> markers;
+   GrblMoveEncoder encoder = NewMoveEncoder();
+   // without a focus plane of its own the scan follows the focus map
+   double fromUm[3];
+   for (int i = 0; i < 3; i++)
+      fromUm[i] = GetCommandedPositionUm(i);
+   bool movesZ = false;
+   for (size_t i = 0; i < tiles.size(); i++)
+   {
+      bool moveZ = tileScan_.useFocusPlane;
+      double zUm = tiles[i].zUm;
+      FollowFocusMap(fromUm, true, tiles[i].xUm, true, tiles[i].yUm, moveZ, zUm);
+      int ret = CheckTargetUm(true, tiles[i].xUm, true, tiles[i].yUm, moveZ, zUm);
+      if (ret != DEVICE_OK)
+         return ret;
+      AppendTriggeredMove(encoder, lines, true, tiles[i].xUm, true, tiles[i].yUm,
+            moveZ, zUm, tileScan_.dwellMs);
+      markers.push_back(lines.size() - 1);
+      fromUm[0] = tiles[i].xUm;
+      fromUm[1] = tiles[i].yUm;
+      if (moveZ)
+         fromUm[2] = zUm;
+      movesZ = movesZ || moveZ;
+   }
+   LogMessage("Tile scan: " + std::to_string(tiles.size()) + " tiles");
+
+   std::vector<long> tickets;
+   StreamLines(lines, true, &tickets);
+   tileTickets_.clear();
+   for (size_t i = 0; i < markers.size(); i++)
+      tileTickets_.push_back(tickets[markers[i]]);
+
+   SetCommandedPositionUm(0, fromUm[0]);
+   SetCommandedPositionUm(1, fromUm[1]);
+   if (movesZ)
+      SetCommandedPositionUm(2, fromUm[2]);
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::StopTileScan()
+{
+   if (tileTickets_.empty())
+      return DEVICE_OK;
+   tileTickets_.clear();
+   return StopMotion();
+}
+
+void ShapeokoGrblHub::GetTileScanProgress(long& done, long& total)
+{
+   total = (long) tileTickets_.size();
+   // markers complete in order; find the first one still outstanding
+   long lo = 0, hi = total;
+   while (lo < hi)
+   {
+      long mid = (lo + hi) / 2;
+      if (IsTicketComplete(tileTickets_[mid]))
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   done = lo;
+}
+
+int ShapeokoGrblHub::OptimizeVisitOrder(const std::vector<VisitPoint>& points, bool keepFirst,
+      std::vector<size_t>& order, double& secondsBefore, double& secondsAfter)
+{
+   MotionModel model;
+   {
+      MMThreadGuard guard(settingsLock_);
+      model = motionModel_;
+   }
+   if (!model.IsValid())
+      return ERR_NO_MOTION_MODEL;
+
+   double startUm[3];
+   std::vector<VisitPoint> rest;
+   if (keepFirst && !points.empty())
+   {
+      startUm[0] = points[0].xUm;
+      startUm[1] = points[0].yUm;
+      startUm[2] = points[0].zUm;
+      rest.assign(points.begin() + 1, points.end());
+   }
+   else
+   {
+      for (int i = 0; i < 3; i++)
+         startUm[i] = GetCommandedPositionUm(i);
+      rest = points;
+   }
+   std::vector<size_t> given(rest.size());
+   for (size_t i = 0; i < given.size(); i++)
+      given[i] = i;
+   std::vector<size_t> optimized;
+   ::OptimizeVisitOrder(model, startUm, rest, optimized);
+   secondsBefore = VisitOrderSeconds(model, startUm, rest, given);
+   secondsAfter = VisitOrderSeconds(model, startUm, rest, optimized);
+
+   order.clear();
+   size_t offset = (keepFirst && !points.empty()) ? 1 : 0;
+   if (offset == 1)
+      order.push_back(0);
+   for (size_t i = 0; i < optimized.size(); i++)
+      order.push_back(optimized[i] + offset);
+   return DEVICE_OK;
+}
+
+int ShapeokoGrblHub::OptimizeVisitOrderFile()
+{
+   MM::MMTime start = GetCurrentMMTime();
+   FILE* file = fopen(visitOrderInput_.c_str(), "r");
+   if (file == 0)
+   {
+      LogMessage("Cannot read " + visitOrderInput_);
+      return ERR_POSITION_FILE;
+   }
+   // positions without a Z are costed at the Z they will be visited at:
+   // the current one, or the focus map's
+   double currentUm[3];
+   for (int i = 0; i < 3; i++)
+      currentUm[i] = GetCommandedPositionUm(i);
+   std::vector<VisitPoint> points;
+   std::vector<bool> hasZ;
+   char line[256];
+   long lineNumber = 0;
+   while (fgets(line, sizeof(line), file) != 0)
+   {
+      lineNumber++;
+      // numbers separated by commas, semicolons or white space; '#'
+      // starts a comment
+      char* comment = strchr(line, '#');
+      if (comment != 0)
+         *comment = 0;
+      double values[3];
+      int count = 0;
+      char* p = line;
+      for (;;)
+      {
+         while (*p != 0 && (isspace((unsigned char) *p) || *p == ',' || *p == ';'))
+            p++;
+         if (*p == 0)
+            break;
+         char* end;
+         double value = strtod(p, &end);
+         if (end == p || count == 3)
+         {
+            count = -1;
+            break;
+         }
+         values[count++] = value;
+         p = end;
+      }
+      if (count == 0)
+         continue;
+      if (count < 2)
+      {
+         fclose(file);
+         LogMessage(visitOrderInput_ + " line " + std::to_string(lineNumber) + ": expected x,y or x,y,z");
+         return ERR_POSITION_FILE;
+      }
+      VisitPoint point;
+      point.xUm = values[0];
+      point.yUm = values[1];
+      bool moveZ = (count == 3);
+      point.zUm = moveZ ? values[2] : currentUm[2];
+      FollowFocusMap(currentUm, true, point.xUm, true, point.yUm, moveZ, point.zUm);
+      points.push_back(point);
+      hasZ.push_back(count == 3);
+   }
+   fclose(file);
+
+   std::vector<size_t> order;
+   int ret = OptimizeVisitOrder(points, visitOrderKeepFirst_, order, visitOrderResult_[0], visitOrderResult_[1]);
+   if (ret != DEVICE_OK)
+      return ret;
+   visitOrderResult_[2] = (GetCurrentMMTime() - start).getMsec();
+   char buf[200];
+   snprintf(buf, sizeof(buf), "Visit order: %ld positions, %.3f s -> %.3f s in %.1f ms",
+         (long) points.size(), visitOrderResult_[0], visitOrderResult_[1], visitOrderResult_[2]);
+   LogMessage(buf);
+
+   if (visitOrderOutput_.empty())
+      return DEVICE_OK;
+   file = fopen(visitOrderOutput_.c_str(), "w");
+   if (file == 0)
+   {
+      LogMessage("Cannot write " + visitOrderOutput_);
+      return ERR_POSITION_FILE;
+   }
+   for (size_t i = 0; i < order.size(); i++)
+   {
+      const VisitPoint& point = points[order[i]];
+      if (hasZ[order[i]])
+         fprintf(file, "%ld,%.3f,%.3f,%.3f\n", (long) order[i], point.xUm, point.yUm, point.zUm);
+      else
+         fprintf(file, "%ld,%.3f,%.3f\n", (long) order[i], point.xUm, point.yUm);
+   }
+   fclose(file);
+   return DEVICE_OK;
+}
+
+// Maps the program; an empty path closes it
+int ShapeokoGrblHub::OpenJob(const std::string& path)
+{
+   MMThreadGuard guard(jobLock_);
+   if (path == jobFile_.GetPath())
+      return DEVICE_OK;
+   if (jobState_ == JobRunning || jobState_ == JobPaused || !jobLines_.empty())
+      return ERR_JOB_ACTIVE;
+   jobState_ = JobIdle;
+   jobLineNumber_ = 0;
+   jobDoneBytes_ = 0;
+   jobError_.clear();
+   if (path.empty())
+   {
+      jobFile_.Close();
+      return DEVICE_OK;
+   }
+   if (!jobFile_.Open(path))
+   {
+      LogMessage("Cannot open G-code file " + path);
+      return ERR_JOB_FILE;
+   }
+   LogMessage("G-code file " + path + ": " + std::to_string((long long) jobFile_.GetSize()) + " bytes");
+   return DEVICE_OK;
+}
+
+// Runs the program from its first line.  The I/O thread feeds it, so
+// nothing is sent before that runs.
+int ShapeokoGrblHub::StartJob()
+{
+   if (!IsIoThreadRunning())
+      return ERR_COMMUNICATION;
+   {
+      MMThreadGuard guard(jobLock_);
+      if (!jobFile_.IsOpen())
+         return ERR_JOB_FILE;
+      // the answers to an aborted run's lines may still be on their way
+      if (jobState_ == JobRunning || jobState_ == JobPaused || !jobLines_.empty())
+         return ERR_JOB_ACTIVE;
+      jobFile_.Rewind();
+      jobState_ = JobRunning;
+      jobEndQueued_ = false;
+      jobLineNumber_ = 0;
+      jobDoneBytes_ = 0;
+      jobError_.clear();
+      jobResyncPending_ = false;
+      LogMessage("Job started: " + jobFile_.GetPath());
+   }
+   WakeIoThread();
+   return DEVICE_OK;
+}
+
+// Stops feeding and holds the motion; lines the controller already has
+// resume with it
+int ShapeokoGrblHub::PauseJob()
+{
+   {
+      MMThreadGuard guard(jobLock_);
+      if (jobState_ != JobRunning)
+         return DEVICE_OK;
+      jobState_ = JobPaused;
+   }
+   return FeedHold();
+}
+
+int ShapeokoGrblHub::ResumeJob()
+{
+   {
+      MMThreadGuard guard(jobLock_);
+      if (jobState_ != JobPaused)
+         return DEVICE_OK;
+      jobState_ = JobRunning;
+   }
+   WakeIoThread();
+   return CycleStart();
+}
+
+// Drops the lines not sent yet and brings the machine to a stop.  The
+// answers for the lines that were out are collected as they come in.
+int ShapeokoGrblHub::AbortJob()
+{
+   {
+      MMThreadGuard guard(jobLock_);
+      if (jobState_ != JobRunning && jobState_ != JobPaused)
+         return DEVICE_OK;
+      jobState_ = JobAborted;
+      jobResyncPending_ = false;
+   }
+   LogMessage("Job aborted");
+   // StopMotion() also takes the position back from the machine
+   return StopMotion();
+}
+
+JobState ShapeokoGrblHub::GetJobState()
+{
+   MMThreadGuard guard(jobLock_);
+   return jobState_;
+}
+
+void ShapeokoGrblHub::GetJobProgress(double& percent, long& lineNumber, std::string& error)
+{
+   MMThreadGuard guard(jobLock_);
+   uint64_t size = jobFile_.GetSize();
+   if (jobState_ == JobDone)
+      percent = 100.0;
+   else
+      percent = size > 0 ? 100.0 * (double) jobDoneBytes_ / (double) size : 0.0;
+   lineNumber = jobLineNumber_;
+   error = jobError_;
+}
+
+// Non-blocking counterpart of WaitForReply(): false while the answer has
+// not come in.  Only for lines queued with keepReply.
+bool ShapeokoGrblHub::TakeReply(long ticket, std::string& answer)
+{
+   MMThreadGuard guard(streamLock_);
+   std::map<long, std::string>::iterator it = replies_.find(ticket);
+   if (it == replies_.end())
+      return false;
+   answer = it->second;
+   replies_.erase(it);
+   return true;
+}
+
+// Collects the answers to job lines and, while the job runs, queues more
+// of it.  Runs on the I/O thread, so it must never wait for the controller.
+void ShapeokoGrblHub::ServiceJob()
+{
+   MMThreadGuard guard(jobLock_);
+   // answers come in the order the lines were queued
+   while (!jobLines_.empty())
+   {
+      std::string answer;
+      if (!TakeReply(jobLines_.front().ticket, answer))
+         break;
+      const JobLine& line = jobLines_.front();
+      if (jobState_ == JobRunning || jobState_ == JobPaused)
+      {
+         if (IsErrorAnswer(answer))
+         {
+            // what the controller already has still runs; the rest is dropped
+            jobError_ = "line " + std::to_string(line.lineNumber) + ": " + line.text + ": " + answer;
+            LogMessage("Job failed at " + jobError_);
+            jobState_ = JobFailed;
+            CancelQueuedCommands(line.ticket + 1);
+            jobResyncPending_ = true;
+            jobEndedAt_ = GetCurrentMMTime();
+         }
+         else
+         {
+            jobLineNumber_ = line.lineNumber;
+            jobDoneBytes_ = line.endOffset;
+         }
+      }
+      jobLines_.pop_front();
+   }
+
+   if (jobState_ == JobRunning)
+   {
+      while (jobLines_.size() < g_jobLookahead && !jobEndQueued_)
+      {
+         JobLine line;
+         bool isMotion;
+         if (jobFile_.NextLine(line.text, line.lineNumber, line.endOffset))
+            isMotion = GrblMoveEncoder::ChangesMotionState(line.text);
+         else
+         {
+            // answered once all motion before it has finished
+            line.text = "G4 P0";
+            line.lineNumber = jobFile_.GetLineNumber();
+            line.endOffset = jobFile_.GetSize();
+            isMotion = true;
+            jobEndQueued_ = true;
+         }
+         line.ticket = QueueCommand(line.text, isMotion, true);
+         jobLines_.push_back(line);
+      }
+      if (jobEndQueued_ && jobLines_.empty())
+      {
+         LogMessage("Job done: " + std::to_string(jobLineNumber_) + " lines");
+         jobState_ = JobDone;
+         jobResyncPending_ = true;
+         jobEndedAt_ = GetCurrentMMTime();
+      }
+   }
+
+   // the program moved the machine behind the stages' backs; take the
+   // position from the first report once it has stopped
+   if (jobResyncPending_)
+   {
+      MMThreadGuard statusGuard(statusLock_);
+      if (status_.timestamp > jobEndedAt_ && status_.state == "Idle")
+      {
+         for (int i = 0; i < 3; i++)
+            commandedUm_[i] = status_.WPos[i] * 1000.0;
+         jobResyncPending_ = false;
+      }
+   }
+}
+
+void ShapeokoGrblHub::GetSequenceWaitLines(std::vector<std::string>& lines)
+{
+   if (sequenceWaitForCycleStart_)
+   {
+      // program pause; Grbl resumes when the cycle start pin is triggered
+      lines.push_back("M0");
+      return;
+   }
+   char buf[32];
+   snprintf(buf, sizeof(buf), "G4 P%.3f", sequenceDwellMs_ / 1000.0);
+   lines.push_back(buf);
+}
+
+// Grbl waits for the planner to empty before it switches coolant or
+// spindle, so the pulse starts once the moves before it are done.  No
+// lines when no trigger output is set.
+void ShapeokoGrblHub::GetTriggerLines(std::vector<std::string>& lines)
+{
+   if (triggerOutput_ == TriggerNone)
+      return;
+   char buf[32];
+   if (triggerOutput_ == TriggerSpindle)
+   {
+      snprintf(buf, sizeof(buf), "M3 S%g", triggerSpindleSpeed_);
+      lines.push_back(buf);
+   }
+   else
+      lines.push_back("M8");
+   if (triggerPulseMs_ > 0.0)
+   {
+      snprintf(buf, sizeof(buf), "G4 P%.3f", triggerPulseMs_ / 1000.0);
+      lines.push_back(buf);
+   }
+   lines.push_back(triggerOutput_ == TriggerSpindle ? "M5" : "M9");
+}
+
+// The final dwell is always there, even for a zero wait: its reply is
+// what tells that the point is done.  The lines go out in bulk, so the
+// move names every axis it sets.
+void ShapeokoGrblHub::AppendTriggeredMove(GrblMoveEncoder& encoder, std::vector<std::string>& lines, bool moveX, double xUm,
+      bool moveY, double yUm, bool moveZ, double zUm, double waitMs)
+{
+   std::string line;
+   if (encoder.Encode(moveX, xUm, moveY, yUm, moveZ, zUm, false, line))
+      lines.push_back(line);
+   GetTriggerLines(lines);
+   char buf[32];
+   snprintf(buf, sizeof(buf), "G4 P%.3f", waitMs / 1000.0);
+   lines.push_back(buf);
+}
+
+int ShapeokoGrblHub::QueueTriggeredMove(bool moveX, double xUm, bool moveY, double yUm, bool moveZ, double zUm,
+      double waitMs, long& ticket)
+{
+   {
+      MMThreadGuard guard(statusLock_);
+      FollowFocusMap(commandedUm_, moveX, xUm, moveY, yUm, moveZ, zUm);
+   }
+   int ret = CheckTargetUm(moveX, xUm, moveY, yUm, moveZ, zUm);
+   if (ret != DEVICE_OK)
+      return ret;
+   std::vector<std::string> lines;
+   GrblMoveEncoder encoder = NewMoveEncoder();
+   AppendTriggeredMove(encoder, lines, moveX, xUm, moveY, yUm, moveZ, zUm, waitMs);
+   std::vector<long> tickets;
+   StreamLines(lines, true, &tickets);
+   ticket = tickets.back();
+   PredictMove(moveX, xUm, moveY, yUm, moveZ, zUm);
+   MMThreadGuard guard(statusLock_);
+   if (moveX)
+      commandedUm_[0] = xUm;
+   if (moveY)
+      commandedUm_[1] = yUm;
+   if (moveZ)
+      commandedUm_[2] = zUm;
+   return DEVICE_OK;
+}
+
+bool ShapeokoGrblHub::IsStreamIdle()
+{
+   MMThreadGuard guard(streamLock_);
+   DrainSubmissions();
+   return pendingLines_.empty() && inFlight_.empty();
+}
+
+bool ShapeokoGrblHub::IsErrorAnswer(const std::string& answer)
+{
+   size_t start = answer.rfind('\n');
+   start = (start == std::string::npos) ? 0 : start + 1;
+   return answer.compare(start, 5, "error") == 0;
+}
+
+// Lock-step mode allows a single line in flight.  Character counting allows
+// as many as fit in the controller's RX buffer; a line that could never fit
+// is sent on its own.
+bool ShapeokoGrblHub::LineFits(size_t length)
+{
+   if (inFlight_.empty())
+      return true;
+   if (!characterCounting_)
+      return false;
+   return inFlightBytes_ + (long) length + 1 <= rxBufferSize_;
+}
+
+// Moves submitted lines into the stream.  Whoever holds streamLock_ is the
+// submission queue's only consumer.
+void ShapeokoGrblHub::DrainSubmissions()
+{
+   StreamedLine entry;
+   while (submissions_.Pop(entry))
+      pendingLines_.push_back(entry);
+}
+
+// Sends as many queued lines as the flow control allows.  Called by
+// whoever reads the port, so that replies can be matched in send order.
+void ShapeokoGrblHub::SendPendingLines()
+{
+   bool failed = false;
+   for (;;)
+   {
+      StreamedLine entry;
+      {
+         MMThreadGuard guard(streamLock_);
+         DrainSubmissions();
+         if (pendingLines_.empty() || !LineFits(pendingLines_.front().line.size()))
+            break;
+         entry = pendingLines_.front();
+         pendingLines_.pop_front();
+         entry.sentAt = GetCurrentMMTime();
+         inFlight_.push_back(entry);
+         inFlightBytes_ += (long) entry.line.size() + 1;
+      }
+      if (SendCommand(entry.line) != DEVICE_OK)
+      {
+         // the line never made it to the controller, so no reply will come
+         MMThreadGuard guard(streamLock_);
+         inFlight_.pop_back();
+         inFlightBytes_ -= (long) entry.line.size() + 1;
+         if (entry.keepReply)
+            replies_[entry.ticket] = "error: write failed";
+         MarkTicketDone(entry.ticket);
+         lastStreamError_ = "write failed: " + entry.line;
+         failed = true;
+      }
+   }
+   if (failed)
+      SignalIoEvent();
+}
+
+// Sends what fits, then reads at most one reply, waiting up to timeout ms
+// for it.  Once the I/O thread runs it does both, and this only waits for
+// it to dispatch something.  Returns true while there are lines left to
+// send or acknowledge.
+bool ShapeokoGrblHub::PumpStream(float timeout)
+{
+   if (IsIoThreadRunning())
+   {
+      unsigned long seen = GetIoEventCount();
+      if (IsStreamIdle())
+         return false;
+      if (timeout > 0)
+         WaitForIoEvent(seen, timeout);
+      return !IsStreamIdle();
+   }
+
+   MMThreadGuard portGuard(executeLock_);
+   SendPendingLines();
+   {
+      MMThreadGuard guard(streamLock_);
+      if (inFlight_.empty())
+         return !pendingLines_.empty();
+   }
+   if (timeout > 0)
+   {
+      std::string line;
+      if (ReceiveResponse(line, timeout) == DEVICE_OK)
+         DispatchLine(line);
+   }
+   return !IsStreamIdle();
+}
+
+// One turn of the I/O thread: sends what fits, then dispatches the
+// complete lines the controller has sent.  When there was nothing to read
+// it sleeps until a line is submitted, for at most 1 ms.
+void ShapeokoGrblHub::ServiceIo()
+{
+   ioWakeRequested_ = false;
+   ServiceJob();
+   {
+      MMThreadGuard portGuard(executeLock_);
+      SendPendingLines();
+      unsigned char buffer[256];
+      unsigned long bytesRead = 0;
+      if (ReadFromComPortH(buffer, sizeof(buffer), bytesRead) == DEVICE_OK && bytesRead > 0)
+      {
+         stats_.AddBytesReceived((long) bytesRead);
+         rxLine_.append((const char*) buffer, bytesRead);
+         bool dispatched = false;
+         size_t end;
+         while ((end = rxLine_.find('\n')) != std::string::npos)
+         {
+            std::string line = rxLine_.substr(0, end);
+            rxLine_.erase(0, end + 1);
+            if (!line.empty() && line[line.size() - 1] == '\r')
+               line.erase(line.size() - 1);
+            LogMessage("answer: " + line, true);
+            DispatchLine(line);
+            dispatched = true;
+         }
+         if (dispatched)
+            SignalIoEvent();
+         return;
+      }
+   }
+   std::unique_lock<std::mutex> lock(ioWakeMutex_);
+   ioWake_.wait_for(lock, std::chrono::milliseconds(1), [this] { return ioWakeRequested_.load(); });
+}
+
+// Waiters take the event count before checking their condition and then
+// wait for it to change, so that no event between the two is missed.
+unsigned long ShapeokoGrblHub::GetIoEventCount()
+{
+   std::lock_guard<std::mutex> lock(ioEventMutex_);
+   return ioEvents_;
+}
+
+void ShapeokoGrblHub::SignalIoEvent()
+{
+   {
+      std::lock_guard<std::mutex> lock(ioEventMutex_);
+      ioEvents_++;
+   }
+   ioEvent_.notify_all();
+}
+
+void ShapeokoGrblHub::WaitForIoEvent(unsigned long seenEvents, double timeoutMs)
+{
+   std::unique_lock<std::mutex> lock(ioEventMutex_);
+   ioEvent_.wait_for(lock, std::chrono::duration<double, std::milli>(timeoutMs),
+         [this, seenEvents] { return ioEvents_ != seenEvents; });
+}
+
+// Writes a real-time byte straight to the port.  Deliberately does not
+// take the port lock: Grbl picks these bytes out of the input wherever they
+// land, so they can jump ahead of a reply another thread is waiting for.
+int ShapeokoGrblHub::SendRealtime(unsigned char command)
+{
+   if (!portAvailable_)
+      return ERR_NO_PORT_SET;
+   LogMessage("Real-time command " + std::to_string((int) command), true);
+   {
+      // holds, resets and cancels make the prediction meaningless
+      MMThreadGuard guard(statusLock_);
+      predictedIdle_ = MM::MMTime(0.0);
+   }
+   MM::MMTime start = GetCurrentMMTime();
+   int ret = WriteToComPortH(&command, 1);
+   if (ret == DEVICE_OK)
+   {
+      stats_.RecordLatency(GrblCommandRealtime, (GetCurrentMMTime() - start).getMsec());
+      stats_.AddBytesSent(1);
+   }
+   return ret;
+}
+
+int ShapeokoGrblHub::JogCancel()
+{
+   if (!IsGrbl11OrLater())
+      return ERR_NOT_SUPPORTED_BY_FIRMWARE;
+   return SendRealtime(GRBL_RT_JOG_CANCEL);
+}
+
+// Resets the controller, which empties its RX buffer and planner.  Lines
+// that were queued or in flight are dropped; the controller is then brought
+// back to a usable state without going through Initialize().
+int ShapeokoGrblHub::SoftReset()
+{
+   long banners;
+   {
+      MMThreadGuard guard(streamLock_);
+      banners = bannerCount_;
+   }
+   // the reset clears the G92 offset the stages' positions are based on
+   double wcoMm[3];
+   {
+      MMThreadGuard guard(statusLock_);
+      for (int i = 0; i < 3; i++)
+         wcoMm[i] = status_.WCO[i];
+   }
+   int ret = SendRealtime(GRBL_RT_SOFT_RESET);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   AbortStream("error: reset");
+   ret = WaitForBanner(banners, 2000);
+   if (ret != DEVICE_OK)
+      return ret;
+   return Resync(wcoMm);
+}
+
+// Brings motion to a stop as quickly as the controller allows.  A jog is
+// cancelled directly, and its velocity zeroed; anything else is
+// decelerated with a feed hold and then flushed with a soft reset
+// (resetting during the hold keeps the position, resetting during motion
+// would raise an alarm).
+int ShapeokoGrblHub::StopMotion()
+{
+   {
+      // otherwise the poller's ServiceJog() starts the jog again
+      MMThreadGuard guard(jogLock_);
+      jogVelocity_[0] = jogVelocity_[1] = 0.0;
+      jogging_ = false;
+   }
+   CancelQueuedCommands(0);
+   // the poller does not ask while a move is predicted to run or its sync
+   // dwell is unanswered, so the cached state may be from before it started
+   GetStatus();
+   MachineStatus status;
+   GetMachineStatus(status);
+   if (status.state == "Jog" && IsGrbl11OrLater())
+   {
+      WaitForStream(1000);
+      return JogCancel();
+   }
+   if (status.state == "Idle" && IsStreamIdle())
+      return DEVICE_OK;
+
+   int ret = FeedHold();
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // wait for the deceleration to finish; 1.1 reports Hold:0, 0.9 only
+   // "Hold", so there we wait for the position to stop changing
+   double last[3] = { status.MPos[0], status.MPos[1], status.MPos[2] };
+   MM::MMTime deadline = GetCurrentMMTime() + MM::MMTime(5000.0 * 1000.0);
+   while (GetCurrentMMTime() < deadline)
+   {
+      if (GetStatus() != DEVICE_OK)
+      {
+         CDeviceUtils::SleepMs(10);
+         continue;
+      }
+      GetMachineStatus(status);
+      if (status.state == "Idle")
+         break;
+      if (status.state == "Hold")
+      {
+         if (status.report.subState == 0)
+            break;
+         if (status.report.subState < 0 && status.MPos[0] == last[0]
+               && status.MPos[1] == last[1] && status.MPos[2] == last[2])
+            break;
+      }
+      for (int i = 0; i < 3; i++)
+         last[i] = status.MPos[i];
+      CDeviceUtils::SleepMs(10);
+   }
+   return SoftReset();
+}
+
+int ShapeokoGrblHub::SetJogVelocity(double vxUmPerSec, double vyUmPerSec)
+{
+   if (!IsGrbl11OrLater())
+      return ERR_NOT_SUPPORTED_BY_FIRMWARE;
+
+   bool stop = (vxUmPerSec == 0.0 && vyUmPerSec == 0.0);
+   bool cancel;
+   {
+      MMThreadGuard guard(jogLock_);
+      // segments already queued run at the old velocity; on a stop or a
+      // reversal they have to go at once
+      cancel = jogging_ && (stop || vxUmPerSec * jogVelocity_[0] < 0 || vyUmPerSec * jogVelocity_[1] < 0);
+      if (cancel)
+      {
+         CancelQueuedCommands(jogFirstTicket_);
+         jogging_ = false;
+         jogResyncPending_ = true;
+      }
+      jogVelocity_[0] = vxUmPerSec;
+      jogVelocity_[1] = vyUmPerSec;
+   }
+   if (cancel)
+   {
+      // jog cancel only flushes the planner; segments still sitting in the
+      // controller's RX buffer would start a new jog once it is done
+      WaitForStream(1000);
+      int ret = JogCancel();
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+   ServiceJog();
+   return DEVICE_OK;
+}
+
+// Tops up the jog queue.  Called for every velocity change and regularly
+// from the status poller.
+void ShapeokoGrblHub::ServiceJog()
+{
+   if (QueueJogSegments())
+      PumpStream(0);
+}
+
+// Queues jog segments up to the lookahead horizon.  Returns true if
+// anything was queued.
+bool ShapeokoGrblHub::QueueJogSegments()
+{
+   MMThreadGuard guard(jogLock_);
+   double vx = jogVelocity_[0];
+   double vy = jogVelocity_[1];
+   if (vx == 0.0 && vy == 0.0)
+   {
+      if (jogResyncPending_ && GetState() == "Idle")
+      {
+         // jog distance is not known in advance; take it from the machine
+         MMThreadGuard statusGuard(statusLock_);
+         commandedUm_[0] = status_.WPos[0] * 1000.0;
+         commandedUm_[1] = status_.WPos[1] * 1000.0;
+         jogResyncPending_ = false;
+      }
+      return false;
+   }
+
+   MM::MMTime now = GetCurrentMMTime();
+   if (!jogging_ || jogQueuedUntil_ < now)
+      jogQueuedUntil_ = now;
+   MM::MMTime horizon = now + MM::MMTime(g_jogLookahead * jogIntervalMs_ * 1000.0);
+   bool queued = false;
+   while (jogQueuedUntil_ < horizon)
+   {
+      double dt = jogIntervalMs_ / 1000.0;
+      // um/s -> mm per segment and mm/min
+      double dx = vx * dt / 1000.0;
+      double dy = vy * dt / 1000.0;
+      double feed = sqrt(vx * vx + vy * vy) * 60.0 / 1000.0;
+      char buff[100];
+      snprintf(buff, sizeof(buff), "$J=G91 X%.4f Y%.4f F%.1f", dx, dy, feed);
+      long ticket = QueueCommand(buff, true, false);
+      if (!jogging_)
+      {
+         jogFirstTicket_ = ticket;
+         jogging_ = true;
+      }
+      jogResyncPending_ = true;
+      jogQueuedUntil_ = jogQueuedUntil_ + MM::MMTime(jogIntervalMs_ * 1000.0);
+      queued = true;
+   }
+   return queued;
+}
+
+// Drops everything queued or in flight.  Waiters get the given reply.
+void ShapeokoGrblHub::AbortStream(const char* reason)
+{
+   {
+      MMThreadGuard guard(streamLock_);
+      DrainSubmissions();
+      for (std::deque<StreamedLine>::iterator it = inFlight_.begin(); it != inFlight_.end(); ++it)
+      {
+         if (it->keepReply)
+            replies_[it->ticket] = reason;
+         MarkTicketDone(it->ticket);
+      }
+      for (std::deque<StreamedLine>::iterator it = pendingLines_.begin(); it != pendingLines_.end(); ++it)
+      {
+         if (it->keepReply)
+            replies_[it->ticket] = reason;
+         MarkTicketDone(it->ticket);
+      }
+      inFlight_.clear();
+      pendingLines_.clear();
+      inFlightBytes_ = 0;
+   }
+   moveEncoderStale_ = true;
+   // waiters find their reply
+   SignalIoEvent();
+}
+
+// Waits until the controller has printed its start-up banner more often
+// than previousBannerCount, reading the port itself while the I/O thread
+// does not run.
+int ShapeokoGrblHub::WaitForBanner(long previousBannerCount, float timeout)
+{
+   MM::MMTime deadline = GetCurrentMMTime() + MM::MMTime(timeout * 1000.0);
+   for (;;)
+   {
+      unsigned long seen = GetIoEventCount();
+      {
+         MMThreadGuard guard(streamLock_);
+         if (bannerCount_ > previousBannerCount)
+            return DEVICE_OK;
+      }
+      MM::MMTime now = GetCurrentMMTime();
+      if (now > deadline)
+      {
+         LogMessage("No banner from the controller");
+         return ERR_COMMUNICATION;
+      }
+      double remaining = std::min(100.0, (deadline - now).getMsec());
+      if (IsIoThreadRunning())
+      {
+         WaitForIoEvent(seen, remaining);
+         continue;
+      }
+      MMThreadGuard portGuard(executeLock_);
+      std::string line;
+      if (ReceiveResponse(line, (float) remaining) == DEVICE_OK)
+         DispatchLine(line);
+   }
+}
+
+// Re-establishes a known state after a reset: unlocks the controller if it
+// came up in alarm, puts the work frame back to the offset it had before
+// the reset (wcoMm, which the reset cleared), and takes the commanded
+// position from where the machine actually is.
+int ShapeokoGrblHub::Resync(const double wcoMm[3])
+{
+   int ret = GetStatus();
+   if (ret != DEVICE_OK)
+      return ret;
+   if (GetState() == "Alarm")
+   {
+      LogMessage("Unlock device after reset.");
+      std::string answer;
+      ret = ExecuteCommand("$X", answer, 1000);
+      if (ret != DEVICE_OK)
+         return ret;
+      ret = GetStatus();
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+
+   // the machine position survives the reset; make its work position what
+   // it was before
+   double mposMm[3];
+   {
+      MMThreadGuard guard(statusLock_);
+      for (int i = 0; i < 3; i++)
+         mposMm[i] = status_.MPos[i];
+   }
+   char cmd[100];
+   snprintf(cmd, sizeof(cmd), "G92 X%.3f Y%.3f Z%.3f", mposMm[0] - wcoMm[0],
+         mposMm[1] - wcoMm[1], mposMm[2] - wcoMm[2]);
+   std::string answer;
+   ret = ExecuteCommand(cmd, answer, 1000);
+   if (ret != DEVICE_OK)
+      return ret;
+   if (IsErrorAnswer(answer))
+   {
+      LogMessage("G92 rejected: " + answer);
+      return ERR_COMMAND_REJECTED;
+   }
+   {
+      // 1.1 reports WCO only now and then; until it does, WPos is derived
+      // from the offset just restored rather than the one the reset left
+      MMThreadGuard guard(statusLock_);
+      for (int i = 0; i < 3; i++)
+         status_.WCO[i] = wcoMm[i];
+   }
+   ret = GetStatus();
+   if (ret != DEVICE_OK)
+      return ret;
+   MMThreadGuard guard(statusLock_);
+   for (int i = 0; i < 3; i++)
+      commandedUm_[i] = status_.WPos[i] * 1000.0;
+   return DEVICE_OK;
+}
+
+// Routes a line received from the controller.  Status reports, the
+// start-up banner, alarms and the unlock request arrive unsolicited and go
+// to their handlers.  'ok' and 'error:' complete the oldest line in flight
+// and anything else is attached to the reply of that line.
+void ShapeokoGrblHub::DispatchLine(const std::string& line)
+{
+   if (line.empty())
+      return;
+   if (line[0] == '<')
+   {
+      ParseStatusLine(line, GetCurrentMMTime());
+      return;
+   }
+   if (line.compare(0, 5, "Grbl ") == 0)
+   {
+      HandleBanner(line);
+      return;
+   }
+   if (line.compare(0, 5, "ALARM") == 0)
+      HandleAlarm(line);
+   else if (line[0] == '[' && HandleMessage(line))
+      return;
+
+   bool isOk = line.compare(0, 2, "ok") == 0;
+   bool isError = line.compare(0, 5, "error") == 0;
+   MMThreadGuard guard(streamLock_);
+   if (inFlight_.empty())
+   {
+      LogMessage("Unsolicited line: " + line, true);
+      return;
+   }
+   StreamedLine& front = inFlight_.front();
+   if (!isOk && !isError)
+   {
+      if (front.keepReply)
+         front.reply += line + "\n";
+      return;
+   }
+
+   stats_.RecordLatency(ClassifyGrblCommand(front.line, front.isMotion),
+         (GetCurrentMMTime() - front.sentAt).getMsec());
+   if (isError)
+   {
+      lastStreamError_ = front.line + ": " + line;
+      LogMessage("Command failed: " + lastStreamError_);
+      stats_.CountError();
+      if (front.isMotion)
+      {
+         moveEncoderStale_ = true;
+         if (!front.keepReply)
+         {
+            // nobody waits for this reply, and commandedUm_ already
+            // holds the target
+            moveError_ = lastStreamError_;
+            moveErrorPending_ = true;
+            MMThreadGuard statusGuard(statusLock_);
+            moveResyncPending_ = true;
+            lastMoveTime_ = GetCurrentMMTime();
+            positionReportPending_ = true;
+         }
+      }
+   }
+   if (front.keepReply)
+      replies_[front.ticket] = front.reply + line;
+   if (front.isMotion && syncState_ != SyncNone)
+   {
+      // done only if nothing moved after the dwell was queued
+      if (front.ticket == syncTicket_)
+      {
+         syncState_ = isOk ? SyncDone : SyncNone;
+         if (!isOk)
+            LogMessage("Sync dwell failed, polling for completion");
+      }
+      else if (front.ticket > syncTicket_)
+         syncState_ = SyncNone;
+   }
+   if (front.isMotion && isOk)
+   {
+      MMThreadGuard statusGuard(statusLock_);
+      lastMoveTime_ = GetCurrentMMTime();
+      positionReportPending_ = true;
+   }
+   inFlightBytes_ -= (long) front.line.size() + 1;
+   MarkTicketDone(front.ticket);
+   inFlight_.pop_front();
+}
+
+// Start-up banner: the controller has reset.  It carries the version.
+void ShapeokoGrblHub::HandleBanner(const std::string& line)
+{
+   LogMessage("Controller reset: " + line);
+   moveEncoderStale_ = true;
+   MMThreadGuard guard(streamLock_);
+   version_ = line.substr(0, line.find(" ["));
+   if (sscanf(version_.c_str(), "Grbl %d.%d", &versionMajor_, &versionMinor_) != 2)
+      versionMajor_ = versionMinor_ = 0;
+   bannerCount_++;
+}
+
+void ShapeokoGrblHub::HandleAlarm(const std::string& line)
+{
+   LogMessage("Controller alarm: " + line);
+   moveEncoderStale_ = true;
+   stats_.CountAlarm();
+}
+
+// Feedback messages in brackets.  Only the request to unlock, which follows
+// the banner when the controller comes up in alarm, is taken here; the
+// others (e.g. the answer to $G) belong to the reply of the line in flight.
+bool ShapeokoGrblHub::HandleMessage(const std::string& line)
+{
+   if (line.find("'$X' to unlock") == std::string::npos)
+      return false;
+   LogMessage("Controller locked: " + line);
+   MMThreadGuard guard(streamLock_);
+   unlockRequested_ = true;
+   return true;
+}
+
+MM::DeviceDetectionStatus ShapeokoGrblHub::DetectDevice(void)
+{
+  LogMessage("DetectDevice");
+  if (initialized_)
+      return MM::CanCommunicate;
+   MM::MMTime detectStart = GetCurrentMMTime();
+
+   // all conditions must be satisfied...
+   MM::DeviceDetectionStatus result = MM::Misconfigured;
+   char answerTO[MM::MaxStrLength];
+
+   try
+   {
+      std::string portLowerCase = port_;
+      for( std::string::iterator its = portLowerCase.begin(); its != portLowerCase.end(); ++its)
+      {
+         *its = (char)tolower(*its);
+      }
+      if( 0< portLowerCase.length() &&  0 != portLowerCase.compare("undefined")  && 0 != portLowerCase.compare("unknown") )
+      {
+         result = MM::CanNotCommunicate;
+         // record the default answer time out
+         GetCoreCallback()->GetDeviceProperty(port_.c_str(), "AnswerTimeout", answerTO);
+
+         // device specific default communication parameters
+         // for Arduino Duemilanova
+         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_Handshaking, "Off");
+         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_StopBits, "1");
+         // Arduino timed out in GetControllerVersion even if AnswerTimeout  = 300 ms
+         GetCoreCallback()->SetDeviceProperty(port_.c_str(), "AnswerTimeout", "500.0");
+         GetCoreCallback()->SetDeviceProperty(port_.c_str(), "DelayBetweenCharsMs", "0");
+         char previousRate[MM::MaxStrLength];
+         GetCoreCallback()->GetDeviceProperty(port_.c_str(), MM::g_Keyword_BaudRate, previousRate);
+         MM::Device* pS = GetCoreCallback()->GetDevice(this, port_.c_str());
+
+         // The baud rate is compiled into the firmware (115200 since Grbl
+         // 0.9, 9600 before), so the first rate that gets a banner and a
+         // status report is the one to keep.  At the wrong rate the port
+         // only delivers garbage and the handshake times out.
+         std::vector<std::string> rates;
+         CDeviceUtils::Tokenize(baudRates_, rates, ", ");
+         for (size_t i = 0; i < rates.size() && result != MM::CanCommunicate; i++)
+         {
+            GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_BaudRate, rates[i].c_str());
+            pS->Initialize();
+            int ret;
+            {
+               // Opening the port resets the Arduino; rather than sleeping
+               // through the bootloader, wait for the banner (or provoke one)
+               MMThreadGuard myLock(executeLock_);
+               ret = GetControllerVersion(version_);
+               if (ret == DEVICE_OK)
+                  ret = GetStatus();
+            }
+            pS->Shutdown();
+            if (ret == DEVICE_OK)
+            {
+               LogMessage("Controller answers at " + rates[i] + " baud");
+               baudRate_ = rates[i];
+               result = MM::CanCommunicate;
+            }
+            else
+            {
+               LogMessage("No answer at " + rates[i] + " baud");
+               LogMessageCode(ret, true);
+            }
+         }
+         if (result != MM::CanCommunicate)
+            GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_BaudRate, previousRate);
+         // always restore the AnswerTimeout to the default
+         GetCoreCallback()->SetDeviceProperty(port_.c_str(), "AnswerTimeout", answerTO);
+
+      }
+   }
+   catch(...)
+   {
+      LogMessage("Exception in DetectDevice!",false);
+   }
+
+   detectDeviceMs_ = (GetCurrentMMTime() - detectStart).getMsec();
+   return result;
+}
+
+int ShapeokoGrblHub::SetAnswerTimeoutMs(double timeout)
+{
+      if(!portAvailable_)
+	   return ERR_NO_PORT_SET;
+   // the property is only pushed to the port when it changes
+   if (timeout == answerTimeoutMs_)
+      return DEVICE_OK;
+   answerTimeoutMs_ = timeout;
+     GetCoreCallback()->SetDeviceProperty(port_.c_str(), "AnswerTimeout",  CDeviceUtils::ConvertToString(timeout));
+   return DEVICE_OK;
+}
+
+std::vector<std::string> &split(const std::string &s, char delim, std::vector<std::string> &elems) {
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, delim)) {
+        elems.push_back(item);
+    }
+    return elems;
+}
+
+
+std::vector<std::string> split(const std::string &s, char delim) {
+    std::vector<std::string> elems;
+    split(s, delim, elems);
+    return elems;
+}
+
+std::string ShapeokoGrblHub::GetState() {
+  MMThreadGuard guard(statusLock_);
+  return status_.state;
+}
+
+void ShapeokoGrblHub::GetPos(float &x, float &y) {
+  MMThreadGuard guard(statusLock_);
+  x = status_.WPos[0];
+  y = status_.WPos[1];
+}
+
+void ShapeokoGrblHub::GetMachineStatus(MachineStatus& status) {
+  MMThreadGuard guard(statusLock_);
+  status = status_;
+}
+
+// True while the last commanded move has not been confirmed finished, i.e.
+// until a report received after the move was sent says "Idle".
+bool ShapeokoGrblHub::IsMotionActive()
+{
+  if (!IsStreamIdle())
+    return true;
+  // the sync dwell was answered: the move is done; one report publishes
+  // the final position
+  if (IsSyncDwellDone())
+  {
+    bool stale;
+    {
+      MMThreadGuard guard(statusLock_);
+      stale = status_.timestamp < lastMoveTime_;
+    }
+    if (stale)
+      GetStatus();
+    return false;
+  }
+  // the model says the move is still running: no need to ask
+  MM::MMTime confirmAt = GetPredictedCompletion();
+  if (GetCurrentMMTime() < confirmAt)
+    return true;
+  bool query = poller_ == 0 || !poller_->IsRunning();
+  if (!query)
+  {
+    // the poller may not get to it for a while; confirm the predicted
+    // end of a move right away, and if that still caught it running,
+    // once more as far past the predicted end as the first was before it
+    MM::MMTime recheckAt = confirmAt + MM::MMTime(2.0 * completionGuardMs_ * 1000.0);
+    MMThreadGuard guard(statusLock_);
+    query = status_.timestamp < confirmAt
+          || (status_.timestamp < recheckAt && !(GetCurrentMMTime() < recheckAt));
+  }
+  if (query)
+  {
+    if (GetStatus() != DEVICE_OK)
+      return true;
+  }
+  MMThreadGuard guard(statusLock_);
+  if (status_.timestamp < lastMoveTime_)
+    return true;
+  return status_.state.compare(0, 4, "Idle") != 0;
+}
+
+// Queries the controller with '?' and publishes the answer in the cached
+// status.  Once the I/O thread runs, it parses the report and this waits
+// for the next one to arrive.  Before that, holds the port for the whole
+// round trip; replies to streamed lines that arrive before the report are
+// dispatched on the way.
+int ShapeokoGrblHub::GetStatus()
+{
+  LogMessage("GetStatus", true);
+  if (IsIoThreadRunning())
+  {
+    long sequence;
+    MM::MMTime start = GetCurrentMMTime();
+    MM::MMTime deadline = start + MM::MMTime(300.0 * 1000.0);
+    {
+      MMThreadGuard guard(statusLock_);
+      sequence = status_.sequence;
+      statusQueries_.push_back(start);
+    }
+    // '?' is a real-time command, so it does not wait behind queued lines
+    unsigned char query = GRBL_RT_STATUS;
+    if (WriteToComPortH(&query, 1) != DEVICE_OK)
+      return DEVICE_ERR;
+    stats_.AddBytesSent(1);
+    WakeIoThread();
+    for (;;)
+    {
+      unsigned long seen = GetIoEventCount();
+      {
+        MMThreadGuard guard(statusLock_);
+        if (status_.sequence != sequence)
+        {
+          stats_.RecordLatency(GrblCommandStatus, (status_.timestamp - start).getMsec());
+          return DEVICE_OK;
+        }
+      }
+      MM::MMTime now = GetCurrentMMTime();
+      if (now > deadline)
+      {
+        stats_.CountTimeout();
+        return DEVICE_ERR;
+      }
+      WaitForIoEvent(seen, (deadline - now).getMsec());
+    }
+  }
+
+  MMThreadGuard portGuard(executeLock_);
+  MM::MMTime start = GetCurrentMMTime();
+  {
+    MMThreadGuard guard(statusLock_);
+    statusQueries_.push_back(start);
   }
-  std::string returnString;
-  ret = ReceiveResponse(returnString);
+  int ret = SendCommand("?", "");
   if(DEVICE_OK != ret){
     return DEVICE_ERR;
   }
-  
-  LogMessage("returnString=" + returnString);
-  std::vector<std::string> tokenInput;
-  char* pEnd;
-  CDeviceUtils::Tokenize(returnString, tokenInput, "<>,:\r\n");
-  //sample: <Idle,MPos:0.000,0.000,0.000,WPos:0.000,0.000,0.000>
-  if(tokenInput.size() != 9)
+  for (int i = 0; i < 32; i++)
+  {
+    std::string returnString;
+    ret = ReceiveResponse(returnString);
+    if(DEVICE_OK != ret){
+      stats_.CountTimeout();
+      return DEVICE_ERR;
+    }
+    if (returnString.empty() || returnString[0] != '<')
+    {
+      DispatchLine(returnString);
+      continue;
+    }
+    LogMessage("returnString=" + returnString, true);
+    MM::MMTime now = GetCurrentMMTime();
+    stats_.RecordLatency(GrblCommandStatus, (now - start).getMsec());
+    return ParseStatusLine(returnString, now);
+  }
+  return DEVICE_ERR;
+}
+
+int ShapeokoGrblHub::ParseStatusLine(const std::string& returnString, const MM::MMTime& when)
+{
+  GrblStatusReport report;
+  if (!ParseGrblStatusReport(returnString.c_str(), returnString.size(), report)
+        || !(report.hasMPos || report.hasWPos))
     {
-      LogMessage(returnString.c_str());
-      LogMessage("echo error!");
+      LogMessage("Malformed status report: " + returnString);
       return DEVICE_ERR;
     }
-  state_.assign(tokenInput[0].c_str());
-  MPos[0] = stringToNum<double>(tokenInput[2]);
-  MPos[1] = stringToNum<double>(tokenInput[3]);
-  MPos[2] = stringToNum<double>(tokenInput[4]);
-  WPos[0] = stringToNum<double>(tokenInput[6]);
-  WPos[1] = stringToNum<double>(tokenInput[7]);
-  WPos[2] = stringToNum<double>(tokenInput[8]);
-   
+  MMThreadGuard guard(statusLock_);
+  if (report.hasWCO)
+    for (int i = 0; i < 3; i++)
+      status_.WCO[i] = report.WCO[i];
+  else if (report.hasMPos && report.hasWPos)
+    for (int i = 0; i < 3; i++)
+      status_.WCO[i] = report.MPos[i] - report.WPos[i];
+  for (int i = 0; i < 3; i++)
+  {
+    status_.MPos[i] = report.hasMPos ? report.MPos[i] : report.WPos[i] + status_.WCO[i];
+    status_.WPos[i] = report.hasWPos ? report.WPos[i] : report.MPos[i] - status_.WCO[i];
+  }
+  status_.state.assign(report.state);
+  status_.report = report;
+  status_.timestamp = when;
+  status_.sequence++;
+
+  // Grbl takes the sample as soon as the '?' arrives, so the report is
+  // stamped with the time the query was sent rather than when the report
+  // came back.  Queries older than GetStatus' timeout were never answered.
+  status_.sampledAt = when;
+  while (!statusQueries_.empty())
+  {
+    MM::MMTime sent = statusQueries_.front();
+    statusQueries_.pop_front();
+    if ((when - sent).getMsec() <= 300.0)
+    {
+      status_.sampledAt = sent;
+      break;
+    }
+  }
+  history_.Add(status_.sampledAt.getUsec(), status_.MPos, report.state);
+
   return DEVICE_OK;
 }
+
+bool ShapeokoGrblHub::GetPositionAt(const MM::MMTime& when, double positionUm[3])
+{
+  double mm[3];
+  GrblStateCode state;
+  double gapMs;
+  if (!history_.GetPositionAt(when.getUsec(), mm, state, gapMs))
+    return false;
+  double wcoMm[3];
+  {
+    MMThreadGuard guard(statusLock_);
+    for (int i = 0; i < 3; i++)
+      wcoMm[i] = status_.WCO[i];
+  }
+  for (int i = 0; i < 3; i++)
+    positionUm[i] = (mm[i] - wcoMm[i]) * 1000.;
+  return true;
+}
+
+void ShapeokoGrblHub::AttachXYStage(CShapeokoGrblXYStage* stage)
+{
+  MMThreadGuard guard(stageLock_);
+  xyStage_ = stage;
+}
+
+void ShapeokoGrblHub::AttachZStage(ZStage* stage)
+{
+  MMThreadGuard guard(stageLock_);
+  zStage_ = stage;
+}
+
+// Tells the attached stages where the last move ended, once a report
+// received after it says Idle, with the same test as IsMotionActive().
+// After a rejected move the commanded position is taken from there too.
+// Called by the status poller, so the core is never called back from the
+// I/O thread.
+void ShapeokoGrblHub::ReportCompletedMove()
+{
+  if (!IsStreamIdle())
+    return;
+  double wpos[3];
+  {
+    MMThreadGuard guard(statusLock_);
+    if (!positionReportPending_ || status_.timestamp < lastMoveTime_
+          || status_.state.compare(0, 4, "Idle") != 0)
+      return;
+    positionReportPending_ = false;
+    for (int i = 0; i < 3; i++)
+      wpos[i] = status_.WPos[i];
+    if (moveResyncPending_)
+    {
+      for (int i = 0; i < 3; i++)
+        commandedUm_[i] = wpos[i] * 1000.;
+      moveResyncPending_ = false;
+    }
+  }
+  MMThreadGuard guard(stageLock_);
+  if (xyStage_ != 0)
+    xyStage_->OnMoveCompleted(wpos[0] * 1000., wpos[1] * 1000.);
+  if (zStage_ != 0)
+    zStage_->OnMoveCompleted(wpos[2] * 1000.);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SerialIoThread
+///////////////////////////////////////////////////////////////////////////////
+
+SerialIoThread::SerialIoThread(ShapeokoGrblHub* hub) :
+   hub_(hub),
+   stop_(true),
+   running_(false)
+{
+}
+
+SerialIoThread::~SerialIoThread()
+{
+   Stop();
+}
+
+void SerialIoThread::Start()
+{
+   MMThreadGuard guard(lock_);
+   if (running_)
+      return;
+   stop_ = false;
+   running_ = true;
+   activate();
+}
+
+void SerialIoThread::Stop()
+{
+   {
+      MMThreadGuard guard(lock_);
+      if (!running_)
+         return;
+      stop_ = true;
+   }
+   wait();
+   MMThreadGuard guard(lock_);
+   running_ = false;
+}
+
+bool SerialIoThread::IsRunning()
+{
+   MMThreadGuard guard(lock_);
+   return running_;
+}
+
+int SerialIoThread::svc()
+{
+   for (;;)
+   {
+      {
+         MMThreadGuard guard(lock_);
+         if (stop_)
+            break;
+      }
+      hub_->ServiceIo();
+   }
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StatusPoller
+///////////////////////////////////////////////////////////////////////////////
+
+StatusPoller::StatusPoller(ShapeokoGrblHub* hub) :
+   hub_(hub),
+   stop_(true),
+   running_(false),
+   intervalMs_(100)
+{
+}
+
+StatusPoller::~StatusPoller()
+{
+   Stop();
+}
+
+void StatusPoller::Start()
+{
+   MMThreadGuard guard(lock_);
+   if (running_)
+      return;
+   stop_ = false;
+   running_ = true;
+   activate();
+}
+
+void StatusPoller::Stop()
+{
+   {
+      MMThreadGuard guard(lock_);
+      if (!running_)
+         return;
+      stop_ = true;
+   }
+   wait();
+   MMThreadGuard guard(lock_);
+   running_ = false;
+}
+
+bool StatusPoller::IsRunning()
+{
+   MMThreadGuard guard(lock_);
+   return running_;
+}
+
+void StatusPoller::SetIntervalMs(long intervalMs)
+{
+   MMThreadGuard guard(lock_);
+   intervalMs_ = intervalMs;
+}
+
+long StatusPoller::GetIntervalMs()
+{
+   MMThreadGuard guard(lock_);
+   return intervalMs_;
+}
+
+// Between two status queries the poller keeps the hub's command stream
+// moving, so queued lines are sent as soon as the controller has room.
+int StatusPoller::svc()
+{
+   for (;;)
+   {
+      long interval;
+      {
+         MMThreadGuard guard(lock_);
+         if (stop_)
+            break;
+         interval = intervalMs_;
+      }
+      // no polling while the motion model says a move is running;
+      // failures are logged by GetStatus; keep polling
+      MM::MMTime now = hub_->GetCurrentMMTime();
+      MM::MMTime confirmAt = hub_->GetPredictedCompletion();
+      bool predicted = now < confirmAt;
+      // nor while the sync dwell after a move is unanswered
+      if (!predicted && !hub_->IsSyncDwellPending())
+      {
+         hub_->GetStatus();
+         hub_->ReportCompletedMove();
+      }
+      hub_->ServiceJog();
+      MM::MMTime next = now + MM::MMTime(interval * 1000.0);
+      if (predicted && confirmAt < next)
+         next = confirmAt;
+      for (;;)
+      {
+         double remaining = (next - hub_->GetCurrentMMTime()).getMsec();
+         if (remaining <= 0)
+            break;
+         if (!hub_->PumpStream((float) std::min(remaining, 20.0)))
+            CDeviceUtils::SleepMs((long) std::min(remaining, 5.0));
+         hub_->ServiceJog();
+      }
+   }
+   return 0;
+}
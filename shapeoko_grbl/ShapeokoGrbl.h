@@ -32,9 +32,25 @@
 
 #include "DeviceBase.h"
 #include "DeviceThreads.h"
+#include "GrblStatusReport.h"
+#include "TileScan.h"
+#include "GrblStats.h"
+#include "MotionModel.h"
+#include "GrblSettings.h"
+#include "GrblCommandQueue.h"
+#include "GrblPositionHistory.h"
+#include "GrblMoveEncoder.h"
+#include "GrblJobFile.h"
+#include "FocusMap.h"
+#include "VisitOrder.h"
 #include <string>
 #include <map>
+#include <set>
+#include <deque>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 //////////////////////////////////////////////////////////////////////////////
 // Error codes
@@ -54,6 +70,123 @@
 #define ERR_COMMUNICATION 107
 #define ERR_NO_PORT_SET 108
 #define ERR_VERSION_MISMATCH 109
+#define ERR_COMMAND_REJECTED 111
+#define ERR_NOT_SUPPORTED_BY_FIRMWARE 112
+#define ERR_MOVE_OUT_OF_RANGE 113
+#define ERR_JOB_FILE 114
+#define ERR_JOB_ACTIVE 115
+#define ERR_NO_MOTION_MODEL 116
+#define ERR_POSITION_FILE 117
+#define ERR_TILE_SCAN_ACTIVE 118
+
+// Grbl real-time commands
+#define GRBL_RT_STATUS     '?'
+#define GRBL_RT_FEED_HOLD  '!'
+#define GRBL_RT_CYCLE_START '~'
+#define GRBL_RT_SOFT_RESET 0x18
+#define GRBL_RT_JOG_CANCEL 0x85
+
+// G-code job runner
+enum JobState
+{
+   JobIdle,
+   JobRunning,
+   JobPaused,
+   JobDone,
+   JobFailed,            // the controller rejected a line
+   JobAborted
+};
+
+// Controller output pulsed after each point of a sequence or tile scan
+enum TriggerOutput
+{
+   TriggerNone,
+   TriggerCoolant,       // M8 / M9
+   TriggerSpindle        // M3 S<speed> / M5
+};
+
+class ShapeokoGrblHub;
+class CShapeokoGrblXYStage;
+class ZStage;
+
+////////////////////////
+// MachineStatus
+// Last status report ('?') parsed from the controller.  MPos and WPos are
+// both filled in; Grbl 1.1 only reports one of them, the other one is
+// derived from the last work coordinate offset (WCO) seen.
+//////////////////////
+
+struct MachineStatus
+{
+   MachineStatus() : sequence(0)
+   {
+      MPos[0] = MPos[1] = MPos[2] = 0.0;
+      WPos[0] = WPos[1] = WPos[2] = 0.0;
+      WCO[0] = WCO[1] = WCO[2] = 0.0;
+      report.Clear();
+   }
+
+   std::string state;
+   double MPos[3];
+   double WPos[3];
+   double WCO[3];
+   GrblStatusReport report; // optional fields of the last report
+   MM::MMTime timestamp; // time the report was received
+   MM::MMTime sampledAt; // time the '?' it answers was sent
+   long sequence;        // incremented for every report received
+};
+
+////////////////////////
+// StatusPoller
+// Sends '?' to the controller at a fixed rate so that the stages can
+// answer Busy() and position queries from the hub's cached status.
+//////////////////////
+
+class StatusPoller : public MMDeviceThreadBase
+{
+public:
+   StatusPoller(ShapeokoGrblHub* hub);
+   ~StatusPoller();
+
+   int svc();
+   void Start();
+   void Stop();
+   bool IsRunning();
+   void SetIntervalMs(long intervalMs);
+   long GetIntervalMs();
+
+private:
+   ShapeokoGrblHub* hub_;
+   bool stop_;
+   bool running_;
+   long intervalMs_;
+   MMThreadLock lock_;
+};
+
+////////////////////////
+// SerialIoThread
+// Owns the port once the hub is initialized: sends queued lines as the
+// controller has room for them, reads everything the controller sends and
+// hands complete lines to the hub's dispatcher.
+//////////////////////
+
+class SerialIoThread : public MMDeviceThreadBase
+{
+public:
+   SerialIoThread(ShapeokoGrblHub* hub);
+   ~SerialIoThread();
+
+   int svc();
+   void Start();
+   void Stop();
+   bool IsRunning();
+
+private:
+   ShapeokoGrblHub* hub_;
+   bool stop_;
+   bool running_;
+   MMThreadLock lock_;
+};
 
 
 ////////////////////////
@@ -62,6 +195,8 @@
 
 class ShapeokoGrblHub : public HubBase<ShapeokoGrblHub>
 {
+   friend class StatusPoller;
+   friend class SerialIoThread;
 public:
   ShapeokoGrblHub();
   ~ShapeokoGrblHub() { Shutdown();}
@@ -69,22 +204,174 @@ public:
    // Device API
    // ---------
    int Initialize();
-  int Shutdown() {initialized_ = false; return DEVICE_OK;};
+   int Shutdown();
    void GetName(char* pName) const; 
-   bool Busy() { return busy_;} ;
+   bool Busy() { return initialized_ && IsMotionActive(); }
 
    // property handlers
   int OnVersion(MM::PropertyBase* pProp, MM::ActionType pAct);
    int OnPort(MM::PropertyBase* pPropt, MM::ActionType eAct);
    int OnCommand(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnStatusPollInterval(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnStreamingMode(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnRxBufferSize(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnMoveError(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnSequenceAdvance(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnSequenceDwell(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnTriggerOutput(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnTriggerPulse(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnTriggerSpindleSpeed(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnStatsLatency(MM::PropertyBase* pProp, MM::ActionType pAct, long commandClass);
+   int OnStatsCounter(MM::PropertyBase* pProp, MM::ActionType pAct, long counter);
+   int OnStatsReset(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnCompletionGuard(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnCompletionMode(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnStartupBannerTimeout(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnStartupResetTimeout(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnBaudRates(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnStartupTime(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnSetting(MM::PropertyBase* pProp, MM::ActionType pAct, long number);
+   int OnMoveXYZ(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnRealtimeCommand(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnJogInterval(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnTileScanSetting(MM::PropertyBase* pProp, MM::ActionType pAct, long index);
+   int OnTileScanFocusPlane(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnTileScanControl(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnTileScanProgress(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnPositionHistorySize(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnPositionAt(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnPositionLogFile(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnFocusMapMode(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnFocusMapPoints(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnVisitOrderFile(MM::PropertyBase* pProp, MM::ActionType pAct, long output);
+   int OnVisitOrderStart(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnVisitOrderControl(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnVisitOrderResult(MM::PropertyBase* pProp, MM::ActionType pAct, long index);
+   int OnJobFile(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnJobControl(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnJobState(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnJobProgress(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnJobLine(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnJobError(MM::PropertyBase* pProp, MM::ActionType pAct);
 
    // HUB api
    int DetectInstalledDevices();
 
   int SendCommand(std::string command, std::string terminator="\r");
   int ReceiveResponse(std::string &returnString, float timeout = 300.0);
+   int ExecuteCommand(const std::string& command, std::string& answer, float timeout = 300.0);
+   // Finishes a line written by the hub's own move encoder, already queued
+   // with PushLine(); other moves go through QueueCommand() or
+   // ExecuteCommand()
+   int CompleteMoveCommand(long ticket, bool lockStep);
+   int TakeMoveError();
+
+   // Motion API, positions in um.  Axes whose flag is false are left out
+   // of the command.  All commanded axes move together in a single G0, so
+   // the hub (and its Busy()) tracks the move as one unit.  MoveTo()
+   // leaves out what the controller still has from the previous move, as
+   // long as that move has been acknowledged, and sends nothing for a move
+   // to where the stage already is.  Lines that are sent later, as a
+   // block, come from an encoder of their own and name every axis.
+   std::string FormatMove(bool moveX, double xUm, bool moveY, double yUm, bool moveZ, double zUm);
+   GrblMoveEncoder NewMoveEncoder();
+   void GetMoveEncoderStats(long& moves, long& bytes, long& legacyBytes);
+   int MoveTo(bool moveX, double xUm, bool moveY, double yUm, bool moveZ, double zUm);
+   int MoveXYZ(double xUm, double yUm, double zUm);
+   double GetCommandedPositionUm(int axis);
+   // From the cached $$ table: step size (1/steps per mm) and travel,
+   // which runs from the origin set at start-up to the axis' max travel.
+   // Targets outside the travel are rejected before anything is sent.
+   double GetStepSizeUm(int axis);
+   void GetTravelLimitsUm(int axis, double& lowerUm, double& upperUm);
+   int CheckTargetUm(bool moveX, double xUm, bool moveY, double yUm, bool moveZ, double zUm);
+   void SetCommandedPositionUm(int axis, double positionUm);
+   // Focus map: while it is on, a move in XY without a Z target of its own
+   // also moves Z by the change in the surface's height, so that Z keeps
+   // its offset from the surface.  fromUm is where the move starts.
+   // Returns true if it added Z to the move.  MoveTo() does this by itself.
+   bool FollowFocusMap(const double fromUm[3], bool moveX, double xUm, bool moveY, double yUm,
+         bool& moveZ, double& zUm);
+
+   // Real-time commands are single bytes that Grbl acts on as soon as they
+   // arrive, even with a full RX buffer, so they bypass the command stream.
+   int SendRealtime(unsigned char command);
+   int FeedHold() { return SendRealtime(GRBL_RT_FEED_HOLD); }
+   int CycleStart() { return SendRealtime(GRBL_RT_CYCLE_START); }
+   int JogCancel();
+   int SoftReset();
+   int StopMotion();
+
+   // Velocity mode (Grbl 1.1 $J= jogging), velocities in um/s.  Short jog
+   // segments are kept a few intervals ahead of the machine; a zero
+   // velocity cancels the jog.
+   int SetJogVelocity(double vxUmPerSec, double vyUmPerSec);
+   void ServiceJog();
+   bool IsGrbl11OrLater() const { return versionMajor_ > 1 || (versionMajor_ == 1 && versionMinor_ >= 1); }
+
+   // Streaming: lines are queued and sent as soon as they fit in the
+   // controller's serial RX buffer (character counting), or one at a time
+   // in lock-step mode.  Each line gets a ticket; 'ok'/'error:' replies are
+   // matched to tickets in the order the lines were sent.
+   long QueueCommand(const std::string& command, bool isMotion = false, bool keepReply = false);
+   int WaitForReply(long ticket, std::string& answer, float timeout = 300.0);
+   int WaitForStream(float timeout);
+   bool PumpStream(float timeout);
+   bool IsStreamIdle();
+   bool IsIoThreadRunning() { return ioThread_ != 0 && ioThread_->IsRunning(); }
+   bool IsCharacterCounting() { return characterCounting_; }
+   static bool IsErrorAnswer(const std::string& answer);
+   void CancelQueuedCommands(long fromTicket);
+
+   // Stage sequences: the lines that make the controller wait at each
+   // sequence point before moving on to the next one.
+   void GetSequenceWaitLines(std::vector<std::string>& lines);
+   // Trigger output: lines that pulse it once the moves before them are
+   // done, and "move, trigger, wait waitMs" as one block.  The ticket
+   // QueueTriggeredMove() returns is that of the final wait, which is
+   // answered only when all of it has happened.
+   void GetTriggerLines(std::vector<std::string>& lines);
+   void AppendTriggeredMove(GrblMoveEncoder& encoder, std::vector<std::string>& lines, bool moveX, double xUm,
+         bool moveY, double yUm, bool moveZ, double zUm, double waitMs);
+   int QueueTriggeredMove(bool moveX, double xUm, bool moveY, double yUm, bool moveZ, double zUm,
+         double waitMs, long& ticket);
+   long StreamLines(const std::vector<std::string>& lines, bool isMotion, std::vector<long>* tickets = 0);
+   bool IsTicketComplete(long ticket);
+
+   // Tile scan: the whole serpentine is streamed as one block of G-code,
+   // with a dwell after each tile whose reply marks the tile as done.
+   int StartTileScan();
+   int StopTileScan();
+   void GetTileScanProgress(long& done, long& total);
+
+   // Visit order: reorders positions (um) for the shortest travel time
+   // the motion model predicts from the $$ rates and accelerations.  The
+   // path starts at the commanded position or, with keepFirst, at the
+   // first position, which stays first.  Times are for the given order
+   // and for the optimized one.
+   int OptimizeVisitOrder(const std::vector<VisitPoint>& points, bool keepFirst,
+         std::vector<size_t>& order, double& secondsBefore, double& secondsAfter);
+   // Same for a position file, one "x,y" or "x,y,z" per line; the output
+   // file gets "index,x,y[,z]" lines in the new order
+   int OptimizeVisitOrderFile();
+
+   // G-code job: a program file streamed line by line behind the
+   // controller's answers, a few dozen lines ahead, by the I/O thread.
+   // Pausing stops the feed and holds the motion; aborting stops the
+   // machine.  The job is done once its last motion has finished.
+   int OpenJob(const std::string& path);
+   int StartJob();
+   int PauseJob();
+   int ResumeJob();
+   int AbortJob();
+   JobState GetJobState();
+   // percent of the file's bytes answered, last answered line, first error
+   void GetJobProgress(double& percent, long& lineNumber, std::string& error);
    int SetAnswerTimeoutMs(double timout);
    MM::DeviceDetectionStatus DetectDevice(void);
+   // wall time of the last successful Initialize() and of the last DetectDevice()
+   double GetInitializeMs() const { return initializeMs_; }
+   double GetDetectDeviceMs() const { return detectDeviceMs_; }
    int PurgeComPortH() {return PurgeComPort(port_.c_str());}
    int WriteToComPortH(const unsigned char* command, unsigned len) {return WriteToComPort(port_.c_str(), command, len);}
    int ReadFromComPortH(unsigned char* answer, unsigned maxLen, unsigned long& bytesRead)
@@ -102,23 +389,209 @@ public:
   int GetStatus(); 
   std::string GetState(); 
   void GetPos(float &x, float &y); 
+   void GetMachineStatus(MachineStatus& status);
+   bool IsMotionActive();
+   // Until this time the motion model says the last move is still
+   // running, so there is no point in asking the controller.  Zero when
+   // there is no prediction.
+   MM::MMTime GetPredictedCompletion();
+   // Completion by dwell: true while the G4 P0 that follows the last move
+   // or batch is still unanswered, so there is no point in polling.
+   bool IsSyncDwellPending();
+
+   // Position history: every status report, stamped with the time the
+   // controller took the sample.  Work position in um (the frame the
+   // stages report and move in) at any time within the history's window;
+   // false outside it.  The history keeps machine positions, so this
+   // applies the current work offset.
+   bool GetPositionAt(const MM::MMTime& when, double positionUm[3]);
+   // Attached stages are told the measured position once a move is done
+   void AttachXYStage(CShapeokoGrblXYStage* stage);
+   void AttachZStage(ZStage* stage);
+   void ReportCompletedMove();
   int ResetDevice();
   int GetControllerVersion(std::string& version);
 
 private:
+   // G4 P0 after the last move: pending until its 'ok', done if that came
+   // after all other motion lines.  Anything else leaves completion to
+   // status polling.
+   enum SyncState
+   {
+      SyncNone,
+      SyncPending,
+      SyncDone
+   };
+
+   struct StreamedLine
+   {
+      long ticket;
+      std::string line;
+      bool isMotion;
+      bool keepReply;
+      std::string reply;
+      MM::MMTime sentAt;
+   };
+
+   // Serial I/O.  Before the I/O thread runs (detection, start-up), the
+   // calling thread reads the port itself; afterwards callers only wait
+   // for the I/O thread to signal that it dispatched something.
+   long PushLine(const std::string& command, bool isMotion, bool keepReply);
+   void DrainSubmissions();
+   void MarkTicketDone(long ticket);
+   void SendPendingLines();
+   void ServiceIo();
+   void WakeIoThread();
+   unsigned long GetIoEventCount();
+   void SignalIoEvent();
+   void WaitForIoEvent(unsigned long seenEvents, double timeoutMs);
+   bool TakeReply(long ticket, std::string& answer);
+   void ServiceJob();
+   void DispatchLine(const std::string& line);
+   void HandleBanner(const std::string& line);
+   void HandleAlarm(const std::string& line);
+   bool HandleMessage(const std::string& line);
+   void AbortStream(const char* reason);
+   bool QueueJogSegments();
+   int WaitForBanner(long previousBannerCount, float timeout);
+   int Resync(const double wcoMm[3]);
+   int ParseStatusLine(const std::string& line, const MM::MMTime& when);
+   int ReadSettings();
+   void ApplySettings();
+   void PredictMove(bool moveX, double xUm, bool moveY, double yUm, bool moveZ, double zUm);
+   void QueueSyncDwell();
+   bool IsSyncDwellDone();
+   bool LineFits(size_t length);
    void GetPeripheralInventory();
    std::vector<std::string> peripherals_;
    bool initialized_;
    bool busy_;
   std::string version_;
+   int versionMajor_;
+   int versionMinor_;
+   long bannerCount_;
+   bool unlockRequested_;
+   double startupBannerTimeoutMs_;
+   double startupResetTimeoutMs_;
+   std::string baudRates_;
+   std::string baudRate_;
    MMThreadLock lock_;
    MMThreadLock executeLock_;
    std::string port_;
    bool portAvailable_;
    std::string commandResult_;
-  std::string state_;
-   double MPos[3];
-   double WPos[3];
+   MachineStatus status_;
+   MMThreadLock statusLock_;
+   std::deque<MM::MMTime> statusQueries_;
+   MM::MMTime lastMoveTime_;
+   GrblMoveEncoder moveEncoder_;
+   // set when a line the encoder did not write may have moved the machine
+   std::atomic<bool> moveEncoderStale_;
+   // held from encoding a move to queueing it, and by QueueCommand() for
+   // lines that make the encoder stale, so lines reach the controller in
+   // the order the encoder saw them
+   MMThreadLock moveLock_;
+   bool positionReportPending_;
+   // a move nobody waited for failed; commandedUm_ is taken from the
+   // machine once it has stopped
+   bool moveResyncPending_;
+   PositionHistory history_;
+   std::string positionAt_;
+   MMThreadLock stageLock_;
+   CShapeokoGrblXYStage* xyStage_;
+   ZStage* zStage_;
+   double commandedUm_[3];
+   FocusMap focusMap_;                   // guarded by statusLock_
+   std::vector<FocusPoint> focusPoints_;
+   StatusPoller* poller_;
+
+   SerialIoThread* ioThread_;
+   MpscQueue<StreamedLine> submissions_;
+   // Tickets are numbered and pushed under submitLock_, so the queue holds
+   // them in ticket order, and recorded as outstanding until their line is
+   // answered, cancelled or dropped.  Taken after streamLock_, never
+   // before it.
+   std::mutex submitLock_;
+   std::set<long> outstandingTickets_;
+   std::mutex ioWakeMutex_;
+   std::condition_variable ioWake_;
+   std::atomic<bool> ioWakeRequested_;
+   std::mutex ioEventMutex_;
+   std::condition_variable ioEvent_;
+   unsigned long ioEvents_;
+   std::string rxLine_;
+
+   MMThreadLock streamLock_;
+   std::deque<StreamedLine> pendingLines_;
+   std::deque<StreamedLine> inFlight_;
+   std::map<long, std::string> replies_;
+   long inFlightBytes_;
+   long nextTicket_;                     // guarded by submitLock_
+   bool characterCounting_;
+   long rxBufferSize_;
+   std::string lastStreamError_;
+   // last move rejected in character-counting mode, and whether a MoveTo()
+   // has returned it yet
+   std::string moveError_;
+   bool moveErrorPending_;
+   double answerTimeoutMs_;
+
+   GrblStats stats_;
+
+   GrblSettings settings_;
+   MMThreadLock settingsLock_;
+   MotionModel motionModel_;
+   MM::MMTime predictedIdle_;
+   double completionGuardMs_;
+   bool completionByDwell_;
+   long syncTicket_;
+   SyncState syncState_;
+
+   double initializeMs_;
+   double detectDeviceMs_;
+
+   MMThreadLock jogLock_;
+   double jogVelocity_[2];
+   bool jogging_;
+   bool jogResyncPending_;
+   long jogFirstTicket_;
+   MM::MMTime jogQueuedUntil_;
+   double jogIntervalMs_;
+
+   TileScanSettings tileScan_;
+   std::vector<long> tileTickets_;
+
+   bool sequenceWaitForCycleStart_;
+   double sequenceDwellMs_;
+
+   std::string visitOrderInput_;
+   std::string visitOrderOutput_;
+   bool visitOrderKeepFirst_;
+   double visitOrderResult_[3];   // seconds before, after; ms spent
+
+   // a job line queued and not answered yet
+   struct JobLine
+   {
+      long ticket;
+      long lineNumber;
+      uint64_t endOffset;
+      std::string text;
+   };
+
+   MMThreadLock jobLock_;
+   GrblJobFile jobFile_;
+   JobState jobState_;
+   std::deque<JobLine> jobLines_;
+   bool jobEndQueued_;         // the whole file is queued
+   long jobLineNumber_;
+   uint64_t jobDoneBytes_;
+   std::string jobError_;
+   bool jobResyncPending_;
+   MM::MMTime jobEndedAt_;
+
+   TriggerOutput triggerOutput_;
+   double triggerPulseMs_;
+   double triggerSpindleSpeed_;
 };
 
 
@@ -0,0 +1,67 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          TileScan.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Serpentine (boustrophedon) tile scan planning for the hub.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#include "TileScan.h"
+#include <cmath>
+
+namespace {
+
+// Tile centres along one axis.  Tiles are spread evenly so that the first
+// and last tile touch the edges of the area; the spacing never exceeds the
+// one the overlap asks for.
+void TileCentres(double minUm, double maxUm, double tileUm, double overlapPercent, std::vector<double>& centres)
+{
+   centres.clear();
+   double extent = maxUm - minUm;
+   if (extent <= tileUm)
+   {
+      centres.push_back((minUm + maxUm) / 2.0);
+      return;
+   }
+   double step = tileUm * (1.0 - overlapPercent / 100.0);
+   long n = (long) std::ceil((extent - tileUm) / step - 1e-9) + 1;
+   double spacing = (extent - tileUm) / (n - 1);
+   for (long i = 0; i < n; i++)
+      centres.push_back(minUm + tileUm / 2.0 + i * spacing);
+}
+
+} // namespace
+
+bool PlanTileScan(const TileScanSettings& s, std::vector<TilePosition>& tiles)
+{
+   tiles.clear();
+   if (s.xMaxUm < s.xMinUm || s.yMaxUm < s.yMinUm || s.tileWidthUm <= 0 || s.tileHeightUm <= 0
+         || s.overlapPercent < 0 || s.overlapPercent >= 100)
+      return false;
+
+   std::vector<double> xs, ys;
+   TileCentres(s.xMinUm, s.xMaxUm, s.tileWidthUm, s.overlapPercent, xs);
+   TileCentres(s.yMinUm, s.yMaxUm, s.tileHeightUm, s.overlapPercent, ys);
+
+   // rows run along the axis with more tiles
+   bool rowsAlongX = xs.size() >= ys.size();
+   const std::vector<double>& fast = rowsAlongX ? xs : ys;
+   const std::vector<double>& slow = rowsAlongX ? ys : xs;
+   tiles.reserve(fast.size() * slow.size());
+   for (size_t r = 0; r < slow.size(); r++)
+   {
+      for (size_t k = 0; k < fast.size(); k++)
+      {
+         size_t c = (r % 2 == 0) ? k : fast.size() - 1 - k;
+         TilePosition t;
+         t.xUm = rowsAlongX ? fast[c] : slow[r];
+         t.yUm = rowsAlongX ? slow[r] : fast[c];
+         t.zUm = s.useFocusPlane ? s.z0Um + s.dzdx * t.xUm + s.dzdy * t.yUm : 0.0;
+         t.row = (long) (rowsAlongX ? r : c);
+         t.column = (long) (rowsAlongX ? c : r);
+         tiles.push_back(t);
+      }
+   }
+   return true;
+}
@@ -0,0 +1,45 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          TileScan.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Serpentine (boustrophedon) tile scan planning for the hub.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifndef _TILE_SCAN_H_
+#define _TILE_SCAN_H_
+
+#include <vector>
+
+struct TileScanSettings
+{
+   TileScanSettings() :
+      xMinUm(0.0), xMaxUm(1000.0), yMinUm(0.0), yMaxUm(1000.0),
+      tileWidthUm(500.0), tileHeightUm(500.0), overlapPercent(10.0),
+      useFocusPlane(false), z0Um(0.0), dzdx(0.0), dzdy(0.0),
+      dwellMs(0.0)
+   {}
+
+   double xMinUm, xMaxUm;     // area to cover
+   double yMinUm, yMaxUm;
+   double tileWidthUm;        // field of view
+   double tileHeightUm;
+   double overlapPercent;     // between neighbouring tiles
+   bool useFocusPlane;        // z = z0 + dzdx * x + dzdy * y
+   double z0Um, dzdx, dzdy;
+   double dwellMs;            // pause at each tile
+};
+
+struct TilePosition
+{
+   double xUm, yUm, zUm;
+   long row, column;
+};
+
+// Lays tiles over the area with the requested overlap and orders them in
+// a serpentine along the axis with more tiles, so that the number of row
+// changes is smallest.  Returns false for an empty or inverted area.
+bool PlanTileScan(const TileScanSettings& settings, std::vector<TilePosition>& tiles);
+
+#endif // _TILE_SCAN_H_
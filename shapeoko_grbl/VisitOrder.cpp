@@ -0,0 +1,433 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          VisitOrder.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Visit order optimization for position lists.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#include "VisitOrder.h"
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <limits>
+#include <utility>
+
+namespace {
+
+// candidate neighbours per point for the local search
+const size_t g_neighbours = 10;
+// longest segment Or-opt moves
+const size_t g_orOptLength = 3;
+// smallest gain, in seconds, worth a move
+const double g_minGain = 1e-9;
+
+////////////////////////
+// PathOptimizer
+// Node 0 is the start, node i + 1 is points[i].  tour_ holds the nodes
+// in visiting order with node 0 always first; pos_ is its inverse.
+//////////////////////
+
+class PathOptimizer
+{
+public:
+   PathOptimizer(const MotionModel& model, const double startUm[3], const std::vector<VisitPoint>& points);
+
+   void FindNeighbours();
+   void BuildNearestNeighbourPath();
+   void Improve();
+   void GetOrder(std::vector<size_t>& order) const;
+
+private:
+   double Cost(size_t a, size_t b) const { return model_.MoveSeconds(&mm_[3 * a], &mm_[3 * b]); }
+   // cost of the edge leaving tour position p, 0 at the end of the path
+   double CostAfter(size_t p) const { return p + 1 < n_ ? Cost(tour_[p], tour_[p + 1]) : 0.0; }
+   // Chebyshev distance in minutes at full rate: cheap, and close enough
+   // to the cost to pick candidates
+   double Distance(size_t a, size_t b) const;
+   bool TryTwoOpt(size_t a);
+   bool TryOrOpt(size_t a);
+   void Reverse(size_t first, size_t last);
+   void UpdatePositions(size_t first, size_t last);
+   void Touch(size_t node);
+
+   const MotionModel& model_;
+   size_t n_;
+   std::vector<double> mm_;           // 3 per node
+   std::vector<double> scaled_;       // 3 per node, mm / (mm/min)
+   size_t k_;                         // neighbours per node
+   std::vector<size_t> neighbours_;   // k_ per node, cheapest first
+   std::vector<size_t> tour_;
+   std::vector<size_t> pos_;
+   std::deque<size_t> queue_;
+   std::vector<char> queued_;
+};
+
+PathOptimizer::PathOptimizer(const MotionModel& model, const double startUm[3], const std::vector<VisitPoint>& points) :
+   model_(model),
+   n_(points.size() + 1),
+   mm_(3 * n_),
+   scaled_(3 * n_),
+   k_(std::min(g_neighbours, n_ - 1)),
+   tour_(n_),
+   pos_(n_),
+   queued_(n_, 0)
+{
+   for (int i = 0; i < 3; i++)
+      mm_[i] = startUm[i] / 1000.0;
+   for (size_t p = 0; p < points.size(); p++)
+   {
+      mm_[3 * (p + 1)] = points[p].xUm / 1000.0;
+      mm_[3 * (p + 1) + 1] = points[p].yUm / 1000.0;
+      mm_[3 * (p + 1) + 2] = points[p].zUm / 1000.0;
+   }
+   for (size_t a = 0; a < n_; a++)
+      for (int i = 0; i < 3; i++)
+         scaled_[3 * a + i] = mm_[3 * a + i] / model.GetMaxRate(i);
+}
+
+double PathOptimizer::Distance(size_t a, size_t b) const
+{
+   double d = 0.0;
+   for (int i = 0; i < 3; i++)
+      d = std::max(d, fabs(scaled_[3 * a + i] - scaled_[3 * b + i]));
+   return d;
+}
+
+// Sweeps outwards from each node in the order along the axis the points
+// spread most on; a side is done once the distance along that axis alone
+// exceeds the k-th closest found so far.
+void PathOptimizer::FindNeighbours()
+{
+   neighbours_.assign(n_ * k_, 0);
+   if (k_ == 0)
+      return;
+   int axis = 0;
+   double spread[2];
+   for (int i = 0; i < 2; i++)
+   {
+      double lo = scaled_[i], hi = scaled_[i];
+      for (size_t a = 1; a < n_; a++)
+      {
+         lo = std::min(lo, scaled_[3 * a + i]);
+         hi = std::max(hi, scaled_[3 * a + i]);
+      }
+      spread[i] = hi - lo;
+   }
+   if (spread[1] > spread[0])
+      axis = 1;
+   std::vector<size_t> sorted(n_);
+   for (size_t a = 0; a < n_; a++)
+      sorted[a] = a;
+   std::sort(sorted.begin(), sorted.end(),
+         [this, axis](size_t a, size_t b) { return scaled_[3 * a + axis] < scaled_[3 * b + axis]; });
+
+   std::vector<std::pair<double, size_t> > best;
+   for (size_t s = 0; s < n_; s++)
+   {
+      size_t a = sorted[s];
+      double key = scaled_[3 * a + axis];
+      best.clear();
+      // max-heap of the k closest so far
+      size_t down = s, up = s + 1;
+      bool downDone = (s == 0), upDone = (up >= n_);
+      while (!downDone || !upDone)
+      {
+         for (int side = 0; side < 2; side++)
+         {
+            if (side == 0 ? downDone : upDone)
+               continue;
+            size_t b = (side == 0) ? sorted[--down] : sorted[up++];
+            double along = fabs(scaled_[3 * b + axis] - key);
+            if (best.size() == k_ && along > best.front().first)
+            {
+               if (side == 0)
+                  downDone = true;
+               else
+                  upDone = true;
+               continue;
+            }
+            double d = Distance(a, b);
+            if (best.size() < k_)
+            {
+               best.push_back(std::make_pair(d, b));
+               std::push_heap(best.begin(), best.end());
+            }
+            else if (d < best.front().first)
+            {
+               std::pop_heap(best.begin(), best.end());
+               best.back() = std::make_pair(d, b);
+               std::push_heap(best.begin(), best.end());
+            }
+            if (side == 0 && down == 0)
+               downDone = true;
+            if (side == 1 && up >= n_)
+               upDone = true;
+         }
+      }
+      // the search metric only picks them; the model ranks them
+      for (size_t i = 0; i < best.size(); i++)
+         best[i].first = Cost(a, best[i].second);
+      std::sort(best.begin(), best.end());
+      for (size_t i = 0; i < k_; i++)
+         neighbours_[a * k_ + i] = best[i].second;
+   }
+}
+
+// Goes on to the cheapest neighbour not visited yet; when all of them are,
+// to the closest remaining node by distance
+void PathOptimizer::BuildNearestNeighbourPath()
+{
+   std::vector<char> visited(n_, 0);
+   std::vector<size_t> remaining;
+   std::vector<size_t> slot(n_);
+   for (size_t a = 1; a < n_; a++)
+   {
+      slot[a] = remaining.size();
+      remaining.push_back(a);
+   }
+   size_t current = 0;
+   visited[0] = 1;
+   tour_[0] = 0;
+   for (size_t p = 1; p < n_; p++)
+   {
+      size_t next = n_;
+      for (size_t i = 0; i < k_; i++)
+      {
+         size_t c = neighbours_[current * k_ + i];
+         if (!visited[c])
+         {
+            next = c;
+            break;
+         }
+      }
+      if (next == n_)
+      {
+         double bestDistance = std::numeric_limits<double>::max();
+         for (size_t i = 0; i < remaining.size(); i++)
+         {
+            double d = Distance(current, remaining[i]);
+            if (d < bestDistance)
+            {
+               bestDistance = d;
+               next = remaining[i];
+            }
+         }
+      }
+      visited[next] = 1;
+      // swap-remove from the remaining nodes
+      size_t moved = remaining.back();
+      remaining[slot[next]] = moved;
+      slot[moved] = slot[next];
+      remaining.pop_back();
+      tour_[p] = next;
+      current = next;
+   }
+   UpdatePositions(0, n_ - 1);
+}
+
+void PathOptimizer::Improve()
+{
+   for (size_t p = 0; p < n_; p++)
+      Touch(tour_[p]);
+   while (!queue_.empty())
+   {
+      size_t a = queue_.front();
+      queue_.pop_front();
+      queued_[a] = 0;
+      if (TryTwoOpt(a) || TryOrOpt(a))
+         Touch(a);
+   }
+}
+
+void PathOptimizer::GetOrder(std::vector<size_t>& order) const
+{
+   order.resize(n_ - 1);
+   for (size_t p = 1; p < n_; p++)
+      order[p - 1] = tour_[p] - 1;
+}
+
+// Makes a and each of its neighbours c adjacent by reversing the part of
+// the path between them, from either side of the pair.  With lo, hi the
+// tour positions of the two:
+//    reverse lo+1..hi:  (t[lo],t[lo+1]) (t[hi],t[hi+1]) -> (t[lo],t[hi]) (t[lo+1],t[hi+1])
+//    reverse lo..hi-1:  (t[lo-1],t[lo]) (t[hi-1],t[hi]) -> (t[lo-1],t[hi-1]) (t[lo],t[hi])
+// The edge after the end of the path costs nothing.
+bool PathOptimizer::TryTwoOpt(size_t a)
+{
+   for (size_t i = 0; i < k_; i++)
+   {
+      size_t c = neighbours_[a * k_ + i];
+      size_t lo = std::min(pos_[a], pos_[c]);
+      size_t hi = std::max(pos_[a], pos_[c]);
+      if (hi < lo + 2)
+         continue;
+      double joined = Cost(tour_[lo], tour_[hi]);
+
+      double removed = CostAfter(lo) + CostAfter(hi);
+      double added = joined + (hi + 1 < n_ ? Cost(tour_[lo + 1], tour_[hi + 1]) : 0.0);
+      if (added < removed - g_minGain)
+      {
+         Touch(tour_[lo]);
+         Touch(tour_[lo + 1]);
+         Touch(tour_[hi]);
+         if (hi + 1 < n_)
+            Touch(tour_[hi + 1]);
+         Reverse(lo + 1, hi);
+         return true;
+      }
+
+      if (lo == 0)
+         continue;
+      removed = CostAfter(lo - 1) + CostAfter(hi - 1);
+      added = Cost(tour_[lo - 1], tour_[hi - 1]) + joined;
+      if (added < removed - g_minGain)
+      {
+         Touch(tour_[lo - 1]);
+         Touch(tour_[lo]);
+         Touch(tour_[hi - 1]);
+         Touch(tour_[hi]);
+         Reverse(lo, hi - 1);
+         return true;
+      }
+   }
+   return false;
+}
+
+// Moves the segment of up to three nodes that starts at a, either way
+// round, next to one of the neighbours of its ends
+bool PathOptimizer::TryOrOpt(size_t a)
+{
+   size_t s = pos_[a];
+   if (s == 0)
+      return false;
+   for (size_t length = 1; length <= g_orOptLength && s + length <= n_; length++)
+   {
+      size_t e = s + length - 1;
+      size_t first = tour_[s];
+      size_t last = tour_[e];
+      double removeGain = Cost(tour_[s - 1], first) + CostAfter(e);
+      if (e + 1 < n_)
+         removeGain -= Cost(tour_[s - 1], tour_[e + 1]);
+
+      for (int end = 0; end < 2; end++)
+      {
+         size_t from = (end == 0) ? first : last;
+         for (size_t i = 0; i < k_; i++)
+         {
+            size_t c = neighbours_[from * k_ + i];
+            size_t q = pos_[c];
+            // the two edges at c: (t[q-1], c) and (c, t[q+1])
+            for (int side = 0; side < 2; side++)
+            {
+               if (side == 0 && q == 0)
+                  continue;
+               size_t p = (side == 0) ? q - 1 : q;
+               // inserting into the segment or where it already is
+               if (p + 1 >= s && p <= e)
+                  continue;
+               size_t u = tour_[p];
+               bool atEnd = (p + 1 >= n_);
+               size_t v = atEnd ? 0 : tour_[p + 1];
+               double base = atEnd ? 0.0 : -Cost(u, v);
+               for (int reversed = 0; reversed < 2; reversed++)
+               {
+                  size_t x = reversed ? last : first;
+                  size_t y = reversed ? first : last;
+                  double added = base + Cost(u, x) + (atEnd ? 0.0 : Cost(y, v));
+                  if (added >= removeGain - g_minGain)
+                     continue;
+                  Touch(tour_[s - 1]);
+                  if (e + 1 < n_)
+                     Touch(tour_[e + 1]);
+                  Touch(first);
+                  Touch(last);
+                  Touch(u);
+                  if (!atEnd)
+                     Touch(v);
+                  size_t lo, hi;
+                  if (p < s)
+                  {
+                     // segment goes to p+1..p+length
+                     std::rotate(tour_.begin() + p + 1, tour_.begin() + s, tour_.begin() + e + 1);
+                     lo = p + 1;
+                     hi = e;
+                     if (reversed)
+                        std::reverse(tour_.begin() + p + 1, tour_.begin() + p + 1 + length);
+                  }
+                  else
+                  {
+                     // segment goes to p-length+1..p
+                     std::rotate(tour_.begin() + s, tour_.begin() + e + 1, tour_.begin() + p + 1);
+                     lo = s;
+                     hi = p;
+                     if (reversed)
+                        std::reverse(tour_.begin() + p + 1 - length, tour_.begin() + p + 1);
+                  }
+                  UpdatePositions(lo, hi);
+                  return true;
+               }
+            }
+         }
+      }
+   }
+   return false;
+}
+
+void PathOptimizer::Reverse(size_t first, size_t last)
+{
+   std::reverse(tour_.begin() + first, tour_.begin() + last + 1);
+   UpdatePositions(first, last);
+}
+
+void PathOptimizer::UpdatePositions(size_t first, size_t last)
+{
+   for (size_t p = first; p <= last; p++)
+      pos_[tour_[p]] = p;
+}
+
+void PathOptimizer::Touch(size_t node)
+{
+   if (queued_[node])
+      return;
+   queued_[node] = 1;
+   queue_.push_back(node);
+}
+
+} // namespace
+
+double VisitOrderSeconds(const MotionModel& model, const double startUm[3],
+      const std::vector<VisitPoint>& points, const std::vector<size_t>& order)
+{
+   double seconds = 0.0;
+   double from[3] = { startUm[0] / 1000.0, startUm[1] / 1000.0, startUm[2] / 1000.0 };
+   for (size_t i = 0; i < order.size(); i++)
+   {
+      const VisitPoint& point = points[order[i]];
+      double to[3] = { point.xUm / 1000.0, point.yUm / 1000.0, point.zUm / 1000.0 };
+      seconds += model.MoveSeconds(from, to);
+      for (int k = 0; k < 3; k++)
+         from[k] = to[k];
+   }
+   return seconds;
+}
+
+void OptimizeVisitOrder(const MotionModel& model, const double startUm[3],
+      const std::vector<VisitPoint>& points, std::vector<size_t>& order)
+{
+   std::vector<size_t> given(points.size());
+   for (size_t i = 0; i < given.size(); i++)
+      given[i] = i;
+   order = given;
+   if (points.size() < 2 || !model.IsValid())
+      return;
+
+   PathOptimizer optimizer(model, startUm, points);
+   optimizer.FindNeighbours();
+   optimizer.BuildNearestNeighbourPath();
+   optimizer.Improve();
+   optimizer.GetOrder(order);
+   if (VisitOrderSeconds(model, startUm, points, order) >= VisitOrderSeconds(model, startUm, points, given))
+      order = given;
+}
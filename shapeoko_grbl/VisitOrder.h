@@ -0,0 +1,36 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          VisitOrder.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Orders a list of stage positions for the shortest travel
+//                time the motion model predicts.
+//
+// LICENSE:       This file is distributed under the BSD license.
+
+#ifndef _VISIT_ORDER_H_
+#define _VISIT_ORDER_H_
+
+#include "MotionModel.h"
+#include <vector>
+#include <stddef.h>
+
+struct VisitPoint
+{
+   double xUm, yUm, zUm;
+};
+
+// Seconds of G0 travel from startUm through the points in the given order
+double VisitOrderSeconds(const MotionModel& model, const double startUm[3],
+      const std::vector<VisitPoint>& points, const std::vector<size_t>& order);
+
+// Open path from startUm through all points, start fixed, end free.  A
+// nearest-neighbour path is improved by 2-opt and Or-opt moves (segments
+// of up to three points) until neither finds a gain.  Moves are only
+// tried towards each point's closest neighbours, so the work grows about
+// linearly with the number of points.  The result is never slower than
+// the order the points came in.  Needs a valid model.
+void OptimizeVisitOrder(const MotionModel& model, const double startUm[3],
+      const std::vector<VisitPoint>& points, std::vector<size_t>& order);
+
+#endif // _VISIT_ORDER_H_
@@ -1,5 +1,6 @@
 #include "ShapeokoGrbl.h"
 #include "XYStage.h"
+#include <cmath>
 
 ///////////////////////////////////////////////////////////////////////////////
 // CShapeokoGrblXYStage implementation
@@ -7,14 +8,21 @@
 
 CShapeokoGrblXYStage::CShapeokoGrblXYStage() :
 CXYStageBase<CShapeokoGrblXYStage>(),
-stepSize_um_(0.025),
+stepSizeX_um_(0.025),
+stepSizeY_um_(0.025),
 posX_um_(0.0),
 posY_um_(0.0),
 busy_(false),
 velocity_(10.0), // in micron per second
 initialized_(false),
-lowerLimit_(0.0),
-upperLimit_(20000.0)
+lowerLimitX_(0.0),
+upperLimitX_(20000.0),
+lowerLimitY_(0.0),
+upperLimitY_(20000.0),
+sequenceMaxLength_(1000),
+sequenceTicket_(0),
+sequenceMovesZ_(false),
+sequenceEndZUm_(0.0)
 {
    InitializeDefaultErrorMessages();
 
@@ -54,6 +62,18 @@ int CShapeokoGrblXYStage::Initialize()
    if (initialized_)
       return DEVICE_OK;
 
+   // Step sizes and limits come from the controller's settings, as read
+   // by the hub.  These values are cached, so if they change during a
+   // session, the adapter will need to be re-initialized
+   if (pHub)
+   {
+      stepSizeX_um_ = pHub->GetStepSizeUm(0);
+      stepSizeY_um_ = pHub->GetStepSizeUm(1);
+      pHub->GetTravelLimitsUm(0, lowerLimitX_, upperLimitX_);
+      pHub->GetTravelLimitsUm(1, lowerLimitY_, upperLimitY_);
+      pHub->AttachXYStage(this);
+   }
+
    // set property list
    // -----------------
 
@@ -67,6 +87,13 @@ int CShapeokoGrblXYStage::Initialize()
    if (DEVICE_OK != ret)
       return ret;
 
+   // Sequence length
+   CPropertyAction* pAct = new CPropertyAction(this, &CShapeokoGrblXYStage::OnSequenceMaxLength);
+   ret = CreateIntegerProperty("SequenceMaxLength", sequenceMaxLength_, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+   SetPropertyLimits("SequenceMaxLength", 1, 100000);
+
    ret = UpdateStatus();
    if (ret != DEVICE_OK)
       return ret;
@@ -80,92 +107,191 @@ int CShapeokoGrblXYStage::Shutdown()
 {
    if (initialized_)
    {
+      ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+      if (pHub)
+         pHub->AttachXYStage(0);
       initialized_ = false;
    }
    return DEVICE_OK;
 }
 
+// Answered from the hub's cached status; does not touch the port.
 bool CShapeokoGrblXYStage::Busy()
 {
   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
-  int ret = pHub->GetStatus();
-  if (ret != DEVICE_OK) {
-    LogMessage("Got error from machien when calling busy.");
-    return ret;
-  }
-  std::string state = pHub->GetState();
-  if (state.compare(0, 5, "Idle") == 0) {
-    LogMessage("I am idle");
-    return false;
-  }
-  LogMessage("I am busy");
-  return true;
+  return pHub->IsMotionActive();
 }
 
 int CShapeokoGrblXYStage::SetPositionSteps(long x, long y)
 {
   LogMessage("XYStage: SetPositionSteps");
-  if (Busy())
-    return ERR_STAGE_MOVING;
-  double newPosX = x * stepSize_um_;
-  double newPosY = y * stepSize_um_;
-  double difX = newPosX - posX_um_;
-  double difY = newPosY - posY_um_;
-  double distance = sqrt( (difX * difX) + (difY * difY) );
-  posX_um_ = x * stepSize_um_;
-  posY_um_ = y * stepSize_um_;
-
-  char buff[100];
-  sprintf(buff, "G0 X%f Y%f", posX_um_/1000., posY_um_/1000.);
-  std::string buffAsStdStr = buff;
   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
-  int ret = pHub->SendCommand(buffAsStdStr);
-  if (ret != DEVICE_OK)
-    return ret;
-  ret = pHub->ReceiveResponse(buffAsStdStr);
+  // when streaming, moves queue up behind the current one in the planner
+  if (!pHub->IsCharacterCounting() && Busy())
+    return ERR_STAGE_MOVING;
+  double newPosX = x * stepSizeX_um_;
+  double newPosY = y * stepSizeY_um_;
+  // out-of-range targets are refused by the hub without a round trip
+  int ret = pHub->MoveTo(true, newPosX, true, newPosY, false, 0.0);
   if (ret != DEVICE_OK)
     return ret;
+  posX_um_ = newPosX;
+  posY_um_ = newPosY;
+  // the core hears about the new position from the hub, measured, once
+  // the move is done
 
-  ret = OnXYStagePositionChanged(posX_um_, posY_um_);
-  if (ret != DEVICE_OK)
-    return ret;
-  
   return DEVICE_OK;
 }
 
+// Reports the last position published by the hub's status poller.
 int CShapeokoGrblXYStage::GetPositionSteps(long& x, long& y)
 {
   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
-  int ret = pHub->GetStatus();
-  if (ret != DEVICE_OK) {
-    LogMessage("Got error from machien when calling busy.");
-    return ret;
-  }
   float tx, ty;
   pHub->GetPos(tx, ty);
   tx *= 1000.;
   ty *= 1000.;
-  LogMessage("XYStage: GetPositionSteps");
-  LogMessage(std::to_string(tx));
-  LogMessage(std::to_string(ty));
-  x = (long)(tx / stepSize_um_);
-  y = (long)(ty / stepSize_um_);
-  LogMessage(std::to_string(x));
-  LogMessage(std::to_string(y));
+  x = (long)(tx / stepSizeX_um_);
+  y = (long)(ty / stepSizeY_um_);
   return DEVICE_OK;
 }
 
+// Feed hold plus reset on the controller; returns as soon as the machine
+// has decelerated instead of after the queued moves.
+int CShapeokoGrblXYStage::Stop()
+{
+  ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+  return pHub->StopMotion();
+}
+
+// Velocity in um/s.  Runs as a continuous jog on the controller (Grbl 1.1
+// only); a zero velocity stops it.
+int CShapeokoGrblXYStage::Move(double vx, double vy)
+{
+  ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+  return pHub->SetJogVelocity(vx, vy);
+}
+
+// From the commanded position, not the measured one: when streaming, the
+// stage may still be on its way to the moves queued before this one.
 int CShapeokoGrblXYStage::SetRelativePositionSteps(long x, long y)
 {
   LogMessage("XYStage: SetRelativePositioNSteps");
-   long xSteps, ySteps;
-   GetPositionSteps(xSteps, ySteps);
+   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+   long xSteps = (long) floor(pHub->GetCommandedPositionUm(0) / stepSizeX_um_ + 0.5);
+   long ySteps = (long) floor(pHub->GetCommandedPositionUm(1) / stepSizeY_um_ + 0.5);
 
    return this->SetPositionSteps(xSteps+x, ySteps+y);
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+// Sequencing
+///////////////////////////////////////////////////////////////////////////////
+
+int CShapeokoGrblXYStage::ClearXYStageSequence()
+{
+   sequenceX_.clear();
+   sequenceY_.clear();
+   sequenceLines_.clear();
+   return DEVICE_OK;
+}
+
+int CShapeokoGrblXYStage::AddToXYStageSequence(double positionX, double positionY)
+{
+   if ((long) sequenceX_.size() >= sequenceMaxLength_)
+      return DEVICE_SEQUENCE_TOO_LARGE;
+   sequenceX_.push_back(positionX);
+   sequenceY_.push_back(positionY);
+   return DEVICE_OK;
+}
+
+/*
+ * Translates the sequence into G-code once, so that starting it only has to
+ * queue the lines.
+ */
+int CShapeokoGrblXYStage::SendXYStageSequence()
+{
+   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+   sequenceLines_.clear();
+   std::vector<std::string> waitLines;
+   pHub->GetSequenceWaitLines(waitLines);
+   GrblMoveEncoder encoder = pHub->NewMoveEncoder();
+   std::string line;
+   // Z follows the focus map from where the stage is now
+   double fromUm[3];
+   for (int i = 0; i < 3; i++)
+      fromUm[i] = pHub->GetCommandedPositionUm(i);
+   sequenceMovesZ_ = false;
+   for (size_t i = 0; i < sequenceX_.size(); i++)
+   {
+      bool moveZ = false;
+      double zUm = 0.0;
+      if (pHub->FollowFocusMap(fromUm, true, sequenceX_[i], true, sequenceY_[i], moveZ, zUm))
+         sequenceMovesZ_ = true;
+      int ret = pHub->CheckTargetUm(true, sequenceX_[i], true, sequenceY_[i], moveZ, zUm);
+      if (ret != DEVICE_OK)
+      {
+         sequenceLines_.clear();
+         return ret;
+      }
+      // a repeated point only triggers again.  The lines are streamed all
+      // at once, so each names every axis: one that is rejected must not
+      // leave the points after it short.
+      if (encoder.Encode(true, sequenceX_[i], true, sequenceY_[i], moveZ, zUm, false, line))
+         sequenceLines_.push_back(line);
+      fromUm[0] = sequenceX_[i];
+      fromUm[1] = sequenceY_[i];
+      if (moveZ)
+         fromUm[2] = zUm;
+      pHub->GetTriggerLines(sequenceLines_);
+      // nothing to wait for after the last point
+      if (i + 1 < sequenceX_.size())
+         sequenceLines_.insert(sequenceLines_.end(), waitLines.begin(), waitLines.end());
+   }
+   sequenceEndZUm_ = fromUm[2];
+   return DEVICE_OK;
+}
+
+int CShapeokoGrblXYStage::StartXYStageSequence()
+{
+   if (sequenceLines_.empty())
+      return DEVICE_OK;
+   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+   sequenceTicket_ = pHub->StreamLines(sequenceLines_, true);
+   posX_um_ = sequenceX_.back();
+   posY_um_ = sequenceY_.back();
+   pHub->SetCommandedPositionUm(0, posX_um_);
+   pHub->SetCommandedPositionUm(1, posY_um_);
+   if (sequenceMovesZ_)
+      pHub->SetCommandedPositionUm(2, sequenceEndZUm_);
+   return DEVICE_OK;
+}
+
+int CShapeokoGrblXYStage::StopXYStageSequence()
+{
+   if (sequenceTicket_ == 0)
+      return DEVICE_OK;
+   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+   pHub->CancelQueuedCommands(sequenceTicket_);
+   sequenceTicket_ = 0;
+   // moves already in the controller (or an M0 pause) are flushed as well
+   return pHub->StopMotion();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Action handlers
 ///////////////////////////////////////////////////////////////////////////////
-// none implemented
+
+int CShapeokoGrblXYStage::OnSequenceMaxLength(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(sequenceMaxLength_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(sequenceMaxLength_);
+   }
+   return DEVICE_OK;
+}
@@ -3,6 +3,8 @@
 
 #include "DeviceBase.h"
 #include "DeviceThreads.h"
+#include <string>
+#include <vector>
 
 class CShapeokoGrblXYStage : public CXYStageBase<CShapeokoGrblXYStage>
 {
@@ -24,12 +26,12 @@ public:
     */
 
    // This must be correct or the conversions between steps and Um will go wrong
-   virtual double GetStepSize() {return stepSize_um_;}
+   virtual double GetStepSize() {return stepSizeX_um_;}
    virtual int SetPositionSteps(long x, long y);
    virtual int GetPositionSteps(long& x, long& y);
    virtual int SetRelativePositionSteps(long x, long y);
    virtual int Home() { return DEVICE_OK; }
-   virtual int Stop() { return DEVICE_OK; }
+   virtual int Stop();
 
    /* This sets the 0,0 position of the adapter to the current position.
     * If possible, the stage controller itself should also be set to 0,0
@@ -41,33 +43,55 @@ public:
 
    virtual int GetLimitsUm(double& xMin, double& xMax, double& yMin, double& yMax)
    {
-      xMin = lowerLimit_; xMax = upperLimit_;
-      yMin = lowerLimit_; yMax = upperLimit_;
+      xMin = lowerLimitX_; xMax = upperLimitX_;
+      yMin = lowerLimitY_; yMax = upperLimitY_;
       return DEVICE_OK;
    }
 
    virtual int GetStepLimits(long& /*xMin*/, long& /*xMax*/, long& /*yMin*/, long& /*yMax*/)
    { return DEVICE_UNSUPPORTED_COMMAND; }
-   double GetStepSizeXUm() { return stepSize_um_; }
-   double GetStepSizeYUm() { return stepSize_um_; }
-   int Move(double /*vx*/, double /*vy*/) {return DEVICE_OK;}
+   double GetStepSizeXUm() { return stepSizeX_um_; }
+   double GetStepSizeYUm() { return stepSizeY_um_; }
+   int Move(double vx, double vy);
+   // Called by the hub with the measured position once a move is done
+   int OnMoveCompleted(double xUm, double yUm) { return OnXYStagePositionChanged(xUm, yUm); }
 
-   int IsXYStageSequenceable(bool& isSequenceable) const {isSequenceable = false; return DEVICE_OK;}
+   // Sequences are streamed to the controller as a block of moves; the
+   // hub's SequenceAdvance setting decides what happens between points.
+   int IsXYStageSequenceable(bool& isSequenceable) const {isSequenceable = true; return DEVICE_OK;}
+   int GetXYStageSequenceMaxLength(long& nrEvents) const {nrEvents = sequenceMaxLength_; return DEVICE_OK;}
+   int StartXYStageSequence();
+   int StopXYStageSequence();
+   int ClearXYStageSequence();
+   int AddToXYStageSequence(double positionX, double positionY);
+   int SendXYStageSequence();
 
 
    // action interface
    // ----------------
    int OnPosition(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSequenceMaxLength(MM::PropertyBase* pProp, MM::ActionType eAct);
 
 private:
-   double stepSize_um_;
+   double stepSizeX_um_;
+   double stepSizeY_um_;
    double posX_um_;
    double posY_um_;
    bool busy_;
    double velocity_;
    bool initialized_;
-   double lowerLimit_;
-   double upperLimit_;
+   double lowerLimitX_;
+   double upperLimitX_;
+   double lowerLimitY_;
+   double upperLimitY_;
+
+   long sequenceMaxLength_;
+   std::vector<double> sequenceX_;
+   std::vector<double> sequenceY_;
+   std::vector<std::string> sequenceLines_;
+   long sequenceTicket_;
+   bool sequenceMovesZ_;      // the focus map was on when it was built
+   double sequenceEndZUm_;
 };
 
 #endif // _SHAPEOKO_GRBL_XYSTAGE_H_
@@ -25,7 +25,11 @@ ZStage::ZStage() :
 // http://www.shapeoko.com/wiki/index.php/Zaxis_ACME
 stepSize_um_ (5.),
 	posZ_um_(0.0),
-initialized_ (false)
+initialized_ (false),
+lowerLimit_(-100000.0),
+upperLimit_(100000.0),
+sequenceMaxLength_(1000),
+sequenceTicket_(0)
 {
    InitializeDefaultErrorMessages();
 
@@ -69,7 +73,21 @@ int ZStage::Initialize()
    if (ret != DEVICE_OK)
       return ret;
 
+   // Sequence length
+   pAct = new CPropertyAction(this, &ZStage::OnSequenceMaxLength);
+   ret = CreateProperty("SequenceMaxLength", CDeviceUtils::ConvertToString(sequenceMaxLength_), MM::Integer, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   SetPropertyLimits("SequenceMaxLength", 1, 100000);
+
    // Update lower and upper limits.  These values are cached, so if they change during a session, the adapter will need to be re-initialized
+   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+   if (pHub)
+   {
+      stepSize_um_ = pHub->GetStepSizeUm(2);
+      pHub->GetTravelLimitsUm(2, lowerLimit_, upperLimit_);
+      pHub->AttachZStage(this);
+   }
    ret = UpdateStatus();
    if (ret != DEVICE_OK)
       return ret;
@@ -81,14 +99,22 @@ int ZStage::Initialize()
 
 int ZStage::Shutdown()
 {
+   if (initialized_)
+   {
+      ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+      if (pHub)
+         pHub->AttachZStage(0);
+   }
    initialized_ = false;
 
    return DEVICE_OK;
 }
 
+// Answered from the hub's cached status; does not touch the port.
 bool ZStage::Busy()
 {
-   return false;
+   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+   return pHub->IsMotionActive();
 }
 
 int ZStage::SetPositionUm(double pos)
@@ -101,100 +127,63 @@ int ZStage::SetPositionUm(double pos)
    return DEVICE_OK;
 }
 
+// From the commanded position, as the XY stage's relative moves
+int ZStage::SetRelativePositionUm(double d)
+{
+   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+   return SetPositionUm(pHub->GetCommandedPositionUm(2) + d);
+}
+
+// Reports the last position published by the hub's status poller, so it
+// follows the stage while it moves.
 int ZStage::GetPositionUm(double& pos)
 {
-   long steps;
-   int ret = GetPositionSteps(steps);
-   if (ret != DEVICE_OK)
-      return ret;
-   pos = steps * stepSize_um_;
+   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+   MachineStatus status;
+   pHub->GetMachineStatus(status);
+   pos = status.WPos[2] * 1000.;
 
    return DEVICE_OK;
 }
 
 /*
- * Requests movement to new z postion from the controller.  This function does the actual communication
+ * Requests movement to new z postion from the controller.  Returns as soon
+ * as the controller has accepted the move; Busy() tells when it is done.
  */
 int ZStage::SetPositionSteps(long steps)
 {
   LogMessage("ZStage: SetPositionSteps");
-  //  if (timeOutTimer_ != 0)
-  //  {
-  // LogMessage("ZStage: 1");
-  //     if (!timeOutTimer_->expired(GetCurrentMMTime()))
-  //        return ERR_STAGE_MOVING;
-  //     delete (timeOutTimer_);
-  // LogMessage("ZStage: 2");
-  //  }
-   posZ_um_ = steps * stepSize_um_;
-   
-
-   char buff[100];
-   sprintf(buff, "G0 Z%f", posZ_um_/1000.);
-   LogMessage("ZStage buff:");
-   LogMessage(buff);
-   std::string buffAsStdStr = buff;
-  LogMessage("ZStage: SetPositionSteps get hub");
    ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
-   LogMessage("ZStage: SetPositionSteps got hub");
-   int ret = pHub->SendCommand(buffAsStdStr);
-   LogMessage("ZStage: SetPositionSteps sent command");
-   if (ret != DEVICE_OK)
-      return ret;
-   ret = pHub->ReceiveResponse(buffAsStdStr);
+   // when streaming, moves queue up behind the current one in the planner
+   if (!pHub->IsCharacterCounting() && Busy())
+      return ERR_STAGE_MOVING;
+   double newPosZ = steps * stepSize_um_;
+   int ret = pHub->MoveTo(false, 0.0, false, 0.0, true, newPosZ);
    if (ret != DEVICE_OK)
       return ret;
+   posZ_um_ = newPosZ;
+   // the core hears about the new position from the hub, measured, once
+   // the move is done
 
-     CDeviceUtils::SleepMs(250);
-    ret = pHub->PurgeComPortH();
-    bool done;
-  while(!done) {
-    ret = pHub->PurgeComPortH();
-    
-    int ret = pHub->SendCommand("?", "");
-    if(DEVICE_OK != ret){
-      return ret;
-    }
-    std::string returnString;
-    ret = pHub->ReceiveResponse(returnString);
-    if(DEVICE_OK != ret){
-      return ret;
-    }
-  
-    LogMessage("returnString=" + returnString);
-    std::vector<std::string> tokenInput;
-    char* pEnd;
-    CDeviceUtils::Tokenize(returnString, tokenInput, "<>,:\r\n");
-    //sample: <Idle,MPos:0.000,0.000,0.000,WPos:0.000,0.000,0.000>
-    if(tokenInput.size() != 9)
-      {
-	LogMessage(returnString.c_str());
-	LogMessage("echo error!");
-	return DEVICE_ERR;
-      }
-    if (tokenInput[0] == "Idle")
-      {
-	  LogMessage("got idle");
-	  break;
-      }
-  }
-
-
-   // ret = OnZStagePositionChanged(posZ_um_);
-   
    return DEVICE_OK;
 }
 
-/*
- * Requests current z postion from the controller.  This function does the actual communication
- */
 int ZStage::GetPositionSteps(long& steps)
 {
-  LogMessage("ZStage: GetPositionSteps");
-   steps = (long)(posZ_um_ / stepSize_um_);
+   double pos;
+   int ret = GetPositionUm(pos);
+   if (ret != DEVICE_OK)
+      return ret;
+   steps = (long)(pos / stepSize_um_);
    return DEVICE_OK;
 }
 
+int ZStage::Stop()
+{
+   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+   return pHub->StopMotion();
+}
+
 int ZStage::SetOrigin()
 {
    // const char* cmd ="HPZP0" ;
@@ -209,6 +198,78 @@ int ZStage::SetOrigin()
 
 // TODO(dek): implement GetUpperLimit and GetLowerLimit
 
+///////////////////////////////////////////////////////////////////////////////
+// Sequencing
+///////////////////////////////////////////////////////////////////////////////
+
+int ZStage::ClearStageSequence()
+{
+   sequence_.clear();
+   sequenceLines_.clear();
+   return DEVICE_OK;
+}
+
+int ZStage::AddToStageSequence(double position)
+{
+   if ((long) sequence_.size() >= sequenceMaxLength_)
+      return DEVICE_SEQUENCE_TOO_LARGE;
+   sequence_.push_back(position);
+   return DEVICE_OK;
+}
+
+/*
+ * Translates the planes into G-code once, so that starting the sequence
+ * only has to queue the lines.
+ */
+int ZStage::SendStageSequence()
+{
+   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+   sequenceLines_.clear();
+   std::vector<std::string> waitLines;
+   pHub->GetSequenceWaitLines(waitLines);
+   GrblMoveEncoder encoder = pHub->NewMoveEncoder();
+   std::string line;
+   for (size_t i = 0; i < sequence_.size(); i++)
+   {
+      int ret = pHub->CheckTargetUm(false, 0.0, false, 0.0, true, sequence_[i]);
+      if (ret != DEVICE_OK)
+      {
+         sequenceLines_.clear();
+         return ret;
+      }
+      // a repeated plane only triggers again
+      if (encoder.Encode(false, 0.0, false, 0.0, true, sequence_[i], false, line))
+         sequenceLines_.push_back(line);
+      pHub->GetTriggerLines(sequenceLines_);
+      // nothing to wait for after the last plane
+      if (i + 1 < sequence_.size())
+         sequenceLines_.insert(sequenceLines_.end(), waitLines.begin(), waitLines.end());
+   }
+   return DEVICE_OK;
+}
+
+int ZStage::StartStageSequence()
+{
+   if (sequenceLines_.empty())
+      return DEVICE_OK;
+   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+   sequenceTicket_ = pHub->StreamLines(sequenceLines_, true);
+   posZ_um_ = sequence_.back();
+   pHub->SetCommandedPositionUm(2, posZ_um_);
+   return DEVICE_OK;
+}
+
+int ZStage::StopStageSequence()
+{
+   if (sequenceTicket_ == 0)
+      return DEVICE_OK;
+   ShapeokoGrblHub* pHub = static_cast<ShapeokoGrblHub*>(GetParentHub());
+   pHub->CancelQueuedCommands(sequenceTicket_);
+   sequenceTicket_ = 0;
+   // moves already in the controller (or an M0 pause) are flushed as well
+   return pHub->StopMotion();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Action handlers
 ///////////////////////////////////////////////////////////////////////////////
@@ -237,5 +298,18 @@ int ZStage::OnPosition(MM::PropertyBase* pProp, MM::ActionType eAct)
    return DEVICE_OK;
 }
 
+int ZStage::OnSequenceMaxLength(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(sequenceMaxLength_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(sequenceMaxLength_);
+   }
+   return DEVICE_OK;
+}
+
 
 // TODO(dek): implement OnStageLoad
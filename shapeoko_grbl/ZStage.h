@@ -41,11 +41,13 @@ public:
 
    // Stage API
    virtual int SetPositionUm(double pos);
+   virtual int SetRelativePositionUm(double d);
    virtual int GetPositionUm(double& pos);
    virtual double GetStepSize() const {return stepSize_um_;}
    virtual int SetPositionSteps(long steps) ;
    virtual int GetPositionSteps(long& steps);
    virtual int SetOrigin();
+   virtual int Stop();
    virtual int GetLimits(double& lower, double& upper)
    {
       lower = lowerLimit_;
@@ -54,20 +56,25 @@ public:
    }
 
    bool IsContinuousFocusDrive() const {return false;}
+   // Called by the hub with the measured position once a move is done
+   int OnMoveCompleted(double posUm) { return OnStagePositionChanged(posUm); }
 
    // action interface
    // ----------------
    int OnPosition(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnLoadSample(MM::PropertyBase* pProp, MM::ActionType eAct);
-
-   // Sequence functions (unimplemented)
-   int IsStageSequenceable(bool& isSequenceable) const {isSequenceable = false; return DEVICE_OK;}
-   int GetStageSequenceMaxLength(long& nrEvents) const  {nrEvents = 0; return DEVICE_OK;}
-   int StartStageSequence() {return DEVICE_OK;}
-   int StopStageSequence() {return DEVICE_OK;}
-   int ClearStageSequence() {return DEVICE_OK;}
-   int AddToStageSequence(double /*position*/) {return DEVICE_OK;}
-   int SendStageSequence() {return DEVICE_OK;}
+   int OnSequenceMaxLength(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+   // Sequence functions
+   // Planes are streamed into the controller's planner as one block of
+   // moves; the hub's SequenceAdvance setting decides what happens between them.
+   int IsStageSequenceable(bool& isSequenceable) const {isSequenceable = true; return DEVICE_OK;}
+   int GetStageSequenceMaxLength(long& nrEvents) const  {nrEvents = sequenceMaxLength_; return DEVICE_OK;}
+   int StartStageSequence();
+   int StopStageSequence();
+   int ClearStageSequence();
+   int AddToStageSequence(double position);
+   int SendStageSequence();
 
 private:
    int GetFocusFirmwareVersion();
@@ -82,6 +89,12 @@ private:
    MM::TimeoutMs* timeOutTimer_;
 
    double upperLimit_;
+
+   long sequenceMaxLength_;
+   std::vector<double> sequence_;
+   std::vector<std::string> sequenceLines_;
+   long sequenceTicket_;
+
    typedef enum {
       ZMSF_MOVING = 0x0002, // trajectory is in progress
       ZMSF_SETTLE = 0x0004  // settling after movement